@@ -0,0 +1,94 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifndef INC_JP2A_CELLS_H
+#define INC_JP2A_CELLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The binary output of jp2a --format=cells: the character and colors of
+ * each cell, for programs that draw the output themselves instead of
+ * parsing ANSI codes or HTML.  jp2a-cells turns it back into the text,
+ * ANSI or HTML output jp2a would have printed.
+ *
+ * Each image is one document, and documents follow each other.  All
+ * numbers are little endian.  A document is
+ *
+ *   1. a cells_header,
+ *   2. the palette: palette_size bytes, the characters of --chars, padded
+ *      with zeros to a multiple of 8 bytes,
+ *   3. height rows of width cells each, left to right, top to bottom.
+ *
+ * With CELLS_COLORS a cell is a cells_cell of 8 bytes, so a row can be
+ * copied as it is on a little endian machine; without it, a cell is only
+ * the glyph byte.  With CELLS_RLE each row is a list of runs instead: a
+ * count byte (1 to 255) and the cell repeated that many times.  Runs don't
+ * go past the end of a row.
+ *
+ * The ANSI code of a cell is what jp2a --colors prints before the
+ * character: 0 for none, 1 for bold, 30 to 37 for the foreground or 40 to
+ * 47 for the background with --fill.  fg and bg are the colors jp2a
+ * --html --colors uses; bg is only set with CELLS_FILL.
+ */
+
+#define CELLS_MAGIC   0x4332504a // "JP2C"
+#define CELLS_VERSION 1
+
+// header flags
+#define CELLS_COLORS 1  // cells are cells_cell, not just the glyph
+#define CELLS_FILL   2  // colors are for --fill
+#define CELLS_RLE    4  // rows are run-length encoded
+#define CELLS_BORDER 8  // printed with --border
+#define CELLS_INVERT 16 // made for a dark background
+
+typedef struct cells_header_ {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint32_t width, height;  // in cells
+	uint32_t palette_size;   // 1 to 256
+	uint32_t reserved;
+} cells_header;
+
+typedef struct cells_cell_ {
+	uint8_t glyph; // index in the palette
+	uint8_t ansi;
+	uint8_t fg[3];
+	uint8_t bg[3];
+} cells_cell;
+
+// largest width and height a reader accepts
+#define CELLS_MAX_SIZE 65536
+
+#define CELLS_PALETTE_ROOM(size) (((size_t) (size) + 7) & ~(size_t) 7)
+
+// A parsed document header
+typedef struct cells_doc_ {
+	unsigned flags;
+	unsigned width, height;
+	unsigned palette_size;
+	const unsigned char *palette;
+	const unsigned char *rows; // the first row
+	const unsigned char *end;  // of the data given to cells_parse()
+} cells_doc;
+
+// Writing, for jp2a
+void cells_write_header(FILE *f, const unsigned flags, const unsigned width,
+	const unsigned height, const char *palette);
+
+// Read the header of the document at p, which has size bytes from there
+// on.  Returns zero on success, and nonzero if the header is bad or there
+// can't be enough bytes for its rows.
+int cells_parse(const unsigned char *p, const size_t size, cells_doc *d);
+
+// Read the row at p into width cells, and return where the next row, or
+// the next document, starts.  Returns NULL if the row is cut short or
+// bad.
+const unsigned char* cells_row(const cells_doc *d, const unsigned char *p, cells_cell *row);
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifndef INC_JP2A_DECODER_H
+#define INC_JP2A_DECODER_H
+
+#include <stdio.h>
+#include <setjmp.h>
+
+#include "jpeglib.h"
+
+/*
+ * Image decoders.  A backend reads one image format from a stream and
+ * delivers it one row of 8-bit samples at a time, with one (gray) or three
+ * (RGB) components per pixel, so that no backend needs to hold the whole
+ * image.  The format is recognized by the first byte of the stream.
+ */
+
+typedef struct decoder_ decoder;
+
+// Images can be decoded in several threads at once (see grid.c) when the
+// error handler of decoder_catch() can be kept per thread.
+#if defined(FEAT_THREADS) && defined(__GNUC__)
+#define DECODER_THREADS
+#define DECODER_LOCAL __thread
+#else
+#define DECODER_LOCAL
+#endif
+
+typedef struct backend_ {
+	const char *name;
+	int magic; // first byte of the file
+
+	// Read the header and set width, height and components.
+	// Returns zero on success.
+	int (*open)(decoder *d, FILE *fp);
+
+	// Optional.  The same, for an image in memory, which must be kept
+	// until the decoder is closed.
+	int (*open_mem)(decoder *d, const unsigned char *data, const size_t size);
+
+	// Optional.  Switch to a smaller version of the image, if there is
+	// one that has at least the given width and height.
+	void (*shrink)(decoder *d, const int width, const int height);
+
+	// Optional.  Decode only what is needed for a region w wide at x, y.
+	// Sets width to the width of the rows read from now on, and moves x
+	// and y to where the region starts in the rows still to be read.
+	// Rows below the region are never read, so they aren't decoded.
+	void (*crop)(decoder *d, int *x, int *y, const int w);
+
+	// Read the next row of width * components samples.
+	// Returns zero on success.
+	int (*read_row)(decoder *d, JSAMPLE *row);
+
+	void (*close)(decoder *d);
+} backend;
+
+struct decoder_ {
+	const backend *b;
+	int width, height;
+	int components;
+	int scanline;     // rows read so far
+	int flipx, flipy; // set by backend if rows come out flipped
+	int damaged;      // rows could not be read, and are left black
+	int downscale;    // let shrink scale down even without --quality=fast
+	void *state;      // private to the backend
+};
+
+extern const backend jpeg_backend;
+extern const backend pnm_backend;
+#ifdef FEAT_PNG
+extern const backend png_backend;
+#endif
+
+// Images can be read from an index made by --index (see index.c).
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_SYS_STAT_H) && defined(HAVE_UNISTD_H)
+#define FEAT_INDEX
+extern const backend index_backend;
+#endif
+
+struct image_t;
+
+// decoder.c
+const backend* find_backend(const int magic);
+void decoder_open(decoder *d, FILE *fp);
+void decoder_open_mem(decoder *d, const unsigned char *data, const size_t size);
+void decoder_read_row(decoder *d, JSAMPLE *row);
+jmp_buf* decoder_catch(jmp_buf *env);
+void decoder_fail(const char *format, ...);
+const char* decoder_failure();
+int decoder_damaged();
+
+// crop.c
+int crop_region(const int width, const int height, int *x, int *y, int *w, int *h);
+void decoder_crop(decoder *d, const int x, const int y, const int w, const int h);
+
+// image.c
+void convert(decoder *d, FILE *fout);
+void render(decoder *d, FILE *fout);
+
+// imagebuf.c
+void memory_decoder(decoder *d, const struct image_t *p);
+
+// progress.c
+void progress_row(const decoder *d);
+void progress_clear();
+
+#endif
@@ -4,6 +4,7 @@
  */
 
 #ifndef INC_JP2A_IMAGE_H
+#define INC_JP2A_IMAGE_H
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -22,16 +23,20 @@ typedef struct rgb_t {
 	JSAMPLE r, g, b;
 } rgb_t;
 
+/*
+ * A decoded image in memory, so that it can be converted several times
+ * (see --render).  Rows are stored one after the other, with one (gray)
+ * or three (RGB) samples per pixel, like the rows decoders deliver.
+ */
 typedef struct image_t {
 	int w, h;
-	rgb_t *pixels;
+	int components;
+	JSAMPLE *pixels;
 } image_t;
 
 image_t* image_read(FILE *f);
-image_t* image_new(int width, int height);
+image_t* image_new(int width, int height, int components);
 void image_destroy(image_t *p);
-void image_clear(image_t *p);
-void image_print(const image_t *p, FILE *fout);
 void image_resize(const image_t* restrict s, image_t* restrict d);
 
 #endif
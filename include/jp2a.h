@@ -7,27 +7,149 @@
 
 #include <stdio.h>
 
+// batch.c
+void batch_begin();
+void batch_directory(const char *dir);
+int batch_files_from(const char *list, FILE *fout);
+int batch_skip(const char *path);
+int batch_hint(const char *path);
+void batch_done(const char *path, const int fails);
+int batch_end();
+FILE* batch_create(const char *path, const char *tile);
+
+// compress.c
+#if defined(FEAT_THREADS) && (defined(HAVE_ZLIB_H) || defined(HAVE_ZSTD_H))
+#define FEAT_COMPRESS
+#endif
+FILE* compress_open(FILE *f);
+int compress_close(FILE *p);
+const char* compress_suffix();
+
 // curl.c
 #ifdef FEAT_CURL
 int is_url(const char* s);
 int curl_download(const char* url, const int debug);
 #endif
 
+// exif.c
+int exif_thumbnail(const unsigned char *data, const unsigned size,
+	const unsigned char **thumb, unsigned *length,
+	int *orientation, int *thumb_orientation);
+
+// grid.c
+#ifdef HAVE_OPEN_MEMSTREAM
+#define FEAT_GRID
+void grid_add(const char *path);
+void grid_end(FILE *fout);
+#endif
+
 // html.c
 void print_html_start(const int fontsize, FILE *fout);
 void print_html_end(FILE *fout);
-void print_html_char(FILE *fout, const char ch,
+#define HTML_CHAR_MAX 80
+char* html_char(char *s, const char ch, const int red_fg, const int green_fg, const int blue_fg);
+char* html_char_fill(char *s, const char ch,
 	const int red_fg, const int green_fg, const int blue_fg,
 	const int red_bg, const int green_bg, const int blue_bg);
 void print_html_newline(FILE *fout);
+const char* html_entity(const char ch);
 
 // image.c
-void decompress(FILE *fin, FILE *fout);
+int decompress(FILE *fin, FILE *fout);
+int decompress_mem(const unsigned char *data, const size_t size, FILE *fout);
+void sample_size(int *subx, int *suby);
+
+// index.c
+int index_render(const char *path, const unsigned char *data, const size_t size, FILE *fout);
+int index_file(const char *path);
+
+// jp2a.c
+int render_file(const char *path, FILE *fout);
+int render_input(const char *arg, FILE *fout);
+void save_dimensions();
+void restore_dimensions();
 
 // options.c
 void parse_options(int argc, char** argv);
+void term_fit();
+
+// readahead.c
+#if defined(FEAT_THREADS) && defined(HAVE_FMEMOPEN)
+#define FEAT_READAHEAD
+#endif
+int readahead_hint(const char *path);
+const unsigned char* readahead_take(const char *path, size_t *size);
+void readahead_release();
+void readahead_end();
+
+// render.c
+extern int render_count;
+void render_add(const char *spec);
+void render_outputs(FILE *fp, FILE *fout);
+int render_end();
+
+// output.c
+FILE* output_begin(FILE *fout);
+void output_end(FILE *f, FILE *fout);
+int output_drain();
+void output_finish();
+
+// progress.c
+void progress_start(int argc, char **argv);
+void progress_expect(const int files);
+void progress_file(const char *path);
+void progress_part(const int n, const int count);
+void progress_source(const int width, const int height);
+void progress_output(const long size);
+void progress_done();
+void progress_clear();
+
+// shm.c
+#if defined(HAVE_SHM_OPEN) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_OPEN_MEMSTREAM)
+#define FEAT_SHM
+int shm_frames(FILE *fout);
+#endif
+
+// shapes.c
+#define SHAPE_COLS 2
+#define SHAPE_ROWS 4
+#define SHAPE_CELLS (SHAPE_COLS * SHAPE_ROWS)
+char shape_match(const float *ink);
+
+// timer.c
+double timer_now();
+
+// unicode.c
+void unicode_cell_size(int *cols, int *rows);
+const char* unicode_cell(const int bits);
+
+// strtab.c
+#define HASH_INIT 2166136261UL
+typedef struct strtab_ strtab;
+unsigned long hash_bytes(const void *p, size_t len, unsigned long h);
+strtab* strtab_new();
+void strtab_free(strtab *t);
+const char* strtab_get(const strtab *t, const char *key);
+int strtab_put(strtab *t, const char *key, const char *value);
+size_t strtab_count(const strtab *t);
+void strtab_each(const strtab *t, void (*fn)(const char *key, const char *value, void *arg), void *arg);
+
+// tiles.c
+int tiles_file(const char *path);
 
 // term.c
 int get_termsize(int* width_, int* height_, char** error);
 
+// crop.c
+int crop_parse(const char *spec);
+
+// view.c
+#if defined(HAVE_TERMIOS_H) && defined(HAVE_POLL_H) && defined(HAVE_OPEN_MEMSTREAM)
+#define FEAT_VIEWER
+int view_file(int argc, char **argv);
+#endif
+
+// watch.c
+int watch_files(int argc, char **argv, FILE *fout);
+
 #endif
@@ -29,6 +29,30 @@ extern float redweight, greenweight, blueweight;
 extern float RED[256], GREEN[256], BLUE[256], GRAY[256];
 extern const char *fileout;
 extern int usecolors;
+extern int use_shapes;
+extern int unicode;
+extern int recursive;
+extern int use_thumbnail;
+extern int quality;
+extern int watch;
+extern int streaming;
+extern int interactive;
+extern int partial;
+extern int levels;
+extern const char *shm_name;
+extern const char *output_template;
+extern const char *statefile;
+extern const char *files_from;
+extern const char *journalfile;
+extern int shard_index, shard_count;
+extern int read_ahead;
+extern int grid_cols, grid_rows, grid_captions;
+extern int compression;
+extern int output_format;
+extern int tile_cols, tile_rows;
+extern int make_index;
+extern int progress_rate;
+extern unsigned long options_hash;
 extern int termfit;
 extern int term_width;
 extern int term_height;
@@ -36,5 +60,23 @@ extern int term_height;
 #define TERM_FIT_WIDTH 2
 #define TERM_FIT_HEIGHT 3
 #define TERM_FIT_AUTO 4
+#define UNICODE_HALFBLOCK 1
+#define UNICODE_QUADRANT 2
+#define UNICODE_BRAILLE 3
+#define LEVELS_AUTO 1
+#define LEVELS_EQUALIZE 2
+#define READ_AHEAD_MAX 256
+#define PROGRESS_RATE 4
+#define PROGRESS_RATE_MAX 50
+#define GRID_AUTO -1
+#define COMPRESS_GZIP 1
+#define COMPRESS_ZSTD 2
+#define FORMAT_CELLS 1
+#define FORMAT_CELLS_RLE 2
+#define QUALITY_DEFAULT 0
+#define QUALITY_FAST 1
+#define QUALITY_BEST 2
+#define THUMBNAIL_AUTO 1
+#define THUMBNAIL_ON 2
 
 #endif
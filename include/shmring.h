@@ -0,0 +1,79 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifndef INC_JP2A_SHMRING_H
+#define INC_JP2A_SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A ring buffer of frames in POSIX shared memory, read by jp2a --shm=NAME.
+ * A capture program that already has frames in memory writes them here,
+ * and jp2a converts them in place, without copying them through a pipe.
+ *
+ * The producer creates the object with shm_open(NAME), sizes it to
+ * SHMRING_SIZE(slots, slot_size) bytes and maps it.  It starts with a
+ * shmring_header, followed by the slots.  Each slot is a shmring_slot
+ * followed by slot_size bytes of frame data; slot_size is a multiple of 8.
+ * Fill in the header, with head = 0, before setting magic.
+ *
+ * Frames are numbered from 1, and frame n goes into slot n % slots.  To
+ * write frame n, the producer
+ *
+ *   1. sets the slot's seq to 2n - 1 (odd: being written),
+ *   2. writes format, width, height, size and the data,
+ *   3. sets seq to 2n (even: frame n is complete), and
+ *   4. sets head to n,
+ *
+ * with a memory barrier (e.g. __sync_synchronize()) between the steps.
+ * When there are no more frames, it sets SHMRING_CLOSED in flags.
+ *
+ * The reader takes frame n = head, from the slot whose seq is 2n, and
+ * reads it in place.  If seq is no longer 2n when it's done, the producer
+ * has written over the frame meanwhile, and the reader throws away what
+ * it made of it.  Frames written while the reader is busy are skipped, so
+ * a slow reader always shows the latest frame.
+ */
+
+#define SHMRING_MAGIC   0x6a703261 // "jp2a"
+#define SHMRING_VERSION 1
+
+// frame formats
+#define SHMRING_JPEG 1 // a JPEG file
+#define SHMRING_GRAY 2 // width x height 8-bit samples, rows top to bottom
+#define SHMRING_RGB  3 // the same, with 3 samples per pixel
+
+// header flags
+#define SHMRING_CLOSED 1 // no more frames will be written
+
+typedef struct shmring_header_ {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t slot_size;      // bytes of data after each shmring_slot
+	volatile uint64_t head;  // last complete frame, 0 if none yet
+	volatile uint32_t flags;
+	uint32_t reserved;
+} shmring_header;
+
+typedef struct shmring_slot_ {
+	volatile uint64_t seq;   // 2n when frame n is complete, odd while written
+	uint32_t format;
+	uint32_t width, height;  // for raw frames
+	uint32_t size;           // bytes of data
+	uint64_t reserved;
+} shmring_slot;
+
+#define SHMRING_SIZE(slots, slot_size) \
+	(sizeof(shmring_header) + (size_t) (slots) * (sizeof(shmring_slot) + (slot_size)))
+
+// The slot frame n is written to
+#define SHMRING_SLOT(h, n) ((shmring_slot*) ((char*) (h) + sizeof(shmring_header) + \
+	(size_t) ((n) % (h)->slots) * (sizeof(shmring_slot) + (h)->slot_size)))
+
+#define SHMRING_DATA(slot) ((unsigned char*) (slot) + sizeof(shmring_slot))
+
+#endif
@@ -0,0 +1,687 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STRINGS_H
+#include <strings.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+
+#include "jp2a.h"
+#include "options.h"
+
+// Directory input: every image in a directory is rendered to its own
+// output file, named by --output-template.  With --state, inputs whose
+// size, modification time and render options are unchanged since the
+// last run are skipped.
+//
+// For batch jobs, inputs can also be listed in a file with --files-from.
+// --shard=I/N renders only the inputs whose path hashes to shard I of N,
+// so N machines given the same list share the work.  --journal appends
+// each input to a file when it's done, and skips those already there, so
+// a job that stopped can be started again where it was.
+
+#define BATCH_PATH_MAX 4096
+
+static strtab *state = NULL;
+static strtab *journaled = NULL;
+static FILE *journal = NULL;
+static int batch_used = 0;
+static int rendered = 0;
+static int skipped = 0;
+static int failed = 0;
+static double started = 0.0;
+
+static int is_image_name(const char *name) {
+	const char *ext = strrchr(name, '.');
+
+	return ext != NULL
+		&& (!strcasecmp(ext, ".jpg")
+		 || !strcasecmp(ext, ".jpeg")
+		 || !strcasecmp(ext, ".jpe")
+#ifdef FEAT_PNG
+		 || !strcasecmp(ext, ".png")
+#endif
+		 || !strcasecmp(ext, ".pgm")
+		 || !strcasecmp(ext, ".ppm")
+		 || !strcasecmp(ext, ".pnm"));
+}
+
+// Expand --output-template for the given input path, and tile of it with
+// --tiles.  Returns zero on success and -1 if the result does not fit.
+static int expand_template(const char *path, const char *tile, char *out, const size_t size) {
+	const char *base = strrchr(path, '/');
+	const char *ext;
+	const char *t;
+	char format[16];
+	size_t len = 0;
+
+	base = base? base + 1 : path;
+	ext = strrchr(base, '.');
+
+	if ( !ext || ext == base )
+		ext = base + strlen(base);
+
+	for ( t = output_template; *t; ++t ) {
+		const char *s = t;
+		size_t n = 1;
+
+		if ( *t == '%' && t[1] ) {
+			switch ( *++t ) {
+			case 'd': // directory of input
+				if ( base == path ) { s = "."; n = 1; }
+				else { s = path; n = (size_t) (base - path - 1); }
+				if ( n == 0 ) { s = "/"; n = 1; }
+				break;
+			case 'f': s = base; n = strlen(base); break; // file name
+			case 'n': s = base; n = (size_t) (ext - base); break; // name without extension
+			case 't': s = tile? tile : ""; n = strlen(s); break; // row and column with --tiles
+			case 'e': // output format
+				snprintf(format, sizeof(format), "%s%s", html? "html" : "txt", compress_suffix());
+				s = format; n = strlen(s);
+				break;
+			default: s = t; n = 1; break; // %% and unknown ones
+			}
+		}
+
+		if ( len + n >= size )
+			return -1;
+
+		memcpy(out + len, s, n);
+		len += n;
+	}
+
+	out[len] = 0;
+	return 0;
+}
+
+// Create the directories leading up to the file path.
+static void make_parents(const char *path) {
+	char dir[BATCH_PATH_MAX];
+	char *p;
+
+	strncpy(dir, path, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = 0;
+
+	for ( p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/') ) {
+		*p = 0;
+#ifdef WIN32
+		mkdir(dir);
+#else
+		mkdir(dir, 0777);
+#endif
+		*p = '/';
+	}
+}
+
+static int other_shard(const char *path) {
+	return shard_count && hash_bytes(path, strlen(path), HASH_INIT) % shard_count != (unsigned long) shard_index - 1;
+}
+
+// Returns nonzero if the input is left to another --shard, or is in the
+// --journal from an earlier run.
+int batch_skip(const char *path) {
+	if ( other_shard(path) ) {
+		progress_done();
+		return 1;
+	}
+
+	if ( journaled && strtab_get(journaled, path) ) {
+		if ( verbose ) {
+			progress_clear();
+			fprintf(stderr, "Done before: %s\n", path);
+		}
+		++skipped;
+		progress_done();
+		return 1;
+	}
+
+	return 0;
+}
+
+// Start reading an input that is coming up, if it's a file that will be
+// rendered.  Returns nonzero if no more can be read ahead for now.
+int batch_hint(const char *path) {
+	if ( !strcmp(path, "-") || other_shard(path) ||
+	     (journaled && strtab_get(journaled, path)) )
+		return 0;
+
+#ifdef FEAT_CURL
+	if ( is_url(path) )
+		return 0;
+#endif
+
+	return readahead_hint(path);
+}
+
+// Count an input as rendered or failed, and add it to the journal when
+// its output has been written.
+void batch_done(const char *path, const int fails) {
+	progress_done();
+
+	if ( fails ) {
+		++failed;
+		return;
+	}
+
+	++rendered;
+
+	// a name with a newline would look like two in the journal, so it's
+	// left out, and rendered again if the job is restarted
+	if ( journal && !strchr(path, '\n') ) {
+		output_drain();
+		fflush(NULL);
+
+		if ( fprintf(journal, "%s\n", path) < 0 || fflush(journal) ) {
+			progress_clear();
+			fprintf(stderr, "Could not write journal '%s'\n", journalfile);
+			exit(1);
+		}
+	}
+}
+
+// Put path in s as it's written in the state file, with backslashes,
+// tabs and newlines escaped so that each entry stays one line of fields.
+// Returns nonzero if it doesn't fit.
+static int escape_path(char *s, const size_t size, const char *path) {
+	size_t n = 0;
+
+	for ( ; *path; ++path ) {
+		const char c = *path == '\\'? '\\' : *path == '\t'? 't' : *path == '\n'? 'n' : 0;
+
+		if ( n + (c? 2 : 1) >= size )
+			return -1;
+
+		if ( c ) {
+			s[n++] = '\\';
+			s[n++] = c;
+		} else
+			s[n++] = *path;
+	}
+
+	s[n] = 0;
+	return 0;
+}
+
+static void batch_file(const char *path, const struct stat *st) {
+	char out[BATCH_PATH_MAX];
+	char key[2*BATCH_PATH_MAX], name[2*BATCH_PATH_MAX];
+	char record[2*BATCH_PATH_MAX + 64];
+	struct stat ost;
+	FILE *file, *fout;
+
+	if ( batch_skip(path) )
+		return;
+
+	if ( expand_template(path, NULL, out, sizeof(out)) ) {
+		progress_clear();
+		fprintf(stderr, "Output name for %s is too long\n", path);
+		++failed;
+		progress_done();
+		return;
+	}
+
+	if ( state && (escape_path(key, sizeof(key), path) || escape_path(name, sizeof(name), out)) ) {
+		progress_clear();
+		fprintf(stderr, "Path of %s is too long for the state file\n", path);
+		++failed;
+		progress_done();
+		return;
+	}
+
+	snprintf(record, sizeof(record), "%ld\t%ld\t%08lx\t%s",
+		(long) st->st_mtime, (long) st->st_size, options_hash, name);
+
+	if ( state ) {
+		const char *old = strtab_get(state, key);
+
+		if ( old && !strcmp(old, record) && stat(out, &ost) == 0 ) {
+			if ( verbose ) {
+				progress_clear();
+				fprintf(stderr, "Unchanged: %s\n", path);
+			}
+			++skipped;
+			progress_done();
+			return;
+		}
+	}
+
+	make_parents(out);
+
+	if ( (file = fopen(out, "wb")) == NULL ) {
+		progress_clear();
+		fprintf(stderr, "Could not open '%s' for writing.\n", out);
+		++failed;
+		progress_done();
+		return;
+	}
+
+	fout = compress_open(file);
+
+	if ( render_file(path, fout) ) {
+		batch_done(path, 1);
+		output_drain();
+		compress_close(fout);
+		fclose(file);
+		return;
+	}
+
+	output_drain();
+
+	if ( compress_close(fout) ) {
+		batch_done(path, 1);
+		fclose(file);
+		return;
+	}
+
+	fclose(file);
+	batch_done(path, 0);
+
+	if ( state && strtab_put(state, key, record) ) {
+		progress_clear();
+		fputs("Not enough memory for batch state\n", stderr);
+		exit(1);
+	}
+}
+
+// Create the output file for a tile of an image with --tiles, named by
+// --output-template.  Returns NULL if it can't.
+FILE* batch_create(const char *path, const char *tile) {
+	char out[BATCH_PATH_MAX];
+	FILE *file;
+
+	if ( expand_template(path, tile, out, sizeof(out)) ) {
+		progress_clear();
+		fprintf(stderr, "Output name for %s is too long\n", path);
+		return NULL;
+	}
+
+	make_parents(out);
+
+	if ( (file = fopen(out, "wb")) == NULL ) {
+		progress_clear();
+		fprintf(stderr, "Could not open '%s' for writing.\n", out);
+	}
+
+	return file;
+}
+
+// Put the path of a directory entry in path.  Returns nonzero if it's too
+// long.
+static int join_path(char *path, const char *dir, const char *name) {
+	return snprintf(path, BATCH_PATH_MAX, "%s%s%s", dir,
+		dir[strlen(dir)-1] == '/'? "" : "/", name) >= BATCH_PATH_MAX;
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// Render all images in a directory, and its subdirectories if --recursive
+// is given.  Entries are visited in sorted order, hidden ones are skipped.
+void batch_directory(const char *dir) {
+#ifdef HAVE_DIRENT_H
+	DIR *d;
+	struct dirent *ent;
+	char **names = NULL;
+	size_t count = 0, room = 0, n, ahead = 0;
+	int images = 0;
+
+	if ( !batch_used ) {
+		batch_used = 1;
+		started = timer_now();
+	}
+
+	if ( (d = opendir(dir)) == NULL ) {
+		progress_clear();
+		fprintf(stderr, "Can't open directory %s\n", dir);
+		++failed;
+		return;
+	}
+
+	while ( (ent = readdir(d)) != NULL ) {
+		if ( ent->d_name[0] == '.' )
+			continue;
+
+		if ( count == room ) {
+			char **p;
+			room = room? room*2 : 64;
+
+			if ( (p = (char**) realloc(names, room * sizeof(char*))) == NULL ) {
+				progress_clear();
+				fputs("Not enough memory for directory listing\n", stderr);
+				exit(1);
+			}
+
+			names = p;
+		}
+
+		if ( (names[count] = (char*) malloc(strlen(ent->d_name) + 1)) == NULL ) {
+			progress_clear();
+			fputs("Not enough memory for directory listing\n", stderr);
+			exit(1);
+		}
+
+		strcpy(names[count++], ent->d_name);
+	}
+
+	closedir(d);
+
+	if ( count )
+		qsort(names, count, sizeof(char*), compare_names);
+
+	// images in subdirectories are added when they are read
+	for ( n=0; n < count; ++n )
+		images += is_image_name(names[n]);
+
+	progress_expect(images);
+
+	for ( n=0; n < count; ++n ) {
+		char path[BATCH_PATH_MAX];
+		struct stat st;
+
+		// start reading the images coming up; with --recursive, not past
+		// what may be a subdirectory, since its images come first
+		for ( ahead = ahead > n? ahead : n; read_ahead && ahead < count; ++ahead ) {
+			if ( !is_image_name(names[ahead]) ) {
+				if ( recursive )
+					break;
+			}
+			else if ( join_path(path, dir, names[ahead]) || batch_hint(path) )
+				break;
+		}
+
+		if ( join_path(path, dir, names[n]) ) {
+			progress_clear();
+			fprintf(stderr, "Path too long in %s\n", dir);
+			++failed;
+		}
+		else if ( stat(path, &st) == 0 ) {
+			if ( S_ISDIR(st.st_mode) ) {
+				if ( recursive ) batch_directory(path);
+			}
+			else if ( S_ISREG(st.st_mode) && is_image_name(names[n]) ) {
+#ifdef FEAT_GRID
+				if ( grid_cols ) {
+					if ( !batch_skip(path) )
+						grid_add(path);
+				} else
+#endif
+				if ( tile_cols || make_index ) {
+					if ( !batch_skip(path) )
+						batch_done(path, tile_cols? tiles_file(path) : index_file(path));
+				} else
+					batch_file(path, &st);
+			}
+		}
+
+		free(names[n]);
+	}
+
+	free(names);
+#else
+	progress_clear();
+	fprintf(stderr, "Can't read directory %s, not supported on this system\n", dir);
+	++failed;
+#endif
+}
+
+// Read a name ending with sep, or with a newline or NUL if sep is EOF.
+// Returns the name, or NULL at the end of f.  *end is set to the character
+// that ended it.
+static char* read_name(FILE *f, const int sep, char **buf, size_t *room, int *end) {
+	size_t len = 0;
+	int c;
+
+	while ( (c = getc(f)) != EOF && c != sep && (sep != EOF || (c != '\n' && c != 0)) ) {
+		if ( len + 1 >= *room ) {
+			char *p;
+			*room = *room? *room * 2 : 256;
+
+			if ( (p = (char*) realloc(*buf, *room)) == NULL ) {
+				progress_clear();
+				fputs("Not enough memory for file name\n", stderr);
+				exit(1);
+			}
+
+			*buf = p;
+		}
+
+		(*buf)[len++] = (char) c;
+	}
+
+	if ( c == EOF && len == 0 )
+		return NULL;
+
+	if ( *buf == NULL && (*buf = (char*) malloc(*room = 1)) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory for file name\n", stderr);
+		exit(1);
+	}
+
+	(*buf)[len] = 0;
+	*end = c;
+	return *buf;
+}
+
+// Read the journal, and open it for adding to.  Only names ending with a
+// newline are read, since the last one may have been cut off.
+static void journal_begin() {
+	char *name = NULL;
+	size_t room = 0;
+	int end = 0;
+	FILE *f;
+
+	if ( (journaled = strtab_new()) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory for journal\n", stderr);
+		exit(1);
+	}
+
+	if ( (f = fopen(journalfile, "rb")) != NULL ) {
+		while ( read_name(f, '\n', &name, &room, &end) != NULL ) {
+			if ( end == '\n' && *name && strtab_put(journaled, name, "") ) {
+				progress_clear();
+				fputs("Not enough memory for journal\n", stderr);
+				exit(1);
+			}
+		}
+
+		fclose(f);
+	}
+
+	free(name);
+
+	if ( (journal = fopen(journalfile, "ab")) == NULL ) {
+		progress_clear();
+		fprintf(stderr, "Could not open '%s' for writing.\n", journalfile);
+		exit(1);
+	}
+
+	// start on a new line after a name that was cut off
+	if ( end != '\n' && end != 0 )
+		fputc('\n', journal);
+
+	if ( verbose ) {
+		progress_clear();
+		fprintf(stderr, "Journal: %lu inputs done before\n",
+			(unsigned long) strtab_count(journaled));
+	}
+}
+
+// Render each input listed in a file, or standard input if it's "-".
+// Names end with a newline, or with NUL if the first one does, as with
+// find -print0.  With --read-ahead, the next names are read before the
+// current one is rendered.  Returns what render_input() returns.
+int batch_files_from(const char *list, FILE *fout) {
+	FILE *f = strcmp(list, "-")? fopen(list, "rb") : stdin;
+	const int window = read_ahead + 1;
+	char **names = (char**) calloc(window, sizeof(char*));
+	size_t *rooms = (size_t*) calloc(window, sizeof(size_t));
+	int first = 0, count = 0, sep = EOF, end, more = 1, fails = 0, n;
+
+	if ( names == NULL || rooms == NULL ) {
+		progress_clear();
+		fputs("Not enough memory for file names\n", stderr);
+		exit(1);
+	}
+
+	if ( f == NULL ) {
+		progress_clear();
+		fprintf(stderr, "Can't open %s\n", list);
+		free(names);
+		free(rooms);
+		return 1;
+	}
+
+	while ( count > 0 || more ) {
+		while ( more && count < window ) {
+			const int last = (first + count) % window;
+
+			if ( read_name(f, sep, &names[last], &rooms[last], &end) == NULL ) {
+				more = 0;
+				break;
+			}
+
+			if ( sep == EOF && end != EOF )
+				sep = end;
+
+			if ( *names[last] ) {
+				batch_hint(names[last]);
+				++count;
+			}
+		}
+
+		if ( count > 0 ) {
+			fails += render_input(names[first], fout);
+			first = (first + 1) % window;
+			--count;
+		}
+	}
+
+	for ( n=0; n < window; ++n )
+		free(names[n]);
+
+	free(names);
+	free(rooms);
+
+	if ( f != stdin )
+		fclose(f);
+
+	return fails;
+}
+
+// Start the journal, and read the --state file, if any.  Each line of the
+// state file is a source path and the record it was last rendered with,
+// separated by a tab.  The paths are escaped by escape_path().
+void batch_begin() {
+	char line[4*BATCH_PATH_MAX + 64];
+	FILE *f;
+
+	if ( files_from || shard_count || journalfile ) {
+		batch_used = 1;
+		started = timer_now();
+	}
+
+	if ( journalfile )
+		journal_begin();
+
+	if ( statefile == NULL )
+		return;
+
+	if ( (state = strtab_new()) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory for batch state\n", stderr);
+		exit(1);
+	}
+
+	if ( (f = fopen(statefile, "rb")) == NULL )
+		return; // first run
+
+	while ( fgets(line, sizeof(line), f) ) {
+		char *tab;
+
+		line[strcspn(line, "\n")] = 0;
+
+		if ( (tab = strchr(line, '\t')) == NULL )
+			continue;
+
+		*tab = 0;
+		strtab_put(state, line, tab + 1);
+	}
+
+	fclose(f);
+}
+
+static void write_record(const char *key, const char *value, void *arg) {
+	fprintf((FILE*) arg, "%s\t%s\n", key, value);
+}
+
+// Write back the state file and report what was done.  Returns the
+// number of inputs that failed.
+int batch_end() {
+	if ( state ) {
+		char tmp[BATCH_PATH_MAX];
+		FILE *f;
+
+		snprintf(tmp, sizeof(tmp), "%s.tmp", statefile);
+
+		if ( (f = fopen(tmp, "wb")) == NULL ) {
+			progress_clear();
+			fprintf(stderr, "Could not open '%s' for writing.\n", tmp);
+			++failed;
+		} else {
+			strtab_each(state, write_record, f);
+
+			if ( fclose(f) || rename(tmp, statefile) ) {
+				progress_clear();
+				fprintf(stderr, "Could not write state file '%s'\n", statefile);
+				++failed;
+			}
+		}
+
+		strtab_free(state);
+		state = NULL;
+	}
+
+	if ( journal ) {
+		fclose(journal);
+		strtab_free(journaled);
+		journal = NULL;
+		journaled = NULL;
+	}
+
+	progress_clear();
+
+	if ( batch_used )
+		fprintf(stderr, "Rendered %d, skipped %d, failed %d files in %.2f seconds\n",
+			rendered, skipped, failed, timer_now() - started);
+
+	return failed;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cells.h"
+
+// Reading and writing the documents of --format=cells, see cells.h.  The
+// reader is used by jp2a-cells, and can be copied into other programs
+// with cells.h.
+
+static void put_u16(unsigned char *p, const unsigned v) {
+	p[0] = (unsigned char) v;
+	p[1] = (unsigned char) (v >> 8);
+}
+
+static void put_u32(unsigned char *p, const unsigned long v) {
+	put_u16(p, (unsigned) (v & 0xffff));
+	put_u16(p + 2, (unsigned) (v >> 16));
+}
+
+static unsigned get_u16(const unsigned char *p) {
+	return p[0] | (unsigned) p[1] << 8;
+}
+
+static unsigned long get_u32(const unsigned char *p) {
+	return get_u16(p) | (unsigned long) get_u16(p + 2) << 16;
+}
+
+void cells_write_header(FILE *f, const unsigned flags, const unsigned width,
+	const unsigned height, const char *palette)
+{
+	unsigned char h[sizeof(cells_header)];
+	const size_t size = strlen(palette);
+	static const char zeros[8] = { 0 };
+
+	put_u32(h, CELLS_MAGIC);
+	put_u16(h + 4, CELLS_VERSION);
+	put_u16(h + 6, flags);
+	put_u32(h + 8, width);
+	put_u32(h + 12, height);
+	put_u32(h + 16, size);
+	put_u32(h + 20, 0);
+
+	fwrite(h, 1, sizeof(h), f);
+	fwrite(palette, 1, size, f);
+	fwrite(zeros, 1, CELLS_PALETTE_ROOM(size) - size, f);
+}
+
+int cells_parse(const unsigned char *p, const size_t size, cells_doc *d) {
+	size_t room, cell, row;
+
+	if ( size < sizeof(cells_header) || get_u32(p) != CELLS_MAGIC || get_u16(p + 4) != CELLS_VERSION )
+		return -1;
+
+	d->flags = get_u16(p + 6);
+	d->width = get_u32(p + 8);
+	d->height = get_u32(p + 12);
+	d->palette_size = get_u32(p + 16);
+	d->end = p + size;
+
+	if ( d->palette_size < 1 || d->palette_size > 256 ||
+	     (d->width == 0 && d->height != 0) ||
+	     d->width > CELLS_MAX_SIZE || d->height > CELLS_MAX_SIZE )
+		return -1;
+
+	room = CELLS_PALETTE_ROOM(d->palette_size);
+
+	if ( size - sizeof(cells_header) < room )
+		return -1;
+
+	d->palette = p + sizeof(cells_header);
+	d->rows = d->palette + room;
+
+	// the fewest bytes a row can take: a run for each 255 cells with
+	// CELLS_RLE, or all of its cells
+	cell = d->flags & CELLS_COLORS? sizeof(cells_cell) : 1;
+	row = d->flags & CELLS_RLE? (d->width + 254) / 255 * (1 + cell) : d->width * cell;
+
+	if ( d->height && (size_t) (d->end - d->rows) / d->height < row )
+		return -1;
+
+	return 0;
+}
+
+const unsigned char* cells_row(const cells_doc *d, const unsigned char *p, cells_cell *row) {
+	const size_t size = d->flags & CELLS_COLORS? sizeof(cells_cell) : 1;
+	const size_t left = (size_t) (d->end - p);
+	unsigned x = 0;
+
+	if ( !(d->flags & CELLS_RLE) ) {
+		if ( left / size < d->width )
+			return NULL;
+
+		if ( size != 1 ) {
+			memcpy(row, p, (size_t) d->width * size);
+		} else {
+			memset(row, 0, d->width * sizeof(cells_cell));
+
+			for ( x=0; x < d->width; ++x )
+				row[x].glyph = p[x];
+		}
+
+		p += (size_t) d->width * size;
+	} else {
+		while ( x < d->width ) {
+			cells_cell c;
+			unsigned n;
+
+			if ( (size_t) (d->end - p) < 1 + size || p[0] == 0 || p[0] > d->width - x )
+				return NULL;
+
+			memset(&c, 0, sizeof(c));
+
+			if ( size != 1 )
+				memcpy(&c, p + 1, size);
+			else
+				c.glyph = p[1];
+
+			for ( n = p[0]; n > 0; --n )
+				row[x++] = c;
+
+			p += 1 + size;
+		}
+	}
+
+	for ( x=0; x < d->width; ++x )
+		if ( row[x].glyph >= d->palette_size )
+			return NULL;
+
+	return p;
+}
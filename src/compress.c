@@ -0,0 +1,519 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include "jp2a.h"
+#include "options.h"
+
+#ifdef FEAT_COMPRESS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+/*
+ * --compress=gzip|zstd compresses the output while it is written.  What
+ * is printed to the stream compress_open() returns goes through a pipe
+ * to a thread that cuts it into blocks, as soon as a block is full or
+ * nothing more is waiting in the pipe.  The blocks are compressed by up
+ * to COMPRESS_THREADS threads at once, like pigz does, and written in
+ * order by the thread that finishes the next one.
+ *
+ * Both make a standard stream.  For gzip, the blocks are parts of one
+ * deflate stream: each is primed with the last 32 KB of what came before
+ * and ends on a byte boundary with a sync flush, and their CRCs are
+ * combined for the trailer.  For zstd, each block is a frame, and a zstd
+ * stream may have any number of them.
+ */
+
+#define BLOCK_SIZE (128 * 1024)
+#define DICT_SIZE 32768
+#define BLOCKS 16 // in the pipeline of each stream
+#define COMPRESS_THREADS 8
+
+#define ZSTD_LEVEL 3
+
+enum { BLOCK_FREE, BLOCK_FILLED, BLOCK_WORKING, BLOCK_DONE };
+
+typedef struct block_ {
+	int state;
+	int last;
+	unsigned char *in; // the dictionary, then the data
+	size_t dict, size;
+	unsigned char *out;
+	size_t out_size, out_room;
+	unsigned long crc;
+} block;
+
+typedef struct zpipe_ {
+	FILE *in;  // what is printed to
+	int rfd;   // the other end of the pipe
+	int fd;    // where the compressed stream goes
+	int failed;
+	block blocks[BLOCKS];
+	unsigned long filled, taken, written; // blocks, in sequence
+	int eof, writing, workers, idle;
+	unsigned long crc, total; // for the gzip trailer
+	unsigned char dict[DICT_SIZE];
+	size_t dict_size;
+	pthread_t feeder;
+	pthread_t threads[COMPRESS_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct zpipe_ *next;
+} zpipe;
+
+static zpipe *open_pipes = NULL;
+static int max_threads = 0;
+
+static const char *suffixes[] = { "", ".gz", ".zst" };
+static const unsigned char gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+
+const char* compress_suffix() {
+	return suffixes[compression];
+}
+
+// Write all of p to fd, returns zero on success.
+static int write_all(const int fd, const unsigned char *p, size_t size) {
+	while ( size > 0 ) {
+		ssize_t len = write(fd, p, size);
+
+		if ( len < 0 ) {
+			if ( errno == EINTR ) continue;
+			return -1;
+		}
+
+		p += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+static void write_failed(zpipe *z) {
+	if ( !z->failed ) {
+		progress_clear();
+		perror("Could not write compressed output");
+	}
+	z->failed = 1;
+}
+
+static void* grow(void *p, size_t *room, const size_t need) {
+	if ( need <= *room )
+		return p;
+
+	*room = need > 2 * *room? need : 2 * *room;
+
+	if ( (p = realloc(p, *room)) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory to compress output\n", stderr);
+		exit(1);
+	}
+
+	return p;
+}
+
+#ifdef HAVE_ZLIB_H
+static void deflate_block(z_stream *s, block *b) {
+	const int flush = b->last? Z_FINISH : Z_SYNC_FLUSH;
+	int ret;
+
+	deflateReset(s);
+
+	if ( b->dict )
+		deflateSetDictionary(s, b->in, b->dict);
+
+	s->next_in = b->in + b->dict;
+	s->avail_in = b->size;
+	b->out_size = 0;
+	b->out = (unsigned char*) grow(b->out, &b->out_room, deflateBound(s, b->size) + 16);
+
+	do {
+		if ( b->out_size == b->out_room )
+			b->out = (unsigned char*) grow(b->out, &b->out_room, b->out_room + BLOCK_SIZE);
+
+		s->next_out = b->out + b->out_size;
+		s->avail_out = b->out_room - b->out_size;
+		ret = deflate(s, flush);
+		b->out_size = b->out_room - s->avail_out;
+	} while ( s->avail_out == 0 || (flush == Z_FINISH && ret == Z_OK) );
+
+	b->crc = crc32(0L, b->in + b->dict, b->size);
+}
+#endif
+
+#ifdef HAVE_ZSTD_H
+static void zstd_block(ZSTD_CCtx *c, block *b) {
+	size_t size;
+
+	b->out_size = 0;
+
+	if ( b->size == 0 )
+		return;
+
+	b->out = (unsigned char*) grow(b->out, &b->out_room, ZSTD_compressBound(b->size));
+	size = ZSTD_compressCCtx(c, b->out, b->out_room, b->in + b->dict, b->size, ZSTD_LEVEL);
+
+	if ( ZSTD_isError(size) ) {
+		progress_clear();
+		fprintf(stderr, "Could not compress output: %s\n", ZSTD_getErrorName(size));
+		exit(1);
+	}
+
+	b->out_size = size;
+}
+#endif
+
+// Write the finished blocks that are next in order.  Called and returns
+// with the lock held.
+static void write_blocks(zpipe *z) {
+	while ( !z->writing && z->written < z->taken ) {
+		block *b = &z->blocks[z->written % BLOCKS];
+
+		if ( b->state != BLOCK_DONE )
+			break;
+
+		z->writing = 1;
+		pthread_mutex_unlock(&z->lock);
+
+		// nothing at all is written for no output
+		if ( z->total == 0 && b->size > 0 && compression == COMPRESS_GZIP &&
+		     write_all(z->fd, gzip_header, sizeof(gzip_header)) )
+			write_failed(z);
+
+		if ( !z->failed && (z->total > 0 || b->size > 0) &&
+		     write_all(z->fd, b->out, b->out_size) )
+			write_failed(z);
+
+#ifdef HAVE_ZLIB_H
+		if ( compression == COMPRESS_GZIP )
+			z->crc = crc32_combine(z->crc, b->crc, b->size);
+#endif
+		z->total += b->size;
+
+		pthread_mutex_lock(&z->lock);
+		b->state = BLOCK_FREE;
+		++z->written;
+		z->writing = 0;
+		pthread_cond_broadcast(&z->changed);
+	}
+}
+
+static void* compress_thread(void *arg) {
+	zpipe *z = (zpipe*) arg;
+#ifdef HAVE_ZLIB_H
+	z_stream s;
+#endif
+#ifdef HAVE_ZSTD_H
+	ZSTD_CCtx *c = NULL;
+#endif
+
+#ifdef HAVE_ZLIB_H
+	if ( compression == COMPRESS_GZIP ) {
+		memset(&s, 0, sizeof(s));
+
+		if ( deflateInit2(&s, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK ) {
+			progress_clear();
+			fputs("Could not start compressing output\n", stderr);
+			exit(1);
+		}
+	}
+#endif
+
+#ifdef HAVE_ZSTD_H
+	if ( compression == COMPRESS_ZSTD && (c = ZSTD_createCCtx()) == NULL ) {
+		progress_clear();
+		fputs("Could not start compressing output\n", stderr);
+		exit(1);
+	}
+#endif
+
+	pthread_mutex_lock(&z->lock);
+
+	for ( ;; ) {
+		block *b;
+
+		++z->idle;
+
+		while ( z->taken == z->filled && !z->eof )
+			pthread_cond_wait(&z->changed, &z->lock);
+
+		--z->idle;
+
+		if ( z->taken == z->filled )
+			break;
+
+		b = &z->blocks[z->taken++ % BLOCKS];
+		b->state = BLOCK_WORKING;
+		pthread_mutex_unlock(&z->lock);
+
+#ifdef HAVE_ZLIB_H
+		if ( compression == COMPRESS_GZIP )
+			deflate_block(&s, b);
+#endif
+#ifdef HAVE_ZSTD_H
+		if ( compression == COMPRESS_ZSTD )
+			zstd_block(c, b);
+#endif
+
+		pthread_mutex_lock(&z->lock);
+		b->state = BLOCK_DONE;
+		write_blocks(z);
+	}
+
+	pthread_mutex_unlock(&z->lock);
+
+#ifdef HAVE_ZLIB_H
+	if ( compression == COMPRESS_GZIP )
+		deflateEnd(&s);
+#endif
+#ifdef HAVE_ZSTD_H
+	ZSTD_freeCCtx(c);
+#endif
+
+	return arg;
+}
+
+// Returns nonzero if more output is waiting in the pipe.  A block is
+// compressed when it's full or the output stops for now, so what has
+// been printed is not held back.
+static int more_waiting(const int fd) {
+#ifdef HAVE_POLL_H
+	struct pollfd p;
+
+	p.fd = fd;
+	p.events = POLLIN;
+	return poll(&p, 1, 0) > 0;
+#else
+	return 1;
+#endif
+}
+
+// Cut what comes through the pipe into blocks, until it is closed.
+static void* feeder_thread(void *arg) {
+	zpipe *z = (zpipe*) arg;
+	unsigned long seq;
+
+	for ( seq=0; ; ++seq ) {
+		block *b = &z->blocks[seq % BLOCKS];
+		int last = 0;
+
+		pthread_mutex_lock(&z->lock);
+
+		while ( b->state != BLOCK_FREE )
+			pthread_cond_wait(&z->changed, &z->lock);
+
+		pthread_mutex_unlock(&z->lock);
+
+		if ( b->in == NULL && (b->in = (unsigned char*) malloc(DICT_SIZE + BLOCK_SIZE)) == NULL ) {
+			progress_clear();
+			fputs("Not enough memory to compress output\n", stderr);
+			exit(1);
+		}
+
+		// a zstd frame stands alone
+		b->dict = compression == COMPRESS_GZIP? z->dict_size : 0;
+		memcpy(b->in, z->dict, b->dict);
+		b->size = 0;
+
+		while ( b->size < BLOCK_SIZE ) {
+			ssize_t len;
+
+			if ( b->size > 0 && !more_waiting(z->rfd) )
+				break;
+
+			len = read(z->rfd, b->in + b->dict + b->size, BLOCK_SIZE - b->size);
+
+			if ( len < 0 && errno == EINTR )
+				continue;
+
+			if ( len <= 0 ) {
+				last = 1;
+				break;
+			}
+
+			b->size += len;
+		}
+
+		// the dictionary of the next block is what this one ends with
+		z->dict_size = b->dict + b->size < DICT_SIZE? b->dict + b->size : DICT_SIZE;
+		memmove(z->dict, b->in + b->dict + b->size - z->dict_size, z->dict_size);
+
+		pthread_mutex_lock(&z->lock);
+
+		b->last = last;
+		b->state = BLOCK_FILLED;
+		++z->filled;
+		z->eof = last;
+
+		// start another thread if this block would have to wait
+		if ( z->idle == 0 && z->workers < max_threads &&
+		     !pthread_create(&z->threads[z->workers], NULL, compress_thread, z) )
+			++z->workers;
+
+		if ( z->workers == 0 ) {
+			progress_clear();
+			fputs("Could not start compressing output\n", stderr);
+			exit(1);
+		}
+
+		pthread_cond_broadcast(&z->changed);
+		pthread_mutex_unlock(&z->lock);
+
+		if ( last )
+			break;
+	}
+
+	return arg;
+}
+
+static void compress_end() {
+	while ( open_pipes != NULL )
+		compress_close(open_pipes->in);
+}
+
+// Return a stream that writes what is printed to it compressed to f, or
+// f itself without --compress.
+FILE* compress_open(FILE *f) {
+	int fds[2];
+	zpipe *z;
+
+	if ( !compression )
+		return f;
+
+	if ( open_pipes == NULL && !max_threads ) {
+		max_threads = COMPRESS_THREADS;
+#ifdef _SC_NPROCESSORS_ONLN
+		max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		if ( max_threads > COMPRESS_THREADS ) max_threads = COMPRESS_THREADS;
+		if ( max_threads < 1 ) max_threads = 1;
+#endif
+		atexit(compress_end);
+	}
+
+	if ( (z = (zpipe*) calloc(1, sizeof(zpipe))) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory to compress output\n", stderr);
+		exit(1);
+	}
+
+	fflush(f);
+
+	if ( pipe(fds) || (z->in = fdopen(fds[1], "wb")) == NULL ) {
+		progress_clear();
+		fputs("Could not create pipe to compress output\n", stderr);
+		exit(1);
+	}
+
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	z->rfd = fds[0];
+	z->fd = fileno(f);
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->changed, NULL);
+
+	if ( pthread_create(&z->feeder, NULL, feeder_thread, z) ) {
+		progress_clear();
+		fputs("Could not start compressing output\n", stderr);
+		exit(1);
+	}
+
+	z->next = open_pipes;
+	open_pipes = z;
+	return z->in;
+}
+
+// Finish the compressed stream that p writes to.  Returns nonzero if it
+// could not be written.
+int compress_close(FILE *p) {
+	zpipe **zp, *z;
+	int n, failed;
+
+	for ( zp = &open_pipes; *zp != NULL && (*zp)->in != p; zp = &(*zp)->next )
+		;
+
+	if ( (z = *zp) == NULL )
+		return 0;
+
+	*zp = z->next;
+
+	fclose(z->in);
+	pthread_join(z->feeder, NULL);
+
+	for ( n=0; n < z->workers; ++n )
+		pthread_join(z->threads[n], NULL);
+
+	if ( compression == COMPRESS_GZIP && z->total > 0 && !z->failed ) {
+		unsigned char trailer[8];
+
+		for ( n=0; n < 4; ++n ) {
+			trailer[n] = (unsigned char) (z->crc >> (8*n));
+			trailer[4 + n] = (unsigned char) (z->total >> (8*n));
+		}
+
+		if ( write_all(z->fd, trailer, sizeof(trailer)) )
+			write_failed(z);
+	}
+
+	for ( n=0; n < BLOCKS; ++n ) {
+		free(z->blocks[n].in);
+		free(z->blocks[n].out);
+	}
+
+	close(z->rfd);
+	pthread_mutex_destroy(&z->lock);
+	pthread_cond_destroy(&z->changed);
+
+	failed = z->failed;
+	free(z);
+	return failed;
+}
+
+#else
+
+const char* compress_suffix() {
+	return "";
+}
+
+FILE* compress_open(FILE *f) {
+	return f;
+}
+
+int compress_close(FILE *p) {
+	return 0;
+}
+
+#endif
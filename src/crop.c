@@ -0,0 +1,203 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "decoder.h"
+#include "jp2a.h"
+#include "options.h"
+
+/*
+ * --crop=WxH+X+Y converts a region of each image.  Each value is in
+ * source pixels, or in percent of the image's width or height if it ends
+ * with '%'.  A cropping decoder wraps the image's decoder and delivers
+ * only the rows and columns of the region.  Backends that can decode a
+ * region by themselves do the work through their crop function; for the
+ * others, rows above the region are read and thrown away, and rows below
+ * it are not read at all.
+ */
+
+enum { CROP_W, CROP_H, CROP_X, CROP_Y };
+
+static int crop_given = 0;
+static int crop_value[4];
+static int crop_percent[4];
+
+typedef struct crop_state_ {
+	backend b;     // the inner backend's name, with our functions
+	decoder inner;
+	int x, y;      // where the region starts in the inner decoder's rows
+	JSAMPLE *row;
+} crop_state;
+
+// Read a number with an optional '%' after it.
+static const char* crop_number(const char *s, int n) {
+	char *end;
+	long v = strtol(s, &end, 10);
+
+	if ( end == s || *s == '-' || *s == '+' || v > 1000000 )
+		return NULL;
+
+	crop_value[n] = (int) v;
+	crop_percent[n] = *end == '%';
+
+	if ( crop_percent[n] ) {
+		if ( v > 100 ) return NULL;
+		++end;
+	}
+
+	return end;
+}
+
+// Parse the argument of --crop, returns zero on success.
+int crop_parse(const char *spec) {
+	const char *s = spec;
+
+	if ( (s = crop_number(s, CROP_W)) == NULL || *s++ != 'x' ||
+	     (s = crop_number(s, CROP_H)) == NULL )
+		return -1;
+
+	crop_value[CROP_X] = crop_value[CROP_Y] = 0;
+	crop_percent[CROP_X] = crop_percent[CROP_Y] = 0;
+
+	if ( *s == '+' ) {
+		if ( (s = crop_number(s + 1, CROP_X)) == NULL || *s++ != '+' ||
+		     (s = crop_number(s, CROP_Y)) == NULL )
+			return -1;
+	}
+
+	if ( *s != 0 || crop_value[CROP_W] < 1 || crop_value[CROP_H] < 1 )
+		return -1;
+
+	crop_given = 1;
+	return 0;
+}
+
+static int crop_pixels(const int n, const int size) {
+	if ( crop_percent[n] )
+		return (int) (((long) crop_value[n] * size + 50) / 100);
+
+	return crop_value[n];
+}
+
+// Set the region of a width x height image to convert.  Returns zero if
+// the whole image is to be converted.
+int crop_region(const int width, const int height, int *x, int *y, int *w, int *h) {
+	if ( !crop_given )
+		return 0;
+
+	*x = crop_pixels(CROP_X, width);
+	*y = crop_pixels(CROP_Y, height);
+	*w = crop_pixels(CROP_W, width);
+	*h = crop_pixels(CROP_H, height);
+
+	if ( *x >= width || *y >= height )
+		decoder_fail("--crop region is outside the image (%dx%d)", width, height);
+
+	// keep the region inside the image
+	if ( *w > width - *x ) *w = width - *x;
+	if ( *h > height - *y ) *h = height - *y;
+	if ( *w < 1 ) *w = 1;
+	if ( *h < 1 ) *h = 1;
+
+	return *x != 0 || *y != 0 || *w != width || *h != height;
+}
+
+static int crop_read_row(decoder *d, JSAMPLE *row) {
+	crop_state *s = (crop_state*) d->state;
+	decoder *in = &s->inner;
+	const int c = d->components;
+
+	// rows above the region, that the backend could not skip
+	for ( ; s->y > 0; --s->y ) {
+		if ( in->b->read_row(in, s->row) )
+			return -1;
+
+		++in->scanline;
+	}
+
+	if ( in->width == d->width ) {
+		if ( in->b->read_row(in, row) )
+			return -1;
+	} else {
+		if ( in->b->read_row(in, s->row) )
+			return -1;
+
+		memcpy(row, s->row + (size_t) s->x * c, (size_t) d->width * c);
+	}
+
+	++in->scanline;
+	return 0;
+}
+
+static void crop_close(decoder *d) {
+	crop_state *s = (crop_state*) d->state;
+
+	if ( s == NULL )
+		return;
+
+	s->inner.b->close(&s->inner);
+	free(s->row);
+	free(s);
+	d->state = NULL;
+}
+
+// Read only the w x h region at x, y of the image from now on.
+void decoder_crop(decoder *d, const int x, const int y, const int w, const int h) {
+	crop_state *s = (crop_state*) calloc(1, sizeof(crop_state));
+
+	if ( s == NULL ) {
+		progress_clear();
+		fputs("Not enough memory to crop image\n", stderr);
+		exit(1);
+	}
+
+	if ( verbose ) {
+		progress_clear();
+		fprintf(stderr, "Cropping %dx%d image to %dx%d+%d+%d\n",
+			d->width, d->height, w, h, x, y);
+	}
+
+	s->inner = *d;
+	s->x = x;
+	s->y = y;
+
+	s->b = *d->b;
+	s->b.open = NULL;
+	s->b.open_mem = NULL;
+	s->b.shrink = NULL;
+	s->b.crop = NULL;
+	s->b.read_row = crop_read_row;
+	s->b.close = crop_close;
+
+	// from here on, closing d also closes the inner decoder
+	d->b = &s->b;
+	d->state = s;
+	d->width = w;
+	d->height = h;
+	d->scanline = 0;
+
+	if ( s->inner.b->crop )
+		s->inner.b->crop(&s->inner, &s->x, &s->y, w);
+
+	if ( (s->row = (JSAMPLE*) malloc((size_t) s->inner.width * d->components)) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory to crop image\n", stderr);
+		exit(1);
+	}
+}
@@ -32,6 +32,10 @@
 #include <unistd.h>
 #endif
 
+#ifdef CURL_DLOPEN
+#include <dlfcn.h>
+#endif
+
 #ifdef WIN32
 #include <io.h>
 #include <fcntl.h>
@@ -39,10 +43,73 @@
 #define pipe(x) _pipe(x, 256, O_BINARY)
 #endif
 
+#include "jp2a.h"
+
 // local variables to curl.c
 int fd[2], debugopt;
 const char* URL;
 
+/*
+ * The libcurl functions we use.  With CURL_DLOPEN, libcurl is loaded the
+ * first time a URL is given, rather than linked.  It pulls in dozens of
+ * other libraries, and linking them slowed down every start of jp2a.
+ */
+static struct {
+	CURLcode (*global_init)(long flags);
+	CURL* (*easy_init)(void);
+	CURLcode (*easy_setopt)(CURL *curl, CURLoption option, ...);
+	CURLcode (*easy_perform)(CURL *curl);
+	void (*easy_cleanup)(CURL *curl);
+	void (*global_cleanup)(void);
+#ifdef CURL_DLOPEN
+} libcurl;
+
+// Load libcurl, or exit.
+static void curl_load() {
+	static const char *names[] = { "libcurl.so.4", "libcurl.4.dylib", "libcurl.so", NULL };
+	void *lib = NULL;
+	int n;
+
+	if ( libcurl.easy_init != NULL )
+		return;
+
+	for ( n=0; lib == NULL && names[n] != NULL; ++n )
+		lib = dlopen(names[n], RTLD_NOW);
+
+	if ( lib == NULL ) {
+		progress_clear();
+		fprintf(stderr, "Could not load libcurl: %s\n", dlerror());
+		exit(1);
+	}
+
+	*(void**) &libcurl.global_init = dlsym(lib, "curl_global_init");
+	*(void**) &libcurl.easy_init = dlsym(lib, "curl_easy_init");
+	*(void**) &libcurl.easy_setopt = dlsym(lib, "curl_easy_setopt");
+	*(void**) &libcurl.easy_perform = dlsym(lib, "curl_easy_perform");
+	*(void**) &libcurl.easy_cleanup = dlsym(lib, "curl_easy_cleanup");
+	*(void**) &libcurl.global_cleanup = dlsym(lib, "curl_global_cleanup");
+
+	if ( !libcurl.global_init || !libcurl.easy_init || !libcurl.easy_setopt ||
+	     !libcurl.easy_perform || !libcurl.easy_cleanup || !libcurl.global_cleanup )
+	{
+		progress_clear();
+		fputs("Could not load libcurl: functions are missing\n", stderr);
+		exit(1);
+	}
+}
+#else
+} libcurl = {
+	curl_global_init,
+	curl_easy_init,
+	curl_easy_setopt,
+	curl_easy_perform,
+	curl_easy_cleanup,
+	curl_global_cleanup
+};
+
+#define curl_load()
+#endif
+
 //! Return 1 if s is a supported URL
 int is_url(const char* s) {
 	return !strncmp(s, "ftp://", 6)
@@ -73,32 +140,33 @@ void curl_download_child(void*)
 #endif
 
 	if ( (fw = fdopen(fd[1], "wb")) == NULL ) {
+		progress_clear();
 		fputs("Could not open pipe for writing.\n", stderr);
 		exit(1);
 	}
 
-	curl_global_init(CURL_GLOBAL_ALL);
+	libcurl.global_init(CURL_GLOBAL_ALL);
 
-	curl = curl_easy_init();
-	curl_easy_setopt(curl, CURLOPT_URL, URL);
+	curl = libcurl.easy_init();
+	libcurl.easy_setopt(curl, CURLOPT_URL, URL);
 
 	if ( debugopt )
-		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+		libcurl.easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 
-	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1); // fail silently
-	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1); // redirects
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, fw);
+	libcurl.easy_setopt(curl, CURLOPT_FAILONERROR, 1L); // fail silently
+	libcurl.easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L); // redirects
+	libcurl.easy_setopt(curl, CURLOPT_WRITEDATA, fw);
 	#ifdef WIN32
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, passthru_write);
+	libcurl.easy_setopt(curl, CURLOPT_WRITEFUNCTION, passthru_write);
 	#endif
 
-	curl_easy_perform(curl);
-	curl_easy_cleanup(curl);
+	libcurl.easy_perform(curl);
+	libcurl.easy_cleanup(curl);
 
 	fclose(fw);
 	close(fd[1]); // close write-end
 
-	curl_global_cleanup();
+	libcurl.global_cleanup();
 
 #ifdef WIN32
 	_endthread();
@@ -113,8 +181,10 @@ int curl_download(const char* url, const int debug) {
 
 	URL = url;
 	debugopt = debug;
+	curl_load();
 
 	if ( pipe(fd) != 0 ) {
+		progress_clear();
 		fputs("Could not create pipe\n", stderr);
 		exit(1);
 	}
@@ -126,12 +196,14 @@ int curl_download(const char* url, const int debug) {
 		curl_download_child();
 		exit(0);
 	} else if ( pid < 0 ) {
+		progress_clear();
 		fputs("Could not fork.\n", stderr);
 		exit(1);
 	}
 
 #else
 	if ( _beginthread(curl_download_child, 0, NULL) <= 0 ) {
+		progress_clear();
 		fputs("Could not create thread", stderr);
 		exit(1);
 	}
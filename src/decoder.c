@@ -0,0 +1,167 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "decoder.h"
+#include "options.h"
+
+// Supported image formats; to add one, write a backend and list it here.
+static const backend* const backends[] = {
+	&jpeg_backend,
+#ifdef FEAT_PNG
+	&png_backend,
+#endif
+	&pnm_backend,
+#ifdef FEAT_INDEX
+	&index_backend,
+#endif
+	NULL
+};
+
+/*
+ * A damaged image shouldn't stop the other images from being converted.
+ * Errors in an image call decoder_fail(), which jumps back to the caller
+ * that is converting it, given with decoder_catch().  The caller closes
+ * the decoder and reports the reason.  Without a caller to jump to, the
+ * reason is printed and we exit.
+ */
+
+static DECODER_LOCAL jmp_buf *handler = NULL;
+static DECODER_LOCAL char failure[256];
+static DECODER_LOCAL int damaged = 0;
+
+// Jump to env on errors, or exit if it's NULL.  Returns the last one.
+jmp_buf* decoder_catch(jmp_buf *env) {
+	jmp_buf *last = handler;
+	handler = env;
+	return last;
+}
+
+// Give up on the image being read.
+void decoder_fail(const char *format, ...) {
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(failure, sizeof(failure), format, ap);
+	va_end(ap);
+
+	if ( handler != NULL )
+		longjmp(*handler, 1);
+
+	progress_clear();
+	fprintf(stderr, "%s\n", failure);
+	exit(1);
+}
+
+// Why the last image failed.
+const char* decoder_failure() {
+	return failure;
+}
+
+// Returns nonzero if rows of an image have been left blank since the
+// last call.
+int decoder_damaged() {
+	const int was = damaged;
+	damaged = 0;
+	return was;
+}
+
+// Read the next row, and fail if it can't be read.  With --partial, the
+// rest of a damaged image is left black instead.
+void decoder_read_row(decoder *d, JSAMPLE *row) {
+	jmp_buf env, *last;
+
+	if ( d->damaged ) {
+		memset(row, 0, (size_t) d->width * d->components);
+		return;
+	}
+
+	if ( !partial ) {
+		if ( d->b->read_row(d, row) )
+			decoder_fail("Could not read %s image", d->b->name);
+
+		return;
+	}
+
+	last = decoder_catch(&env);
+
+	if ( setjmp(env) == 0 ) {
+		if ( d->b->read_row(d, row) )
+			decoder_fail("Could not read %s image", d->b->name);
+	} else {
+		if ( verbose ) {
+			progress_clear();
+			fprintf(stderr, "%s, leaving %d rows blank\n", failure, d->height - d->scanline);
+		}
+
+		d->damaged = damaged = 1;
+		memset(row, 0, (size_t) d->width * d->components);
+	}
+
+	decoder_catch(last);
+}
+
+// Return the backend for files starting with the given byte, or NULL.
+const backend* find_backend(const int magic) {
+	int n;
+
+	for ( n=0; backends[n] != NULL; ++n )
+		if ( backends[n]->magic == magic )
+			return backends[n];
+
+	return NULL;
+}
+
+// Find a decoder for the image format, and read the image header.
+void decoder_open(decoder *d, FILE *fp) {
+	const int magic = getc(fp);
+
+	memset(d, 0, sizeof(decoder));
+
+	if ( magic == EOF )
+		decoder_fail("Empty input file");
+
+	ungetc(magic, fp);
+
+	// an --index is only read in memory
+	if ( (d->b = find_backend(magic)) == NULL || d->b->open == NULL )
+		decoder_fail("Unsupported image format");
+
+	if ( d->b->open(d, fp) )
+		decoder_fail("Could not read %s image", d->b->name);
+}
+
+// The same, for an image in memory.
+void decoder_open_mem(decoder *d, const unsigned char *data, const size_t size) {
+	const backend *b = size? find_backend(data[0]) : NULL;
+
+	memset(d, 0, sizeof(decoder));
+
+	if ( size == 0 )
+		decoder_fail("Empty input file");
+
+	if ( b == NULL || b->open_mem == NULL )
+		decoder_fail("Unsupported image format");
+
+	d->b = b;
+
+	if ( d->b->open_mem(d, data, size) )
+		decoder_fail("Could not read %s image", d->b->name);
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "jp2a.h"
+
+// Just enough of an Exif reader to find the embedded JPEG thumbnail and
+// the orientation of the main image and the thumbnail.  The Exif data is
+// a TIFF file, whose first IFD describes the main image and whose second
+// IFD, if any, describes the thumbnail.
+
+#define TAG_ORIENTATION 0x0112
+#define TAG_THUMB_OFFSET 0x0201
+#define TAG_THUMB_LENGTH 0x0202
+
+typedef struct tiff_ {
+	const unsigned char *data;
+	unsigned size;
+	int motorola; // big endian
+} tiff;
+
+static unsigned get16(const tiff *t, const unsigned pos) {
+	const unsigned char *p = t->data + pos;
+	return t->motorola? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static unsigned get32(const tiff *t, const unsigned pos) {
+	return t->motorola?
+		(get16(t, pos) << 16) | get16(t, pos + 2) :
+		(get16(t, pos + 2) << 16) | get16(t, pos);
+}
+
+// Read the tags we want from the IFD at offset, return the offset of
+// the next IFD or zero.
+static unsigned read_ifd(const tiff *t, const unsigned offset,
+	int *orientation, unsigned *thumb_offset, unsigned *thumb_length)
+{
+	unsigned entries, n;
+
+	if ( offset < 8 || offset + 2 > t->size )
+		return 0;
+
+	entries = get16(t, offset);
+
+	if ( offset + 2 + entries*12 + 4 > t->size )
+		return 0;
+
+	for ( n=0; n < entries; ++n ) {
+		const unsigned entry = offset + 2 + n*12;
+		const unsigned value = get16(t, entry + 2) == 3? // SHORT
+			get16(t, entry + 8) : get32(t, entry + 8);
+
+		switch ( get16(t, entry) ) {
+		case TAG_ORIENTATION:  *orientation = value >= 1 && value <= 8? (int) value : 1; break;
+		case TAG_THUMB_OFFSET: *thumb_offset = value; break;
+		case TAG_THUMB_LENGTH: *thumb_length = value; break;
+		}
+	}
+
+	return get32(t, offset + 2 + entries*12);
+}
+
+/*
+ * Look for a JPEG thumbnail in the contents of an APP1 marker.
+ *
+ * Returns 1 and sets thumb and length to the thumbnail data within the
+ * marker if found, otherwise 0.  Orientations are the Exif values 1-8 of
+ * the main image and thumbnail, where 1 is the default.
+ */
+int exif_thumbnail(const unsigned char *data, const unsigned size,
+	const unsigned char **thumb, unsigned *length,
+	int *orientation, int *thumb_orientation)
+{
+	unsigned ifd1, offset = 0, len = 0;
+	tiff t;
+
+	*orientation = 1;
+
+	if ( size < 14 || memcmp(data, "Exif\0\0", 6) )
+		return 0;
+
+	t.data = data + 6;
+	t.size = size - 6;
+
+	if ( !memcmp(t.data, "MM", 2) )
+		t.motorola = 1;
+	else if ( !memcmp(t.data, "II", 2) )
+		t.motorola = 0;
+	else
+		return 0;
+
+	if ( get16(&t, 2) != 42 )
+		return 0;
+
+	// a thumbnail is only valid in IFD1, so offset and length from IFD0 are ignored
+	ifd1 = read_ifd(&t, get32(&t, 4), orientation, &offset, &len);
+
+	*thumb_orientation = *orientation;
+	offset = len = 0;
+
+	if ( !ifd1 )
+		return 0;
+
+	read_ifd(&t, ifd1, thumb_orientation, &offset, &len);
+
+	if ( !offset || !len || offset >= t.size || len > t.size - offset )
+		return 0;
+
+	*thumb = t.data + offset;
+	*length = len;
+	return 1;
+}
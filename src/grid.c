@@ -0,0 +1,547 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include "jp2a.h"
+
+#ifdef FEAT_GRID
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "decoder.h"
+#include "image.h"
+#include "options.h"
+#include "round.h"
+
+/*
+ * --grid=COLSxROWS puts the images on contact sheets, each image fitted
+ * in a cell of the grid, with its file name under it if --grid-captions
+ * is given.  The inputs are collected first, then decoded by a few
+ * threads at once, each image only as large as its cell needs (JPEG
+ * images are scaled down by the IDCT).  The cells of a sheet are
+ * converted one by one into memory, and the sheet is put together from
+ * their rows and written in one go.
+ *
+ * Decoding threads only touch the cell they decode; the decoders keep
+ * their error handler per thread (see DECODER_LOCAL).
+ */
+
+// characters between cells, and lines between rows of cells
+#define GRID_GAP 1
+
+// most threads decoding at once
+#define GRID_THREADS 8
+
+// a cell with width and height of at least this is good enough for --grid=auto
+#define GRID_AUTO_MIN 8
+
+typedef struct cell_ {
+	char *path;
+	image_t *image;    // NULL if it could not be decoded
+	int width, height; // of the region to convert, before shrinking
+	int flipx, flipy;
+	int damaged;
+	int decoded;
+	char failure[256];
+} cell;
+
+static cell *cells = NULL;
+static int count = 0, room = 0;
+
+// the size images are fitted in, in characters; height 0 is any height
+static int cell_width = 0, cell_height = 0;
+
+// Collect an image for the grid.
+void grid_add(const char *path) {
+	if ( count == room ) {
+		cell *p;
+		room = room? room*2 : 64;
+
+		if ( (p = (cell*) realloc(cells, room * sizeof(cell))) == NULL ) {
+			progress_clear();
+			fputs("Not enough memory for --grid\n", stderr);
+			exit(1);
+		}
+
+		cells = p;
+	}
+
+	memset(&cells[count], 0, sizeof(cell));
+
+	if ( (cells[count].path = (char*) malloc(strlen(path) + 1)) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory for --grid\n", stderr);
+		exit(1);
+	}
+
+	strcpy(cells[count++].path, path);
+}
+
+// Fit an image region of w x h pixels in the cell, with the same aspect
+// ratio as aspect_ratio() gives.
+static void cell_fit(const int w, const int h, int *cols, int *rows) {
+	const int border = use_border * 2;
+	const int cw = cell_width - border;
+	const int ch = cell_height - border;
+
+	*cols = cw;
+	*rows = ROUND(0.5f * (float) cw * (float) h / (float) w);
+
+	if ( cell_height && *rows > ch ) {
+		*rows = ch;
+		*cols = ROUND(2.0f * (float) ch * (float) w / (float) h);
+	}
+
+	if ( *cols < 1 ) *cols = 1;
+	if ( *rows < 1 ) *rows = 1;
+}
+
+// Decode the image of a cell, no larger than needed.  This runs in the
+// decoding threads.
+static void cell_decode(cell *c) {
+	static DECODER_LOCAL decoder d; // not on the stack, since we may longjmp back here
+	static DECODER_LOCAL image_t *p;
+	static DECODER_LOCAL FILE *fp;
+	int x = 0, y = 0, cols, rows, subx, suby;
+	jmp_buf env;
+
+	if ( (fp = fopen(c->path, "rb")) == NULL ) {
+		snprintf(c->failure, sizeof(c->failure), "Can't open file");
+		return;
+	}
+
+	d.b = NULL;
+	p = NULL;
+	decoder_damaged();
+
+	if ( setjmp(env) ) {
+		decoder_catch(NULL);
+
+		if ( d.b != NULL && d.b->close != NULL )
+			d.b->close(&d);
+
+		image_destroy(p);
+		fclose(fp);
+		snprintf(c->failure, sizeof(c->failure), "%s", decoder_failure());
+		return;
+	}
+
+	decoder_catch(&env);
+	decoder_open(&d, fp);
+
+	c->width = d.width;
+	c->height = d.height;
+
+	// regions in pixels are for the full image, so it's not shrunk
+	if ( !crop_region(d.width, d.height, &x, &y, &c->width, &c->height) && d.b->shrink ) {
+		cell_fit(c->width, c->height, &cols, &rows);
+		sample_size(&subx, &suby);
+
+		d.downscale = 1;
+		d.b->shrink(&d, cols * subx, rows * suby);
+	}
+
+	p = image_new(d.width, d.height, d.components);
+
+	while ( d.scanline < d.height ) {
+		decoder_read_row(&d, p->pixels + (size_t) d.scanline * d.width * d.components);
+		++d.scanline;
+	}
+
+	c->flipx = d.flipx;
+	c->flipy = d.flipy;
+	d.b->close(&d);
+
+	decoder_catch(NULL);
+	fclose(fp);
+
+	if ( (c->damaged = decoder_damaged()) )
+		snprintf(c->failure, sizeof(c->failure), "%s", decoder_failure());
+
+	c->image = p;
+}
+
+#ifdef FEAT_THREADS
+
+#include <pthread.h>
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static int next = 0;  // the next cell to decode
+static int limit = 0; // cells up to here may be decoded
+static int quit = 0;
+
+static void* decode_thread(void *arg) {
+	pthread_mutex_lock(&lock);
+
+	for ( ;; ) {
+		cell *c;
+
+		while ( next >= limit && !quit )
+			pthread_cond_wait(&changed, &lock);
+
+		if ( next >= limit )
+			break;
+
+		c = &cells[next++];
+		pthread_mutex_unlock(&lock);
+
+		cell_decode(c);
+
+		pthread_mutex_lock(&lock);
+		c->decoded = 1;
+		pthread_cond_broadcast(&changed);
+	}
+
+	pthread_mutex_unlock(&lock);
+	return arg;
+}
+
+#endif
+
+// Convert a decoded cell into memory.  Returns the output, which ends up
+// in *size bytes, and sets *cols and *rows to its size in characters.
+static char* cell_convert(const cell *c, size_t *size, int *cols, int *rows) {
+	const int store_clearscr = clearscr, store_raw = html_rawoutput;
+	char *out = NULL;
+	decoder d;
+	FILE *f;
+
+	if ( (f = open_memstream(&out, size)) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory for --grid\n", stderr);
+		exit(1);
+	}
+
+	restore_dimensions();
+	cell_fit(c->width, c->height, &width, &height);
+	auto_width = auto_height = 0;
+
+	// the sheet has the header
+	clearscr = 0;
+	html_rawoutput = 1;
+
+	memory_decoder(&d, c->image);
+	d.flipx = c->flipx;
+	d.flipy = c->flipy;
+	convert(&d, f);
+	d.b->close(&d);
+
+	clearscr = store_clearscr;
+	html_rawoutput = store_raw;
+
+	*cols = width + use_border * 2;
+	*rows = height + use_border * 2;
+
+	fclose(f);
+	return out;
+}
+
+// Find the end of the line starting at s, before end.  Lines of HTML end
+// with <br/>, borders with a newline.  Returns where the next line starts.
+static const char* line_end(const char *s, const char *end, const char **eol) {
+	for ( ; s < end; ++s ) {
+		if ( *s == '\n' ) {
+			*eol = s;
+			return s + 1;
+		}
+
+		if ( html && *s == '<' && end - s >= 5 && !memcmp(s, "<br/>", 5) ) {
+			*eol = s;
+			return s + 5;
+		}
+	}
+
+	*eol = end;
+	return end;
+}
+
+static void put_spaces(int n, FILE *f) {
+	while ( n-- > 0 )
+		fputc(' ', f);
+}
+
+static void put_newline(FILE *f) {
+	if ( html )
+		print_html_newline(f);
+	else
+		fputc('\n', f);
+}
+
+// Write the caption of a cell, centered and cut to the cell width.
+static int put_caption(const char *path, FILE *f) {
+	const char *name = strrchr(path, '/');
+	int len, pad, n;
+
+	name = name? name + 1 : path;
+	len = (int) strlen(name);
+
+	if ( len > cell_width )
+		len = cell_width;
+
+	pad = (cell_width - len) / 2;
+	put_spaces(pad, f);
+
+	for ( n=0; n < len; ++n ) {
+		if ( html )
+			fputs(html_entity(name[n]), f);
+		else
+			fputc(name[n], f);
+	}
+
+	return pad + len;
+}
+
+// Put the cells from first to last on a sheet.  Each cell is counted by
+// batch_done(); one that can't be decoded is left blank.
+static void print_sheet(const int first, const int last, const int cols, FILE *fout) {
+	FILE *f = output_begin(fout);
+	int n;
+
+	if ( clearscr ) {
+		fprintf(f, "%c[2J", 27);
+		fprintf(f, "%c[0;0H", 27);
+	}
+
+	if ( html && !html_rawoutput )
+		print_html_start(html_fontsize, f);
+
+	for ( n=first; n < last; n += cols ) {
+		const int end = n + cols < last? n + cols : last;
+		char *out[end - n];
+		const char *pos[end - n];
+		size_t size[end - n];
+		int w[end - n], h[end - n];
+		int i, line, lines = 0;
+
+		for ( i=n; i < end; ++i ) {
+			cell *c = &cells[i];
+
+			out[i-n] = NULL;
+			size[i-n] = 0;
+			w[i-n] = h[i-n] = 0;
+
+			if ( c->image == NULL ) {
+				progress_clear();
+				fprintf(stderr, "Could not convert %s: %s\n", c->path, c->failure);
+				batch_done(c->path, 1);
+				continue;
+			}
+
+			if ( verbose ) {
+				progress_clear();
+				fprintf(stderr, "File: %s\n", c->path);
+			}
+
+			progress_file(c->path);
+
+			if ( c->damaged ) {
+				progress_clear();
+				fprintf(stderr, "Converted part of %s: %s\n", c->path, c->failure);
+			}
+
+			out[i-n] = cell_convert(c, &size[i-n], &w[i-n], &h[i-n]);
+			pos[i-n] = out[i-n];
+
+			if ( h[i-n] > lines )
+				lines = h[i-n];
+
+			batch_done(c->path, c->damaged);
+
+			image_destroy(c->image);
+			c->image = NULL;
+		}
+
+		if ( n > first )
+			for ( line=0; line < GRID_GAP; ++line )
+				put_newline(f);
+
+		for ( line=0; line < lines; ++line ) {
+			int used = 0; // characters written on the line
+
+			for ( i=0; i < end - n; ++i ) {
+				const int left = i * (cell_width + GRID_GAP) + (cell_width - w[i]) / 2;
+
+				if ( line < h[i] && out[i] != NULL ) {
+					const char *eol;
+					const char *from = pos[i];
+
+					pos[i] = line_end(pos[i], out[i] + size[i], &eol);
+					put_spaces(left - used, f);
+					fwrite(from, 1, eol - from, f);
+					used = left + w[i];
+				}
+			}
+
+			put_newline(f);
+		}
+
+		if ( grid_captions ) {
+			int used = 0;
+
+			for ( i=0; i < end - n; ++i ) {
+				put_spaces(i * (cell_width + GRID_GAP) - used, f);
+				used = i * (cell_width + GRID_GAP) + put_caption(cells[n+i].path, f);
+			}
+
+			put_newline(f);
+		}
+
+		for ( i=0; i < end - n; ++i )
+			free(out[i]);
+	}
+
+	if ( html && !html_rawoutput )
+		print_html_end(f);
+
+	output_end(f, fout);
+}
+
+// Pick the number of columns that gives the biggest cells for all images
+// on one sheet of sheet_width x sheet_height characters.
+static int auto_columns(const int sheet_width, const int sheet_height) {
+	int best = 1, best_size = 0, cols;
+
+	for ( cols=1; cols <= count; ++cols ) {
+		const int rows = (count + cols - 1) / cols;
+		const int w = (sheet_width - (cols - 1) * GRID_GAP) / cols;
+		const int h = (sheet_height - (rows - 1) * GRID_GAP - rows * grid_captions) / rows;
+
+		// characters are about twice as high as wide
+		const int size = w < 2*h? w : 2*h;
+
+		if ( size > best_size ) {
+			best = cols;
+			best_size = size;
+		}
+	}
+
+	if ( best_size < GRID_AUTO_MIN ) {
+		progress_clear();
+		fprintf(stderr, "%d images don't fit well on %dx%d characters\n",
+			count, sheet_width, sheet_height);
+	}
+
+	return best;
+}
+
+// Decode the collected images and print them on sheets.
+void grid_end(FILE *fout) {
+	int sheet_width, sheet_height, cols = grid_cols, rows = grid_rows;
+	int per_sheet, first;
+#ifdef FEAT_THREADS
+	pthread_t threads[GRID_THREADS];
+	int n, started = 0, cpus = GRID_THREADS;
+#endif
+
+	if ( count == 0 )
+		return;
+
+	// the sheet is as big as a single image would be, with its border
+	restore_dimensions();
+
+	sheet_width = !auto_width && width > 0? width + use_border * 2 :
+		term_width > 0? term_width : 78;
+
+	sheet_height = !auto_height && height > 0? height + use_border * 2 :
+		termfit && termfit != TERM_FIT_WIDTH && term_height > 1? term_height - 1 : 0;
+
+	if ( cols == GRID_AUTO ) {
+		cols = auto_columns(sheet_width, sheet_height? sheet_height : sheet_width / 2);
+		rows = (count + cols - 1) / cols;
+	}
+
+	cell_width = (sheet_width - (cols - 1) * GRID_GAP) / cols;
+	cell_height = rows && sheet_height?
+		(sheet_height - (rows - 1) * GRID_GAP - rows * grid_captions) / rows : 0;
+
+	if ( cell_width < 1 + use_border * 2 || (rows && sheet_height && cell_height < 1 + use_border * 2) ) {
+		progress_clear();
+		fprintf(stderr, "A grid of %dx%d does not fit in %dx%d characters\n",
+			cols, rows, sheet_width, sheet_height);
+		exit(1);
+	}
+
+	per_sheet = rows? cols * rows : count;
+
+	if ( verbose ) {
+		progress_clear();
+		fprintf(stderr, "Grid: %d images, %d columns, cells of %dx%d\n",
+			count, cols, cell_width, cell_height);
+	}
+
+#ifdef FEAT_THREADS
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	for ( n=0; n < GRID_THREADS && n < cpus && n < count; ++n ) {
+		if ( pthread_create(&threads[n], NULL, decode_thread, NULL) )
+			break;
+		++started;
+	}
+#endif
+
+	for ( first=0; first < count; first += per_sheet ) {
+		const int last = first + per_sheet < count? first + per_sheet : count;
+		int i;
+
+#ifdef FEAT_THREADS
+		if ( started ) {
+			pthread_mutex_lock(&lock);
+
+			// decode this sheet and the next
+			limit = last + per_sheet < count? last + per_sheet : count;
+			pthread_cond_broadcast(&changed);
+
+			for ( i=first; i < last; ++i )
+				while ( !cells[i].decoded )
+					pthread_cond_wait(&changed, &lock);
+
+			pthread_mutex_unlock(&lock);
+		}
+		else
+#endif
+		for ( i=first; i < last; ++i )
+			cell_decode(&cells[i]);
+
+		print_sheet(first, last, cols, fout);
+	}
+
+#ifdef FEAT_THREADS
+	pthread_mutex_lock(&lock);
+	quit = 1;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+
+	for ( n=0; n < started; ++n )
+		pthread_join(threads[n], NULL);
+#endif
+
+	for ( first=0; first < count; ++first )
+		free(cells[first].path);
+
+	free(cells);
+	cells = NULL;
+	count = room = 0;
+}
+
+#endif
@@ -57,18 +57,44 @@ const char* html_entity(const char ch) {
 	}
 }
 
-void print_html_char(FILE *f, const char ch,
+static char* put_color(char *s, const int r, const int g, const int b) {
+	static const char hex[] = "0123456789abcdef";
+
+	*s++ = '#';
+	*s++ = hex[(r >> 4) & 15]; *s++ = hex[r & 15];
+	*s++ = hex[(g >> 4) & 15]; *s++ = hex[g & 15];
+	*s++ = hex[(b >> 4) & 15]; *s++ = hex[b & 15];
+	return s;
+}
+
+static char* put_string(char *s, const char *str) {
+	while ( *str )
+		*s++ = *str++;
+	return s;
+}
+
+// Write a character in the given color to s, and return the end of it.
+// At most HTML_CHAR_MAX bytes are written.
+char* html_char(char *s, const char ch, const int r_fg, const int g_fg, const int b_fg) {
+	s = put_string(s, "<span style='color:");
+	s = put_color(s, r_fg, g_fg, b_fg);
+	s = put_string(s, ";'>");
+	s = put_string(s, html_entity(ch));
+	return put_string(s, "</span>");
+}
+
+// The same, with a background color.
+char* html_char_fill(char *s, const char ch,
 	const int r_fg, const int g_fg, const int b_fg,
 	const int r_bg, const int g_bg, const int b_bg)
 {
-	if ( colorfill ) {
-		fprintf(f, "<span style='color:#%02x%02x%02x; background-color:#%02x%02x%02x;'>%s</span>",
-			r_fg, g_fg, b_fg,
-			r_bg, g_bg, b_bg,
-			html_entity(ch));
-	} else
-		fprintf(f, "<span style='color:#%02x%02x%02x;'>%s</span>",
-			r_fg, g_fg, b_fg, html_entity(ch));
+	s = put_string(s, "<span style='color:");
+	s = put_color(s, r_fg, g_fg, b_fg);
+	s = put_string(s, "; background-color:");
+	s = put_color(s, r_bg, g_bg, b_bg);
+	s = put_string(s, ";'>");
+	s = put_string(s, html_entity(ch));
+	return put_string(s, "</span>");
 }
 
 void print_html_newline(FILE *f) {
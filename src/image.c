@@ -21,6 +21,8 @@
 #include "jpeglib.h"
 
 #include "aspect_ratio.h"
+#include "cells.h"
+#include "decoder.h"
 #include "image.h"
 #include "jp2a.h"
 #include "options.h"
@@ -36,18 +38,30 @@ typedef struct Image_ {
 	float resize_y;
 	float resize_x;
 	int *lookup_resx;
+	char *glyph; // characters picked by --shapes, or NULL
+	int rows;    // rows of pixels kept, from row top on
+	int top;
+	int lasty;   // last row a scanline was added to
+	unsigned long *histogram; // of source luminance, or NULL
+	void (*print)(const struct Image_* const i, const int chars, FILE *f); // see pick_kernel()
 } Image;
 
-void print_border(const int width) {
+// Prints rows of characters for an image
+typedef void (*print_kernel)(const Image* const i, const int chars, FILE *f);
+
+void print_border(const int width, FILE *f) {
 	#ifndef HAVE_MEMSET
 	int n;
 	#endif
 
-	#ifdef WIN32
+	// on the heap, since --size can be very wide
 	char *bord = (char*) malloc(width+3);
-	#else
-	char bord[width + 3];
-	#endif
+
+	if ( bord == NULL ) {
+		progress_clear();
+		fputs("Not enough memory for given output dimension\n", stderr);
+		exit(1);
+	}
 
 	#ifdef HAVE_MEMSET
 	memset(bord, '-', width+2);
@@ -57,151 +71,392 @@ void print_border(const int width) {
 
 	bord[0] = bord[width+1] = '+';
 	bord[width+2] = 0;
-	puts(bord);
-
-	#ifdef WIN32
+	fputs(bord, f);
+	fputc('\n', f);
 	free(bord);
-	#endif
 }
 
-void print_image_colors(const Image* const i, const int chars, FILE* f) {
-
-	int x, y;
-	int xstart, xend, xincr;
+// Kernels below are instantiated from one inline function, with constant
+// arguments for the options, so it must be inlined for the branches on
+// them to go away.
+#ifdef __GNUC__
+#define KERNEL static inline __attribute__((always_inline))
+#else
+#define KERNEL static inline
+#endif
 
-	for ( y=0;  y < i->height; ++y ) {
+// Expand M(b1, ..., bn) for every combination of n bits, counting up.
+#define BITS_1(M, ...) M(__VA_ARGS__ 0) M(__VA_ARGS__ 1)
+#define BITS_2(M, ...) BITS_1(M, __VA_ARGS__ 0,) BITS_1(M, __VA_ARGS__ 1,)
+#define BITS_3(M, ...) BITS_2(M, __VA_ARGS__ 0,) BITS_2(M, __VA_ARGS__ 1,)
+#define BITS_4(M, ...) BITS_3(M, __VA_ARGS__ 0,) BITS_3(M, __VA_ARGS__ 1,)
+#define BITS_5(M, ...) BITS_4(M, __VA_ARGS__ 0,) BITS_4(M, __VA_ARGS__ 1,)
+#define BITS_6(M, ...) BITS_5(M, __VA_ARGS__ 0,) BITS_5(M, __VA_ARGS__ 1,)
+
+// Most bytes an ANSI colored character takes
+#define ANSI_CHAR_MAX 10
+
+KERNEL int ansi_color_of(const float Y, const float R, const float G, const float B,
+	const int gray, int *highl)
+{
+	const float min = 1.0f / 255.0f;
+	const float t = 0.1f; // threshold
+	const float i = 1.0f - t;
+
+	int colr = 0;
+	*highl = 0;
+
+	// ANSI highlite, only use in grayscale
+        if ( Y>=0.95f && R<min && G<min && B<min ) *highl = 1; // ANSI highlite
+
+	if ( !gray ) {
+	     if ( R-t>G && R-t>B )            colr = 31; // red
+	else if ( G-t>R && G-t>B )            colr = 32; // green
+	else if ( R-t>B && G-t>B && R+G>i )   colr = 33; // yellow
+	else if ( B-t>R && B-t>G && Y<0.95f ) colr = 34; // blue
+	else if ( R-t>G && B-t>G && R+B>i )   colr = 35; // magenta
+	else if ( G-t>R && B-t>R && B+G>i )   colr = 36; // cyan
+	else if ( R+G+B>=3.0f*Y )             colr = 37; // white
+	} else {
+		if ( Y>=0.7f ) { *highl=1; colr = 37; }
+	}
 
-		if ( use_border ) fprintf(f, "|");
+	return colr;
+}
 
-		xstart = 0;
-		xend   = i->width;
-		xincr  = 1;
+// Return ANSI foreground color 31-37 for the given pixel, or zero if it
+// has none, and set *highl if it should be highlighted.
+int ansi_color(const float Y, const float R, const float G, const float B, int *highl) {
+	return ansi_color_of(Y, R, G, B, convert_grayscale, highl);
+}
 
-		if ( flipx ) {
-			xstart = i->width - 1;
-			xend = -1;
-			xincr = -1;
-		}
+// Write ch with ANSI attribute code (1 or 30-47) to s.
+static inline char* put_ansi(char *s, const int code, const char ch) {
+	*s++ = 27;
+	*s++ = '[';
+	if ( code >= 10 ) *s++ = '0' + code / 10;
+	*s++ = '0' + code % 10;
+	*s++ = 'm';
+	*s++ = ch;
+	*s++ = 27;
+	*s++ = '[';
+	*s++ = '0';
+	*s++ = 'm';
+	return s;
+}
 
-		for ( x=xstart; x != xend; x += xincr ) {
+// Print an image in ANSI or HTML colors.  Each row is put together in
+// memory and written at once.
+KERNEL void print_colors(const Image* const i, const int chars, FILE *f,
+	const int glyph, const int html, const int fill, const int gray,
+	const int flipx, const int invert)
+{
+	const float min = 1.0f / 255.0f;
+	char *line = (char*) malloc((size_t) i->width * (html? HTML_CHAR_MAX : ANSI_CHAR_MAX) + 2);
+	int x, y;
 
-			float Y = i->pixel[x + (flipy? i->height - y - 1 : y ) * i->width];
-			float Y_inv = 1.0f - Y;
-			float R = i->red  [x + (flipy? i->height - y - 1 : y ) * i->width];
-			float G = i->green[x + (flipy? i->height - y - 1 : y ) * i->width];
-			float B = i->blue [x + (flipy? i->height - y - 1 : y ) * i->width];
+	if ( line == NULL ) {
+		progress_clear();
+		fputs("Not enough memory for given output dimension\n", stderr);
+		exit(1);
+	}
 
-			const int pos = ROUND((float)chars * (!invert? Y_inv : Y));
-			char ch = ascii_palette[pos];
+	for ( y=0;  y < i->height; ++y ) {
+		const int row = (flipy? i->height - y - 1 : y) * i->width;
+		const float *pixel = i->pixel + row;
+		const float *red = i->red + row, *green = i->green + row, *blue = i->blue + row;
+		char *s = line;
 
-			const float min = 1.0f / 255.0f;
+		if ( use_border ) *s++ = '|';
 
-			if ( !html ) {
-				const float t = 0.1f; // threshold
-				const float i = 1.0f - t;
-
-				int colr = 0;
-				int highl = 0;
-
-				// ANSI highlite, only use in grayscale
-			        if ( Y>=0.95f && R<min && G<min && B<min ) highl = 1; // ANSI highlite
-
-				if ( !convert_grayscale ) {
-				     if ( R-t>G && R-t>B )            colr = 31; // red
-				else if ( G-t>R && G-t>B )            colr = 32; // green
-				else if ( R-t>B && G-t>B && R+G>i )   colr = 33; // yellow
-				else if ( B-t>R && B-t>G && Y<0.95f ) colr = 34; // blue
-				else if ( R-t>G && B-t>G && R+B>i )   colr = 35; // magenta
-				else if ( G-t>R && B-t>R && B+G>i )   colr = 36; // cyan
-				else if ( R+G+B>=3.0f*Y )             colr = 37; // white
-				} else {
-					if ( Y>=0.7f ) { highl=1; colr = 37; }
-				}
+		for ( x=0; x < i->width; ++x ) {
+			const int src = flipx? i->width - x - 1 : x;
+			const float Y = pixel[src];
+			const float R = red[src], G = green[src], B = blue[src];
 
-				if ( !colr ) {
-					if ( !highl ) fprintf(f, "%c", ch);
-					else          fprintf(f, "%c[1m%c%c[0m", 27, ch, 27);
-				} else {
-					if ( colorfill ) colr += 10;          // set to ANSI background color
-					fprintf(f, "%c[%dm%c", 27, colr, ch); // ANSI color
-					fprintf(f, "%c[0m", 27);              // ANSI reset
-				}
+			const char ch = glyph? i->glyph[row + src] :
+				ascii_palette[ROUND((float)chars * (invert? Y : 1.0f - Y))];
 
-			} else {  // HTML output
-			
-				// either --grayscale is specified (convert_grayscale)
-				// or we can see that the image is inherently a grayscale image	
-				if ( convert_grayscale || (R<min && G<min && B<min && Y>min) ) {
-					// Grayscale image
-					if ( colorfill )
-						print_html_char(f, ch,
-							ROUND(255.0f*Y*0.5f), ROUND(255.0f*Y*0.5f), ROUND(255.0f*Y*0.5f),
-							ROUND(255.0f*Y),      ROUND(255.0f*Y),      ROUND(255.0f*Y));
-					else
-						print_html_char(f, ch,
-							ROUND(255.0f*Y), ROUND(255.0f*Y), ROUND(255.0f*Y),
-							255, 255, 255);
-				} else {
-					if ( colorfill )
-						print_html_char(f, ch,
-							ROUND(255.0f*Y*R), ROUND(255.0f*Y*G), ROUND(255.0f*Y*B),
-							ROUND(255.0f*R),   ROUND(255.0f*G),   ROUND(255.0f*B));
-					else
-						print_html_char(f, ch,
-							ROUND(255.0f*R), ROUND(255.0f*G), ROUND(255.0f*B),
-							255, 255, 255);
-				}
+			if ( !html ) {
+				int highl;
+				const int colr = ansi_color_of(Y, R, G, B, gray, &highl);
+
+				if ( colr )
+					s = put_ansi(s, fill? colr + 10 : colr, ch); // background with --fill
+				else if ( highl )
+					s = put_ansi(s, 1, ch);
+				else
+					*s++ = ch;
+
+			// either --grayscale is specified or we can see that the
+			// image is inherently a grayscale image
+			} else if ( gray || (R<min && G<min && B<min && Y>min) ) {
+				if ( fill )
+					s = html_char_fill(s, ch,
+						ROUND(255.0f*Y*0.5f), ROUND(255.0f*Y*0.5f), ROUND(255.0f*Y*0.5f),
+						ROUND(255.0f*Y),      ROUND(255.0f*Y),      ROUND(255.0f*Y));
+				else
+					s = html_char(s, ch, ROUND(255.0f*Y), ROUND(255.0f*Y), ROUND(255.0f*Y));
+			} else {
+				if ( fill )
+					s = html_char_fill(s, ch,
+						ROUND(255.0f*Y*R), ROUND(255.0f*Y*G), ROUND(255.0f*Y*B),
+						ROUND(255.0f*R),   ROUND(255.0f*G),   ROUND(255.0f*B));
+				else
+					s = html_char(s, ch, ROUND(255.0f*R), ROUND(255.0f*G), ROUND(255.0f*B));
 			}
 		}
 
-		if ( use_border )
-			fputc('|', f);
+		if ( use_border ) *s++ = '|';
+
+		fwrite(line, 1, s - line, f);
 
 		if ( html )
 			print_html_newline(f);
 		else
 			fputc('\n', f);
 	}
+
+	free(line);
 }
 
-void print_image(const Image* const i, const int chars, FILE *f) {
+// Print an image without colors.
+KERNEL void print_plain(const Image* const i, const int chars, FILE *f,
+	const int glyph, const int flipx, const int invert)
+{
+	char *line = (char*) malloc(i->width + 1);
 	int x, y;
 
-	#ifdef WIN32
-	char *line = (char*) malloc(i->width + 1);
-	#else
-	char line[i->width + 1];
-	#endif
+	if ( line == NULL ) {
+		progress_clear();
+		fputs("Not enough memory for given output dimension\n", stderr);
+		exit(1);
+	}
 
 	line[i->width] = 0;
 
 	for ( y=0; y < i->height; ++y ) {
+		const int row = (flipy? i->height - y - 1 : y) * i->width;
+		const float *pixel = i->pixel + row;
 
 		for ( x=0; x < i->width; ++x ) {
+			const int pos = ROUND((float)chars * pixel[x]);
 
-			const float lum = i->pixel[x + (flipy? i->height - y - 1 : y) * i->width];
-			const int pos = ROUND((float)chars * lum);
-
-			line[flipx? i->width - x - 1 : x] = ascii_palette[invert? pos : chars - pos];
+			line[flipx? i->width - x - 1 : x] = glyph? i->glyph[row + x] :
+				ascii_palette[invert? pos : chars - pos];
 		}
 
 		fprintf(f, !use_border? "%s\n" : "|%s|\n", line);
 	}
 
-	#ifdef WIN32
 	free(line);
-	#endif
+}
+
+#define COLORS_KERNEL(glyph, html, fill, gray, flipx, invert) \
+	static void print_colors_##glyph##html##fill##gray##flipx##invert( \
+		const Image* const i, const int chars, FILE *f) \
+	{ print_colors(i, chars, f, glyph, html, fill, gray, flipx, invert); }
+
+#define PLAIN_KERNEL(glyph, flipx, invert) \
+	static void print_plain_##glyph##flipx##invert( \
+		const Image* const i, const int chars, FILE *f) \
+	{ print_plain(i, chars, f, glyph, flipx, invert); }
+
+BITS_6(COLORS_KERNEL,)
+BITS_3(PLAIN_KERNEL,)
+
+#define COLORS_ENTRY(glyph, html, fill, gray, flipx, invert) \
+	print_colors_##glyph##html##fill##gray##flipx##invert,
+
+#define PLAIN_ENTRY(glyph, flipx, invert) \
+	print_plain_##glyph##flipx##invert,
+
+static const print_kernel colors_kernels[64] = { BITS_6(COLORS_ENTRY,) };
+static const print_kernel plain_kernels[8] = { BITS_3(PLAIN_ENTRY,) };
+
+static void put_rgb(uint8_t *p, const int r, const int g, const int b) {
+	p[0] = (uint8_t) r;
+	p[1] = (uint8_t) g;
+	p[2] = (uint8_t) b;
+}
+
+// Print an image as rows of --format=cells, see cells.h.  Glyphs and
+// colors are picked the same way as by the kernels above, so jp2a-cells
+// prints what they would.
+static void print_cells(const Image* const i, const int chars, FILE *f) {
+	const float min = 1.0f / 255.0f;
+	const size_t size = usecolors? sizeof(cells_cell) : 1;
+	const int rle = output_format == FORMAT_CELLS_RLE;
+	unsigned char *line = (unsigned char*) malloc(i->width * (size + 1));
+	unsigned char index[256]; // of the glyphs --shapes picks
+	int x, y, n;
+
+	if ( line == NULL ) {
+		progress_clear();
+		fputs("Not enough memory for given output dimension\n", stderr);
+		exit(1);
+	}
+
+	memset(index, 0, sizeof(index));
+
+	for ( n=chars; n >= 0; --n )
+		index[(unsigned char) ascii_palette[n]] = (unsigned char) n;
+
+	for ( y=0; y < i->height; ++y ) {
+		const int row = (flipy? i->height - y - 1 : y) * i->width;
+		unsigned char *s = line, *run = NULL;
+
+		for ( x=0; x < i->width; ++x ) {
+			const int src = flipx? i->width - x - 1 : x;
+			const float Y = i->pixel[row + src];
+			cells_cell c;
+
+			memset(&c, 0, sizeof(c));
+
+			if ( use_shapes )
+				c.glyph = index[(unsigned char) i->glyph[row + src]];
+			else if ( usecolors )
+				c.glyph = (uint8_t) ROUND((float)chars * (invert? Y : 1.0f - Y));
+			else {
+				const int pos = ROUND((float)chars * Y);
+				c.glyph = (uint8_t) (invert? pos : chars - pos);
+			}
+
+			if ( usecolors ) {
+				const float R = i->red[row + src], G = i->green[row + src], B = i->blue[row + src];
+				int highl;
+				const int colr = ansi_color(Y, R, G, B, &highl);
+
+				c.ansi = (uint8_t) (colr? (colorfill? colr + 10 : colr) : highl? 1 : 0);
+
+				if ( convert_grayscale || (R<min && G<min && B<min && Y>min) ) {
+					if ( colorfill ) {
+						put_rgb(c.fg, ROUND(255.0f*Y*0.5f), ROUND(255.0f*Y*0.5f), ROUND(255.0f*Y*0.5f));
+						put_rgb(c.bg, ROUND(255.0f*Y),      ROUND(255.0f*Y),      ROUND(255.0f*Y));
+					} else
+						put_rgb(c.fg, ROUND(255.0f*Y), ROUND(255.0f*Y), ROUND(255.0f*Y));
+				} else {
+					if ( colorfill ) {
+						put_rgb(c.fg, ROUND(255.0f*Y*R), ROUND(255.0f*Y*G), ROUND(255.0f*Y*B));
+						put_rgb(c.bg, ROUND(255.0f*R),   ROUND(255.0f*G),   ROUND(255.0f*B));
+					} else
+						put_rgb(c.fg, ROUND(255.0f*R), ROUND(255.0f*G), ROUND(255.0f*B));
+				}
+			}
+
+			if ( rle && run != NULL && *run < 255 && !memcmp(run + 1, &c, size) ) {
+				++*run;
+				continue;
+			}
+
+			if ( rle ) {
+				run = s;
+				*s++ = 1;
+			}
+
+			memcpy(s, &c, size);
+			s += size;
+		}
+
+		fwrite(line, 1, s - line, f);
+	}
+
+	free(line);
+}
+
+// 4x4 ordered dither thresholds for the subpixels of --unicode output
+static const float bayer[4][4] = {
+	{  0.5f/16.0f,  8.5f/16.0f,  2.5f/16.0f, 10.5f/16.0f },
+	{ 12.5f/16.0f,  4.5f/16.0f, 14.5f/16.0f,  6.5f/16.0f },
+	{  3.5f/16.0f, 11.5f/16.0f,  1.5f/16.0f,  9.5f/16.0f },
+	{ 15.5f/16.0f,  7.5f/16.0f, 13.5f/16.0f,  5.5f/16.0f },
+};
+
+// ANSI color of a subpixel for --unicode=halfblock, never zero
+int halfblock_color(const Image* const i, const int idx) {
+	int highl;
+	const int colr = ansi_color(i->pixel[idx], i->red[idx], i->green[idx], i->blue[idx], &highl);
+	return colr? colr : (i->pixel[idx] >= 0.5f ? 37 : 30);
+}
+
+// Print an image sampled with several subpixels per character, using
+// Unicode block or braille characters.  Half blocks in color use the
+// foreground for the upper and the background for the lower pixel,
+// the other modes color each character by the pixels that are lit.
+void print_image_unicode(const Image* const i, FILE *f) {
+	int cols, rows, x, y, sx, sy;
+
+	unicode_cell_size(&cols, &rows);
+
+	for ( y=0; y < i->height / rows; ++y ) {
+
+		if ( use_border ) fputc('|', f);
+
+		for ( x=0; x < i->width / cols; ++x ) {
+			int bits = 0, lit = 0;
+			float Y, R, G, B;
+			Y = R = G = B = 0.0f;
+
+			if ( unicode == UNICODE_HALFBLOCK && usecolors ) {
+				const int px = flipx? i->width - x - 1 : x;
+				const int upper = px + (flipy? i->height - 2*y - 1 : 2*y) * i->width;
+				const int lower = px + (flipy? i->height - 2*y - 2 : 2*y + 1) * i->width;
+
+				fprintf(f, "%c[%d;%dm%s%c[0m", 27,
+					halfblock_color(i, upper), halfblock_color(i, lower) + 10,
+					unicode_cell(1), 27);
+				continue;
+			}
+
+			for ( sy=0; sy < rows; ++sy ) {
+				for ( sx=0; sx < cols; ++sx ) {
+					const int px = x*cols + sx;
+					const int py = y*rows + sy;
+					const int idx = (flipx? i->width - px - 1 : px)
+						+ (flipy? i->height - py - 1 : py) * i->width;
+					const float ink = invert? i->pixel[idx] : 1.0f - i->pixel[idx];
+
+					if ( ink > bayer[py & 3][px & 3] ) {
+						bits |= 1 << (sx + sy*cols);
+						++lit;
+
+						if ( usecolors ) {
+							Y += i->pixel[idx];
+							R += i->red  [idx];
+							G += i->green[idx];
+							B += i->blue [idx];
+						}
+					}
+				}
+			}
+
+			if ( usecolors && lit ) {
+				int highl;
+				const int colr = ansi_color(Y/lit, R/lit, G/lit, B/lit, &highl);
+
+				if ( colr ) {
+					fprintf(f, "%c[%dm%s%c[0m", 27, colr, unicode_cell(bits), 27);
+					continue;
+				}
+			}
+
+			fputs(unicode_cell(bits), f);
+		}
+
+		if ( use_border ) fputc('|', f);
+		fputc('\n', f);
+	}
 }
 
 void clear(Image* i) {
-	memset(i->yadds, 0, i->height * sizeof(int) );
-	memset(i->pixel, 0, i->width * i->height * sizeof(float));
+	memset(i->yadds, 0, i->rows * sizeof(int) );
+	memset(i->pixel, 0, i->width * i->rows * sizeof(float));
 	memset(i->lookup_resx, 0, (1 + i->width) * sizeof(int) );
 
 	if ( usecolors ) {
-		memset(i->red,   0, i->width * i->height * sizeof(float));
-		memset(i->green, 0, i->width * i->height * sizeof(float));
-		memset(i->blue,  0, i->width * i->height * sizeof(float));
+		memset(i->red,   0, i->width * i->rows * sizeof(float));
+		memset(i->green, 0, i->width * i->rows * sizeof(float));
+		memset(i->blue,  0, i->width * i->rows * sizeof(float));
 	}
 }
 
@@ -239,46 +494,129 @@ void normalize(Image* i) {
 	}
 }
 
-void print_progress(const struct jpeg_decompress_struct* jpg) {
-	float progress;
-	int pos;
-	#define BARLEN 56
+void print_info(const decoder* d) {
+	progress_clear();
+	fprintf(stderr, "Source width: %d\n", d->width);
+	fprintf(stderr, "Source height: %d\n", d->height);
+	fprintf(stderr, "Source color components: %d\n", d->components);
+	fprintf(stderr, "Output width: %d\n", width);
+	fprintf(stderr, "Output height: %d\n", height);
+	fprintf(stderr, "Output palette (%d chars): '%s'\n", (int)strlen(ascii_palette), ascii_palette);
+}
+
+/*
+ * --auto-levels and --equalize: a histogram of the luminance of the source
+ * pixels is counted while they are sampled, and turned into a lookup
+ * table when the image is decoded.  The table is then applied to the
+ * output pixels, which are much fewer than the source pixels.
+ */
+static unsigned long histogram[256];
+static float levels_table[256];
 
-	static char s[BARLEN];
-	s[BARLEN-1] = 0;
+// The histogram bin of a luminance
+static inline int level_of(const float Y) {
+	const int n = ROUND(255.0f * Y);
+	return n < 0? 0 : n > 255? 255 : n;
+}
 
- 	progress = (float) (jpg->output_scanline + 1.0f) / (float) jpg->output_height;
-	pos = ROUND( (float) (BARLEN-2) * progress );
+// The luminance that a fraction of the counted pixels are darker than
+static int histogram_at(const unsigned long *cdf, const float fraction) {
+	const unsigned long count = (unsigned long) (fraction * (float) cdf[255]);
+	int n = 0;
 
-	memset(s, '.', BARLEN-2);
-	memset(s, '#', pos);
+	while ( n < 255 && cdf[n] <= count )
+		++n;
 
-	fprintf(stderr, "Decompressing image [%s]\r", s);
-	fflush(stderr);
+	return n;
 }
 
-void print_info(const struct jpeg_decompress_struct* jpg) {
-	fprintf(stderr, "Source width: %d\n", jpg->output_width);
-	fprintf(stderr, "Source height: %d\n", jpg->output_height);
-	fprintf(stderr, "Source color components: %d\n", jpg->output_components);
-	fprintf(stderr, "Output width: %d\n", width);
-	fprintf(stderr, "Output height: %d\n", height);
-	fprintf(stderr, "Output palette (%d chars): '%s'\n", (int)strlen(ascii_palette), ascii_palette);
+// Make the lookup table for --auto-levels or --equalize from the histogram.
+static void make_levels() {
+	unsigned long cdf[256], sum = 0;
+	int n;
+
+	for ( n=0; n < 256; ++n )
+		cdf[n] = sum += histogram[n];
+
+	if ( levels == LEVELS_AUTO ) {
+		// stretch, so the darkest and brightest 0.5% become black and white
+		const int black = histogram_at(cdf, 0.005f);
+		const int white = histogram_at(cdf, 0.995f);
+
+		if ( verbose ) {
+			progress_clear();
+			fprintf(stderr, "Levels: %d to %d stretched to 0 to 255\n", black, white);
+		}
+
+		for ( n=0; n < 256; ++n ) {
+			if ( white <= black )
+				levels_table[n] = (float) n / 255.0f;
+			else if ( n <= black )
+				levels_table[n] = 0.0f;
+			else if ( n >= white )
+				levels_table[n] = 1.0f;
+			else
+				levels_table[n] = (float) (n - black) / (float) (white - black);
+		}
+	} else {
+		// spread the luminances evenly by their cumulative distribution
+		unsigned long first = 0;
+
+		for ( n=0; n < 256 && first == 0; ++n )
+			first = cdf[n];
+
+		for ( n=0; n < 256; ++n )
+			levels_table[n] = sum <= first? (float) n / 255.0f :
+				cdf[n] < first? 0.0f : (float) (cdf[n] - first) / (float) (sum - first);
+	}
 }
 
-void process_scanline(const struct jpeg_decompress_struct *jpg, const JSAMPLE* scanline, Image* i) {
-	static int lasty = 0;
-	const int y = ROUND( i->resize_y * (float) (jpg->output_scanline-1) );
+// Apply the table to the output pixels.  Colors are scaled with the
+// luminance, keeping their hue.
+static void apply_levels(Image *i) {
+	const int size = i->width * i->height;
+	int n;
+
+	for ( n=0; n < size; ++n ) {
+		const float Y = i->pixel[n];
+		const float to = levels_table[level_of(Y)];
+
+		i->pixel[n] = to;
+
+		if ( usecolors ) {
+			const float scale = Y > 0.0f? to / Y : 0.0f;
+
+			i->red  [n] = i->red  [n] * scale > 1.0f? 1.0f : i->red  [n] * scale;
+			i->green[n] = i->green[n] * scale > 1.0f? 1.0f : i->green[n] * scale;
+			i->blue [n] = i->blue [n] * scale > 1.0f? 1.0f : i->blue [n] * scale;
+		}
+	}
+}
+
+void process_scanline(const decoder *d, const JSAMPLE* scanline, Image* i) {
+	const int y = ROUND( i->resize_y * (float) (d->scanline-1) );
+	int lasty = i->lasty;
 
 	// include all scanlines since last call
 
 	float *pixel, *red, *green, *blue;
 
-	pixel  = &i->pixel[lasty * i->width];
+	// nearest neighbour: only the first scanline of each output row
+	if ( quality == QUALITY_FAST ) {
+		while ( lasty <= y && i->yadds[lasty - i->top] )
+			++lasty;
+
+		if ( lasty > y ) {
+			i->lasty = y;
+			return;
+		}
+	}
+
+	pixel  = &i->pixel[(lasty - i->top) * i->width];
 	red = green = blue = NULL;
 
 	if ( usecolors ) {
-		int offset = lasty * i->width;
+		int offset = (lasty - i->top) * i->width;
 		red   = &i->red  [offset];
 		green = &i->green[offset];
 		blue  = &i->blue [offset];
@@ -286,13 +624,15 @@ void process_scanline(const struct jpeg_decompress_struct *jpg, const JSAMPLE* s
 
 	while ( lasty <= y ) {
 
-		const int components = jpg->out_color_components;
+		const int components = d->components;
 		const int readcolors = usecolors;
+		unsigned long *histogram = i->histogram;
+		const int nearest = quality == QUALITY_FAST;
 
 		int x;
 		for ( x=0; x < i->width; ++x ) {
 			const JSAMPLE *src     = &scanline[i->lookup_resx[x]];
-			const JSAMPLE *src_end = &scanline[i->lookup_resx[x+1]];
+			const JSAMPLE *src_end = nearest? src : &scanline[i->lookup_resx[x+1]];
 
 			int adds = 0;
 
@@ -301,10 +641,13 @@ void process_scanline(const struct jpeg_decompress_struct *jpg, const JSAMPLE* s
 
 			while ( src <= src_end ) {
 
-				if ( components != 3 )
+				if ( components != 3 ) {
 					v += GRAY[src[0]];
-				else {
-					v += RED[src[0]] + GREEN[src[1]] + BLUE[src[2]];
+					if ( histogram ) ++histogram[src[0]];
+				} else {
+					const float lum = RED[src[0]] + GREEN[src[1]] + BLUE[src[2]];
+					v += lum;
+					if ( histogram ) ++histogram[level_of(lum)];
 
 					if ( readcolors ) {
 						r += (float) src[0]/255.0f;
@@ -326,7 +669,7 @@ void process_scanline(const struct jpeg_decompress_struct *jpg, const JSAMPLE* s
 			}
 		}
 
-		++i->yadds[lasty++];
+		++i->yadds[lasty++ - i->top];
 
 		pixel += i->width;
 
@@ -337,7 +680,7 @@ void process_scanline(const struct jpeg_decompress_struct *jpg, const JSAMPLE* s
 		}
 	}
 
-	lasty = y;
+	i->lasty = y;
 }
 
 void free_image(Image* i) {
@@ -347,23 +690,30 @@ void free_image(Image* i) {
 	if ( i->blue ) free(i->blue);
 	if ( i->yadds ) free(i->yadds);
 	if ( i->lookup_resx ) free(i->lookup_resx);
+	if ( i->glyph ) free(i->glyph);
 }
 
-void malloc_image(Image* i) {
+// Allocate an image of width x height pixels, keeping the given number
+// of rows in memory at a time.
+void malloc_image(Image* i, const int width, const int height, const int rows) {
 	i->pixel = i->red = i->green = i->blue = NULL;
 	i->yadds = NULL;
 	i->lookup_resx = NULL;
+	i->glyph = NULL;
+	i->histogram = NULL;
 
 	i->width = width;
 	i->height = height;
+	i->rows = rows;
+	i->top = i->lasty = 0;
 
-	i->yadds = (int*) malloc(height * sizeof(int));
-	i->pixel = (float*) malloc(width*height*sizeof(float));
+	i->yadds = (int*) malloc(rows * sizeof(int));
+	i->pixel = (float*) malloc(width*rows*sizeof(float));
 
 	if ( usecolors ) {
-		i->red   = (float*) malloc(width*height*sizeof(float));
-		i->green = (float*) malloc(width*height*sizeof(float));
-		i->blue  = (float*) malloc(width*height*sizeof(float));
+		i->red   = (float*) malloc(width*rows*sizeof(float));
+		i->green = (float*) malloc(width*rows*sizeof(float));
+		i->blue  = (float*) malloc(width*rows*sizeof(float));
 	}
 
 	// we allocate one extra pixel for resx because of the src .. src_end stuff in process_scanline
@@ -372,85 +722,437 @@ void malloc_image(Image* i) {
 	if ( !(i->pixel && i->yadds && i->lookup_resx) ||
 	     (usecolors && !(i->red && i->green && i->blue)) )
 	{
+		progress_clear();
 		fprintf(stderr, "Not enough memory for given output dimension\n");
 		free_image(i);
 		exit(1);
 	}
 }
 
-void init_image(Image *i, const struct jpeg_decompress_struct *jpg) {
+// Reduce an image sampled with SHAPE_COLS x SHAPE_ROWS subcells per
+// character to one cell per character, and pick each cell's glyph by
+// matching the subcells against the shapes of the palette characters.
+void shape_reduce(const Image* const s, Image* d) {
+	float ink[SHAPE_CELLS];
+	int x, y, sx, sy;
+
+	malloc_image(d, s->width / SHAPE_COLS, s->height / SHAPE_ROWS, s->height / SHAPE_ROWS);
+
+	if ( (d->glyph = (char*) malloc(d->width * d->height)) == NULL ) {
+		progress_clear();
+		fprintf(stderr, "Not enough memory for given output dimension\n");
+		free_image(d);
+		exit(1);
+	}
+
+	for ( y=0; y < d->height; ++y ) {
+		for ( x=0; x < d->width; ++x ) {
+			const int dst = x + y * d->width;
+			float lum, r, g, b;
+			lum = r = g = b = 0.0f;
+
+			for ( sy=0; sy < SHAPE_ROWS; ++sy ) {
+				for ( sx=0; sx < SHAPE_COLS; ++sx ) {
+					const int src = x*SHAPE_COLS + sx + (y*SHAPE_ROWS + sy) * s->width;
+
+					// the glyph is drawn flipped, so match it against a flipped cell
+					const int k = (flipx? SHAPE_COLS - sx - 1 : sx)
+						+ (flipy? SHAPE_ROWS - sy - 1 : sy) * SHAPE_COLS;
+
+					ink[k] = invert? s->pixel[src] : 1.0f - s->pixel[src];
+					lum += s->pixel[src];
+
+					if ( usecolors ) {
+						r += s->red  [src];
+						g += s->green[src];
+						b += s->blue [src];
+					}
+				}
+			}
+
+			d->pixel[dst] = lum / (float) SHAPE_CELLS;
+
+			if ( usecolors ) {
+				d->red  [dst] = r / (float) SHAPE_CELLS;
+				d->green[dst] = g / (float) SHAPE_CELLS;
+				d->blue [dst] = b / (float) SHAPE_CELLS;
+			}
+
+			d->glyph[dst] = shape_match(ink);
+		}
+	}
+}
+
+void init_image(Image *i, const decoder *d) {
 	int dst_x;
 
-	i->resize_y = (float) (i->height - 1) / (float) (jpg->output_height - 1);
-	i->resize_x = (float) (jpg->output_width - 1) / (float) (i->width );
+	i->top = i->lasty = 0;
+
+	i->resize_y = (float) (i->height - 1) / (float) (d->height - 1);
+	i->resize_x = (float) (d->width - 1) / (float) (i->width );
 
 	for ( dst_x=0; dst_x <= i->width; ++dst_x ) {
 		i->lookup_resx[dst_x] = ROUND( (float) dst_x * i->resize_x );
-		i->lookup_resx[dst_x] *= jpg->out_color_components;
+		i->lookup_resx[dst_x] *= d->components;
 	}
 }
 
-void decompress(FILE *fp, FILE *fout) {
-	int row_stride;
-	struct jpeg_error_mgr jerr;
-	struct jpeg_decompress_struct jpg;
-	JSAMPARRAY buffer;
-	Image image;
+// Number of pixels to sample for each output character.
+void sample_size(int *subx, int *suby) {
+	*subx = *suby = 1;
+
+	if ( use_shapes ) {
+		*subx = SHAPE_COLS;
+		*suby = SHAPE_ROWS;
+	}
 
-	jpg.err = jpeg_std_error(&jerr);
-	jpeg_create_decompress(&jpg);
-	jpeg_stdio_src(&jpg, fp);
-	jpeg_read_header(&jpg, TRUE);
-	jpeg_start_decompress(&jpg);
+	if ( unicode )
+		unicode_cell_size(subx, suby);
+}
 
-	if ( jpg.data_precision != 8 ) {
-		fprintf(stderr,
-			"Image has %d bits color channels, we only support 8-bit.\n",
-			jpg.data_precision);
-		exit(1);
+static void print_header(FILE *f) {
+	if ( output_format ) {
+		cells_write_header(f,
+			(usecolors? CELLS_COLORS : 0) | (usecolors && colorfill? CELLS_FILL : 0) |
+			(output_format == FORMAT_CELLS_RLE? CELLS_RLE : 0) |
+			(use_border? CELLS_BORDER : 0) | (invert? CELLS_INVERT : 0),
+			width, height, ascii_palette);
+		return;
+	}
+
+	if ( clearscr ) {
+		fprintf(f, "%c[2J", 27); // ansi code for clear
+		fprintf(f, "%c[0;0H", 27); // move to upper left
+	}
+
+	if ( html && !html_rawoutput ) print_html_start(html_fontsize, f);
+	if ( use_border ) print_border(width, f);
+}
+
+// The characters come from unicode.c, not from the palette.
+static void print_unicode(const Image* const i, const int chars, FILE *f) {
+	(void) chars;
+	print_image_unicode(i, f);
+}
+
+// Each combination of output options has its own kernel for printing
+// rows, so the options are looked at once per image instead of for each
+// character.
+static print_kernel pick_kernel(void) {
+	if ( output_format )
+		return print_cells;
+
+	if ( unicode )
+		return print_unicode;
+
+	if ( !usecolors )
+		return plain_kernels[!!use_shapes << 2 | !!flipx << 1 | !!invert];
+
+	return colors_kernels[!!use_shapes << 5 | !!html << 4 | !!colorfill << 3 |
+		!!convert_grayscale << 2 | !!flipx << 1 | !!invert];
+}
+
+// Print rows top .. upto-1 of the image, and make room for more rows.
+// Rows are only complete once all source scanlines for them are in.
+void print_rows(Image *i, const int upto, FILE *f) {
+	Image view = *i, cells;
+	const Image *out = &view;
+	const int n = upto - i->top;
+	const int rest = i->rows - n;
+
+	if ( n <= 0 )
+		return;
+
+	view.height = n;
+	normalize(&view);
+
+	if ( levels )
+		apply_levels(&view);
+
+	if ( use_shapes ) {
+		shape_reduce(&view, &cells);
+		out = &cells;
+	}
+
+	i->print(out, (int) strlen(ascii_palette) - 1, f);
+
+	if ( use_shapes ) free_image(&cells);
+
+	// move the unfinished rows to the top
+	if ( rest > 0 ) {
+		memmove(i->yadds, i->yadds + n, rest * sizeof(int));
+		memset(i->yadds + rest, 0, n * sizeof(int));
+		memmove(i->pixel, i->pixel + n * i->width, rest * i->width * sizeof(float));
+		memset(i->pixel + rest * i->width, 0, n * i->width * sizeof(float));
+
+		if ( usecolors ) {
+			float *planes[3];
+			int c;
+
+			planes[0] = i->red;
+			planes[1] = i->green;
+			planes[2] = i->blue;
+
+			for ( c=0; c < 3; ++c ) {
+				memmove(planes[c], planes[c] + n * i->width, rest * i->width * sizeof(float));
+				memset(planes[c] + rest * i->width, 0, n * i->width * sizeof(float));
+			}
+		}
+	}
+
+	i->top = upto;
+}
+
+// The row and image buffers are kept between images, so converting
+// images of the same size again (e.g., with --watch) doesn't allocate.
+static JSAMPLE *row = NULL;
+static size_t row_size = 0;
+static Image image;
+static int have_image = 0;
+
+// Decode and print an image whose header has been read, at the output
+// dimensions set by aspect_ratio().
+//
+// With --stream, each row of characters is printed as soon as it is
+// complete, and only the rows being filled are kept, so the memory used
+// doesn't depend on the output height.  --flipy needs the last row
+// first, and --auto-levels and --equalize the whole image, so then the
+// whole image is kept as usual.
+void render(decoder *d, FILE *fout) {
+	static const char *quality_names[] = { "default", "fast", "best" };
+	const double started = timer_now();
+	const size_t size = d->width * d->components;
+	const int stream = streaming && !flipy && !levels;
+	FILE *f = fout;
+	long at = -1, end;
+	int subx, suby, rows;
+
+	if ( size > row_size ) {
+		free(row);
+		if ( (row = (JSAMPLE*) malloc(size)) == NULL ) {
+			progress_clear();
+			fputs("Not enough memory to decode image\n", stderr);
+			exit(1);
+		}
+		row_size = size;
 	}
 
-	row_stride = jpg.output_width * jpg.output_components;
+	sample_size(&subx, &suby);
+
+	// a scanline is added to up to resize_y + 1 rows, and a row of
+	// characters is printed when all of its suby rows are done
+	rows = height * suby;
 
-	buffer = (*jpg.mem->alloc_sarray)((j_common_ptr) &jpg, JPOOL_IMAGE, row_stride, 1);
+	if ( stream && d->height > 1 ) {
+		const int span = 2 + (height * suby - 1) / (d->height - 1);
+
+		if ( suby + span < rows )
+			rows = suby + span;
+	}
 
-	aspect_ratio(jpg.output_width, jpg.output_height);
+	if ( !have_image || image.width != width * subx || image.height != height * suby ||
+	     image.rows != rows || (image.red != NULL) != (usecolors != 0) )
+	{
+		if ( have_image ) free_image(&image);
+		malloc_image(&image, width * subx, height * suby, rows);
+		have_image = 1;
+	}
 
-	malloc_image(&image);
 	clear(&image);
 
-	if ( verbose ) print_info(&jpg);
+	if ( verbose ) print_info(d);
 
-	init_image(&image, &jpg);
+	init_image(&image, d);
+	image.histogram = NULL;
+
+	if ( levels ) {
+		memset(histogram, 0, sizeof(histogram));
+		image.histogram = histogram;
+	}
+	image.print = pick_kernel();
 
-	while ( jpg.output_scanline < jpg.output_height ) {
-		jpeg_read_scanlines(&jpg, buffer, 1);
-		process_scanline(&jpg, buffer[0], &image);
-		if ( verbose ) print_progress(&jpg);
+	if ( stream ) {
+		output_drain(); // so we can write to fout directly
+		at = progress_rate? ftell(f) : -1;
+		print_header(f);
+	}
+
+	while ( d->scanline < d->height ) {
+		decoder_read_row(d, row);
+		++d->scanline;
+		process_scanline(d, row, &image);
+		if ( progress_rate ) progress_row(d);
+
+		if ( stream && image.lasty - image.top >= suby ) {
+			print_rows(&image, image.top + (image.lasty - image.top) / suby * suby, f);
+			fflush(f);
+		}
 	}
 
 	if ( verbose ) {
-		fprintf(stderr, "\n");
+		progress_clear();
+		fprintf(stderr, "Decoded in %.3f seconds (%s quality)\n",
+			timer_now() - started, quality_names[quality]);
 		fflush(stderr);
 	}
 
-	normalize(&image);
+	if ( levels )
+		make_levels();
 
-	if ( clearscr ) {
-		fprintf(fout, "%c[2J", 27); // ansi code for clear
-		fprintf(fout, "%c[0;0H", 27); // move to upper left
+	if ( !stream ) {
+		f = output_begin(fout);
+		at = progress_rate? ftell(f) : -1;
+		print_header(f);
+	}
+
+	print_rows(&image, image.height, f);
+
+	if ( !output_format ) {
+		if ( use_border ) print_border(width, f);
+		if ( html && !html_rawoutput ) print_html_end(f);
+	}
+
+	// output to pipes and compressed output can't be counted this way
+	if ( at >= 0 && (end = ftell(f)) >= at )
+		progress_output(end - at);
+
+	if ( stream )
+		fflush(f);
+	else
+		output_end(f, fout);
+}
+
+// Convert an opened image with the current options.
+void convert(decoder *d, FILE *fout) {
+	const int store_flipx = flipx, store_flipy = flipy;
+	int x = 0, y = 0, w = d->width, h = d->height;
+	const int cropped = crop_region(d->width, d->height, &x, &y, &w, &h);
+	jmp_buf env, *last;
+
+	aspect_ratio(w, h);
+	progress_source(d->width, d->height);
+
+	if ( d->b->shrink ) {
+		const int full_width = d->width, full_height = d->height;
+		int subx, suby;
+		sample_size(&subx, &suby);
+
+		// enough pixels for the output in the cropped part
+		d->b->shrink(d, (int) (((long) width * subx * full_width + w - 1) / w),
+		                (int) (((long) height * suby * full_height + h - 1) / h));
+
+		if ( cropped && d->width != full_width ) {
+			x = (int) ((long) x * d->width / full_width);
+			w = (int) ((long) w * d->width / full_width);
+			if ( w < 1 ) w = 1;
+			if ( x + w > d->width ) x = d->width - w;
+		}
+
+		if ( cropped && d->height != full_height ) {
+			y = (int) ((long) y * d->height / full_height);
+			h = (int) ((long) h * d->height / full_height);
+			if ( h < 1 ) h = 1;
+			if ( y + h > d->height ) y = d->height - h;
+		}
+	}
+
+	if ( cropped ) {
+		// a flipped thumbnail has the region on the other side
+		if ( d->flipx ) x = d->width - x - w;
+		if ( d->flipy ) y = d->height - y - h;
+
+		decoder_crop(d, x, y, w, h);
+	}
+
+	flipx ^= d->flipx;
+	flipy ^= d->flipy;
+
+	// an image that fails jumps past the end, so the flips are put back
+	// before the caller gets it, or the next image would come out flipped
+	last = decoder_catch(&env);
+
+	if ( setjmp(env) ) {
+		char why[256];
+
+		flipx = store_flipx;
+		flipy = store_flipy;
+		decoder_catch(last);
+
+		snprintf(why, sizeof(why), "%s", decoder_failure());
+		decoder_fail("%s", why);
 	}
 
-	if ( html && !html_rawoutput ) print_html_start(html_fontsize, fout);
-	if ( use_border ) print_border(image.width);
+	render(d, fout);
+
+	decoder_catch(last);
+	flipx = store_flipx;
+	flipy = store_flipy;
+}
+
+// Convert an image from fp, or from data if fp is NULL.
+static int decompress_from(FILE *fp, const unsigned char *data, const size_t size, FILE *fout) {
+	static decoder d; // not on the stack, since we may longjmp back here
+	jmp_buf env;
+
+	d.b = NULL;
+	decoder_damaged();
 
-	(!usecolors? print_image : print_image_colors) (&image, (int) strlen(ascii_palette) - 1, fout);
+	if ( setjmp(env) ) {
+		decoder_catch(NULL);
 
-	if ( use_border ) print_border(image.width);
-	if ( html && !html_rawoutput ) print_html_end(fout);
+		if ( d.b != NULL && d.b->close != NULL )
+			d.b->close(&d);
+
+		return -1;
+	}
 
-	free_image(&image);
+	decoder_catch(&env);
+
+	// with --render, the image is decoded once for all outputs
+	if ( render_count )
+		render_outputs(fp, fout);
+	else {
+		if ( fp != NULL )
+			decoder_open(&d, fp);
+		else
+			decoder_open_mem(&d, data, size);
+
+		convert(&d, fout);
+		d.b->close(&d);
+	}
+
+	decoder_catch(NULL);
+	return decoder_damaged()? 1 : 0;
+}
+
+// Convert an image.  Returns zero on success, -1 if the image could not
+// be read, and 1 if it was damaged and only partially converted; see
+// decoder_failure() for why.
+int decompress(FILE *fp, FILE *fout) {
+	return decompress_from(fp, NULL, 0, fout);
+}
+
+// The same, for an image file read into memory.  JPEG images are decoded
+// where they are; --render and the other formats read it as a stream.
+int decompress_mem(const unsigned char *data, const size_t size, FILE *fout) {
+#ifdef HAVE_FMEMOPEN
+	const backend *b = size? find_backend(data[0]) : NULL;
+
+	if ( render_count || (b != NULL && b->open_mem == NULL) ) {
+		FILE *fp = fmemopen((void*) data, size, "rb");
+		int result;
+
+		if ( fp == NULL ) {
+			progress_clear();
+			fputs("Not enough memory to read image\n", stderr);
+			exit(1);
+		}
+
+		result = decompress_from(fp, NULL, 0, fout);
+		fclose(fp);
+		return result;
+	}
+#endif
 
-	jpeg_finish_decompress(&jpg);
-	jpeg_destroy_decompress(&jpg);
+	return decompress_from(NULL, data, size, fout);
 }
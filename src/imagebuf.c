@@ -0,0 +1,150 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "decoder.h"
+#include "image.h"
+
+image_t* image_new(int width, int height, int components) {
+	image_t *p = (image_t*) malloc(sizeof(image_t));
+
+	if ( p == NULL ||
+	     (p->pixels = (JSAMPLE*) malloc((size_t) width * height * components)) == NULL )
+	{
+		progress_clear();
+		fputs("Not enough memory to hold decoded image\n", stderr);
+		exit(1);
+	}
+
+	p->w = width;
+	p->h = height;
+	p->components = components;
+	return p;
+}
+
+void image_destroy(image_t *p) {
+	if ( p ) {
+		free(p->pixels);
+		free(p);
+	}
+}
+
+// Decode a whole image.  If it fails, the decoder and image are freed
+// before passing the failure on.
+image_t* image_read(FILE *f) {
+	static decoder d; // not on the stack, since we may longjmp back here
+	static image_t *p;
+	jmp_buf env, *last;
+
+	d.b = NULL;
+	p = NULL;
+	last = decoder_catch(&env);
+
+	if ( setjmp(env) ) {
+		char reason[256];
+
+		decoder_catch(last);
+		snprintf(reason, sizeof(reason), "%s", decoder_failure());
+
+		if ( d.b != NULL && d.b->close != NULL )
+			d.b->close(&d);
+
+		image_destroy(p);
+		decoder_fail("%s", reason);
+	}
+
+	decoder_open(&d, f);
+	p = image_new(d.width, d.height, d.components);
+
+	while ( d.scanline < d.height ) {
+		decoder_read_row(&d, p->pixels + (size_t) d.scanline * d.width * d.components);
+		++d.scanline;
+	}
+
+	d.b->close(&d);
+	decoder_catch(last);
+	return p;
+}
+
+// Scale s down to the size of d, averaging the pixels that make up each
+// pixel of d.
+void image_resize(const image_t* restrict s, image_t* restrict d) {
+	const int c = s->components;
+	int x, y, n;
+
+	for ( y=0; y < d->h; ++y ) {
+		const int y0 = y * s->h / d->h;
+		const int y1 = (y + 1) * s->h / d->h;
+
+		for ( x=0; x < d->w; ++x ) {
+			const int x0 = x * s->w / d->w;
+			const int x1 = (x + 1) * s->w / d->w;
+			unsigned sum[3] = { 0, 0, 0 };
+			unsigned count = 0;
+			int sx, sy;
+
+			for ( sy=y0; sy < y1 || sy == y0; ++sy ) {
+				const JSAMPLE *src = s->pixels + ((size_t) sy * s->w + x0) * c;
+
+				for ( sx=x0; sx < x1 || sx == x0; ++sx, src += c ) {
+					for ( n=0; n < c; ++n )
+						sum[n] += src[n];
+					++count;
+				}
+			}
+
+			for ( n=0; n < c; ++n )
+				d->pixels[((size_t) y * d->w + x) * c + n] = (JSAMPLE) ((sum[n] + count/2) / count);
+		}
+	}
+}
+
+// A backend that reads rows from a decoded image in memory.
+
+static int memdec_read_row(decoder *d, JSAMPLE *row) {
+	const image_t *p = (const image_t*) d->state;
+	const size_t size = (size_t) p->w * p->components;
+
+	memcpy(row, p->pixels + d->scanline * size, size);
+	return 0;
+}
+
+static void memdec_close(decoder *d) {
+	d->state = NULL; // the image belongs to the caller
+}
+
+static const backend memory_backend = {
+	"decoded", -1,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	memdec_read_row,
+	memdec_close
+};
+
+// Set up a decoder for reading p.
+void memory_decoder(decoder *d, const image_t *p) {
+	memset(d, 0, sizeof(decoder));
+	d->b = &memory_backend;
+	d->width = p->w;
+	d->height = p->h;
+	d->components = p->components;
+	d->state = (void*) p;
+}
@@ -0,0 +1,433 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include "decoder.h"
+#include "jp2a.h"
+
+#ifdef FEAT_INDEX
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "image.h"
+#include "options.h"
+#include "round.h"
+
+/*
+ * --index decodes each image once, and writes IMAGE.jp2a-index next to it
+ * with the image scaled down to 1024, 512, 256 and 128 pixels wide.  When
+ * the image is converted later and the index is valid, it is mapped into
+ * memory and read as an image of its own (see index_backend), whose
+ * shrink picks the smallest level with enough pixels for the output,
+ * instead of decoding the image again.  So changing the output size only
+ * costs the conversion.  --quality=best always decodes the image.
+ *
+ * An index is valid if the image still has the size, modification time
+ * and hash of its first and last blocks written in it; otherwise it's
+ * ignored, and the image is decoded as usual.  The index is a header followed by the
+ * levels, largest first, each the rows of samples a decoder delivers.  It
+ * is in the byte order of the machine that wrote it, and the magic number
+ * doesn't match on others.
+ */
+
+#define INDEX_SUFFIX  ".jp2a-index"
+#define INDEX_MAGIC   0x4950324a // "J2PI", starting with the 'J' of index_backend
+#define INDEX_VERSION 2
+#define INDEX_LEVELS  4
+#define INDEX_WIDTH   1024 // of the largest level
+#define INDEX_HASHED  65536 // bytes hashed at each end of the image
+
+typedef struct index_level_ {
+	uint32_t width, height;
+	uint64_t offset; // from the start of the file
+} index_level;
+
+typedef struct index_header_ {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint32_t source_hash;  // source_hash() of the image file
+	uint32_t width, height; // of the image
+	uint32_t components;
+	uint32_t flipx, flipy;
+	uint32_t levels;
+	uint32_t reserved;
+	index_level level[INDEX_LEVELS];
+} index_header;
+
+typedef struct index_state_ {
+	const index_header *h;
+	const JSAMPLE *pixels; // of the level picked by shrink, or NULL
+} index_state;
+
+// Put the name of the index of path in name.  Returns nonzero if it's too
+// long.
+static int index_name(const char *path, char *name, const size_t size) {
+	return snprintf(name, size, "%s%s", path, INDEX_SUFFIX) >= (int) size;
+}
+
+// Hash the first and last INDEX_HASHED bytes of the image, which may be
+// given in data already.  With its size and modification time this finds
+// images that were changed, without reading all of a large image each
+// time it is converted.  Returns nonzero if it can't be read.
+static int source_hash(const char *path, const unsigned char *data, const size_t size,
+	unsigned long *hash)
+{
+	const size_t head = size < INDEX_HASHED? size : INDEX_HASHED;
+	const size_t tail = size - head < INDEX_HASHED? head : size - INDEX_HASHED;
+	unsigned char buf[INDEX_HASHED];
+	int failed;
+	FILE *f;
+
+	*hash = HASH_INIT;
+
+	if ( data != NULL ) {
+		*hash = hash_bytes(data, head, *hash);
+		*hash = hash_bytes(data + tail, size - tail, *hash);
+		return 0;
+	}
+
+	if ( (f = fopen(path, "rb")) == NULL )
+		return -1;
+
+	failed = fread(buf, 1, head, f) != head;
+	*hash = hash_bytes(buf, head, *hash);
+
+	if ( !failed && (fseek(f, (long) tail, SEEK_SET) || fread(buf, 1, size - tail, f) != size - tail) )
+		failed = 1;
+
+	*hash = hash_bytes(buf, size - tail, *hash);
+	fclose(f);
+	return failed? -1 : 0;
+}
+
+// The backend reading an index as an image
+
+static int indexdec_open_mem(decoder *d, const unsigned char *data, const size_t size) {
+	const index_header *h = (const index_header*) data;
+	index_state *s;
+	unsigned n;
+
+	if ( size < sizeof(index_header) || h->magic != INDEX_MAGIC ||
+	     h->version != INDEX_VERSION || h->levels < 1 || h->levels > INDEX_LEVELS ||
+	     (h->components != 1 && h->components != 3) )
+		return -1;
+
+	for ( n=0; n < h->levels; ++n ) {
+		const index_level *l = &h->level[n];
+
+		if ( l->width < 1 || l->height < 1 || l->offset > size ||
+		     (uint64_t) l->width * l->height * h->components > size - l->offset )
+			return -1;
+	}
+
+	if ( (s = (index_state*) malloc(sizeof(index_state))) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory to read index\n", stderr);
+		exit(1);
+	}
+
+	s->h = h;
+	s->pixels = NULL;
+
+	// the size of the image, so --crop and the aspect ratio work as for it
+	d->state = s;
+	d->width = h->width;
+	d->height = h->height;
+	d->components = h->components;
+	d->flipx = h->flipx;
+	d->flipy = h->flipy;
+	return 0;
+}
+
+// Switch to the smallest level with enough pixels: twice those needed, so
+// averaging them again comes close to averaging the whole image, or just
+// enough with --quality=fast.  The largest is good enough if it's the
+// whole image.
+static void indexdec_shrink(decoder *d, const int width, const int height) {
+	index_state *s = (index_state*) d->state;
+	const index_header *h = s->h;
+	const uint32_t factor = quality == QUALITY_FAST? 1 : 2;
+	int n;
+
+	for ( n = h->levels - 1; n > 0; --n )
+		if ( h->level[n].width >= factor * width && h->level[n].height >= factor * height )
+			break;
+
+	if ( n == 0 && h->level[0].width != h->width &&
+	     (h->level[0].width < factor * width || h->level[0].height < factor * height) )
+		decoder_fail("The index is too small for %dx%d pixels", width, height);
+
+	s->pixels = (const JSAMPLE*) h + h->level[n].offset;
+	d->width = h->level[n].width;
+	d->height = h->level[n].height;
+}
+
+static int indexdec_read_row(decoder *d, JSAMPLE *row) {
+	const index_state *s = (const index_state*) d->state;
+	const size_t size = (size_t) d->width * d->components;
+
+	// rows are only read from a level
+	if ( s->pixels == NULL )
+		return -1;
+
+	memcpy(row, s->pixels + (size_t) d->scanline * size, size);
+	return 0;
+}
+
+static void indexdec_close(decoder *d) {
+	free(d->state);
+	d->state = NULL;
+}
+
+const backend index_backend = {
+	"jp2a index", 'J',
+	NULL,
+	indexdec_open_mem,
+	indexdec_shrink,
+	NULL,
+	indexdec_read_row,
+	indexdec_close
+};
+
+// Convert an image from its index, if it has a valid one.  data is the
+// image file if it has been read already.  Returns what decompress()
+// does, or -1 if the image has to be decoded instead.
+int index_render(const char *path, const unsigned char *data, const size_t size, FILE *fout) {
+	char name[4096];
+	struct stat st, ist;
+	const index_header *h;
+	unsigned long hash;
+	void *map;
+	int fd, result;
+
+	if ( index_name(path, name, sizeof(name)) || stat(path, &st) )
+		return -1;
+
+	if ( (fd = open(name, O_RDONLY)) < 0 )
+		return -1;
+
+	if ( fstat(fd, &ist) || ist.st_size < (off_t) sizeof(index_header) ||
+	     (map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED )
+	{
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	h = (const index_header*) map;
+
+	if ( h->magic != INDEX_MAGIC || h->version != INDEX_VERSION ||
+	     h->source_size != (uint64_t) st.st_size || h->source_mtime != (int64_t) st.st_mtime ||
+	     (data != NULL && size != (size_t) st.st_size) ||
+	     source_hash(path, data, (size_t) st.st_size, &hash) || h->source_hash != hash )
+	{
+		if ( verbose ) {
+			progress_clear();
+			fprintf(stderr, "Ignoring outdated index %s\n", name);
+		}
+
+		munmap(map, ist.st_size);
+		return -1;
+	}
+
+	if ( verbose ) {
+		progress_clear();
+		fprintf(stderr, "Index: %s\n", name);
+	}
+
+	result = decompress_mem((const unsigned char*) map, ist.st_size, fout);
+
+	if ( result < 0 && verbose ) {
+		progress_clear();
+		fprintf(stderr, "Could not use %s: %s\n", name, decoder_failure());
+	}
+
+	munmap(map, ist.st_size);
+	return result;
+}
+
+// Decode an image, and write its index.  Returns nonzero on failure.
+int index_file(const char *path) {
+	static decoder d; // not on the stack, since we may longjmp back here
+	static image_t *p, *levels[INDEX_LEVELS];
+	static FILE *fp;
+	char name[4096], temp[4096 + 8];
+	index_header h;
+	struct stat st;
+	unsigned long hash;
+	uint64_t offset;
+	jmp_buf env;
+	FILE *f;
+	int n, failed = 0;
+
+	if ( verbose ) {
+		progress_clear();
+		fprintf(stderr, "File: %s\n", path);
+	}
+
+	progress_file(path);
+
+	if ( index_name(path, name, sizeof(name)) ) {
+		progress_clear();
+		fprintf(stderr, "Index name for %s is too long\n", path);
+		return 1;
+	}
+
+	if ( stat(path, &st) || source_hash(path, NULL, (size_t) st.st_size, &hash) ||
+	     (fp = fopen(path, "rb")) == NULL )
+	{
+		progress_clear();
+		fprintf(stderr, "Can't open %s\n", path);
+		return 1;
+	}
+
+	d.b = NULL;
+	p = NULL;
+	memset(levels, 0, sizeof(levels));
+	decoder_damaged();
+
+	if ( setjmp(env) ) {
+		decoder_catch(NULL);
+
+		if ( d.b != NULL && d.b->close != NULL )
+			d.b->close(&d);
+
+		image_destroy(p);
+		fclose(fp);
+		progress_clear();
+		fprintf(stderr, "Could not index %s: %s\n", path, decoder_failure());
+		return 1;
+	}
+
+	decoder_catch(&env);
+	decoder_open(&d, fp);
+	p = image_new(d.width, d.height, d.components);
+
+	while ( d.scanline < d.height ) {
+		decoder_read_row(&d, p->pixels + (size_t) d.scanline * d.width * d.components);
+		++d.scanline;
+	}
+
+	d.b->close(&d);
+	decoder_catch(NULL);
+	fclose(fp);
+
+	// an index of a damaged image would hide that it is
+	if ( decoder_damaged() ) {
+		progress_clear();
+		fprintf(stderr, "Could not index %s: %s\n", path, decoder_failure());
+		image_destroy(p);
+		return 1;
+	}
+
+	memset(&h, 0, sizeof(h));
+	h.magic = INDEX_MAGIC;
+	h.version = INDEX_VERSION;
+	h.source_size = st.st_size;
+	h.source_mtime = st.st_mtime;
+	h.source_hash = hash;
+	h.width = p->w;
+	h.height = p->h;
+	h.components = p->components;
+	h.flipx = d.flipx;
+	h.flipy = d.flipy;
+
+	// each level is scaled down from the one before, and one that isn't
+	// smaller than the image is the image itself
+	offset = sizeof(h);
+
+	for ( n=0; n < INDEX_LEVELS; ++n ) {
+		const int w = INDEX_WIDTH >> n;
+		const int k = h.levels;
+		image_t *l;
+
+		if ( k && levels[k-1]->w <= w )
+			continue;
+
+		if ( p->w <= w )
+			l = p;
+		else {
+			const int lh = ROUND((float) w * p->h / p->w);
+
+			l = image_new(w, lh > 0? lh : 1, p->components);
+			image_resize(k? levels[k-1] : p, l);
+		}
+
+		levels[k] = l;
+		h.level[k].width = l->w;
+		h.level[k].height = l->h;
+		h.level[k].offset = offset;
+		offset += (uint64_t) l->w * l->h * p->components;
+		++h.levels;
+	}
+
+	// written to the side and renamed, so readers never see half of it
+	snprintf(temp, sizeof(temp), "%s.tmp", name);
+
+	if ( (f = fopen(temp, "wb")) == NULL ) {
+		progress_clear();
+		fprintf(stderr, "Could not open '%s' for writing.\n", temp);
+		failed = 1;
+	} else {
+		fwrite(&h, sizeof(h), 1, f);
+
+		for ( n=0; n < (int) h.levels; ++n )
+			fwrite(levels[n]->pixels, (size_t) levels[n]->w * levels[n]->h * p->components, 1, f);
+
+		failed = ferror(f);
+
+		if ( fclose(f) || failed || rename(temp, name) ) {
+			progress_clear();
+			fprintf(stderr, "Could not write index '%s'\n", name);
+			remove(temp);
+			failed = 1;
+		}
+	}
+
+	for ( n=0; n < (int) h.levels; ++n )
+		if ( levels[n] != p )
+			image_destroy(levels[n]);
+
+	image_destroy(p);
+	return failed;
+}
+
+#else
+
+int index_render(const char *path, const unsigned char *data, const size_t size, FILE *fout) {
+	return -1;
+}
+
+int index_file(const char *path) {
+	progress_clear();
+	fputs("--index is not supported on this system\n", stderr);
+	return 1;
+}
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+/*
+ * Turns the output of jp2a --format=cells back into text, ANSI colors or
+ * HTML, the same as jp2a would have printed it.
+ *
+ *   jp2a-cells [--colors] [--html] [--html-raw] [--html-fontsize=N]
+ *              [--html-no-bold] [--html-title=...] [FILE...]
+ *
+ * Without files, standard input is read.  Colors are only printed for
+ * documents that have them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cells.h"
+#include "jp2a.h"
+
+// used by html.c
+int invert = 1;
+int usecolors = 0;
+int html_bold = 1;
+const char *html_title = "jp2a converted image";
+
+static int colors = 0, html = 0, html_raw = 0, html_fontsize = 8;
+
+static void usage() {
+	fputs("Usage: jp2a-cells [--colors] [--html] [--html-raw] [--html-fontsize=N]\n"
+	      "                  [--html-no-bold] [--html-title=...] [FILE...]\n", stderr);
+	exit(1);
+}
+
+static unsigned char* read_all(FILE *f, size_t *size) {
+	unsigned char *data = NULL;
+	size_t room = 0;
+
+	*size = 0;
+
+	for ( ;; ) {
+		if ( *size == room ) {
+			room = room? room * 2 : 65536;
+
+			if ( (data = (unsigned char*) realloc(data, room)) == NULL ) {
+				fputs("Not enough memory\n", stderr);
+				exit(1);
+			}
+		}
+
+		if ( fread(data + *size, 1, 1, f) != 1 )
+			break;
+
+		*size += 1 + fread(data + *size + 1, 1, room - *size - 1, f);
+	}
+
+	return data;
+}
+
+static void print_border(const unsigned width, FILE *f) {
+	unsigned n;
+
+	fputc('+', f);
+	for ( n=0; n < width; ++n )
+		fputc('-', f);
+	fputs("+\n", f);
+}
+
+static void print_row(const cells_doc *d, const cells_cell *row, FILE *f) {
+	const int border = d->flags & CELLS_BORDER;
+	const int fill = d->flags & CELLS_FILL;
+	char s[HTML_CHAR_MAX + 1];
+	unsigned x;
+
+	if ( border ) fputc('|', f);
+
+	for ( x=0; x < d->width; ++x ) {
+		const cells_cell *c = &row[x];
+		const char ch = (char) d->palette[c->glyph];
+
+		if ( !usecolors )
+			fputc(ch, f);
+		else if ( html ) {
+			if ( fill )
+				*html_char_fill(s, ch, c->fg[0], c->fg[1], c->fg[2], c->bg[0], c->bg[1], c->bg[2]) = 0;
+			else
+				*html_char(s, ch, c->fg[0], c->fg[1], c->fg[2]) = 0;
+
+			fputs(s, f);
+		}
+		else if ( c->ansi )
+			fprintf(f, "%c[%dm%c%c[0m", 27, c->ansi, ch, 27);
+		else
+			fputc(ch, f);
+	}
+
+	if ( border ) fputc('|', f);
+
+	if ( html && usecolors )
+		print_html_newline(f);
+	else
+		fputc('\n', f);
+}
+
+// Print the documents in data.  Returns zero on success.
+static int convert(const unsigned char *p, const size_t size, FILE *f) {
+	const unsigned char *end = p + size;
+
+	while ( p < end ) {
+		cells_cell *row;
+		cells_doc d;
+		unsigned y;
+
+		if ( cells_parse(p, end - p, &d) || (size_t) d.width + 1 > (size_t) -1 / sizeof(cells_cell) )
+			return -1;
+
+		if ( (row = (cells_cell*) malloc(((size_t) d.width + 1) * sizeof(cells_cell))) == NULL ) {
+			fputs("Not enough memory\n", stderr);
+			exit(1);
+		}
+
+		invert = (d.flags & CELLS_INVERT) != 0;
+		usecolors = colors && (d.flags & CELLS_COLORS);
+
+		if ( html && !html_raw ) print_html_start(html_fontsize, f);
+		if ( d.flags & CELLS_BORDER ) print_border(d.width, f);
+
+		for ( p = d.rows, y=0; y < d.height; ++y ) {
+			if ( (p = cells_row(&d, p, row)) == NULL ) {
+				free(row);
+				return -1;
+			}
+
+			print_row(&d, row, f);
+		}
+
+		if ( d.flags & CELLS_BORDER ) print_border(d.width, f);
+		if ( html && !html_raw ) print_html_end(f);
+
+		free(row);
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int n, files = 0, failed = 0;
+
+	for ( n=1; n < argc; ++n ) {
+		const char *s = argv[n];
+
+		if ( s[0] != '-' || !s[1] ) ++files;
+		else if ( !strcmp(s, "--colors") || !strcmp(s, "--color") ) colors = 1;
+		else if ( !strcmp(s, "--html") ) html = 1;
+		else if ( !strcmp(s, "--html-raw") ) html = html_raw = 1;
+		else if ( !strcmp(s, "--html-no-bold") ) html_bold = 0;
+		else if ( !strncmp(s, "--html-title=", 13) ) html_title = s + 13;
+		else if ( sscanf(s, "--html-fontsize=%d", &html_fontsize) == 1 ) ;
+		else usage();
+	}
+
+	for ( n=1; n < argc || !files; ++n ) {
+		const char *name = files? argv[n] : "-";
+		unsigned char *data;
+		size_t size;
+		FILE *f;
+
+		if ( files && argv[n][0] == '-' && argv[n][1] )
+			continue;
+
+		if ( (f = strcmp(name, "-")? fopen(name, "rb") : stdin) == NULL ) {
+			fprintf(stderr, "Can't open %s\n", name);
+			failed = 1;
+			continue;
+		}
+
+		data = read_all(f, &size);
+
+		if ( f != stdin )
+			fclose(f);
+
+		if ( convert(data, size, stdout) ) {
+			fprintf(stderr, "%s is not jp2a --format=cells output\n",
+				f == stdin? "Standard input" : name);
+			failed = 1;
+		}
+
+		free(data);
+
+		if ( !files )
+			break;
+	}
+
+	return failed;
+}
@@ -13,10 +13,23 @@
 
 #include <stdio.h>
 
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
 
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#include "decoder.h"
 #include "jp2a.h"
 #include "options.h"
 
@@ -28,91 +41,268 @@
 #include <fcntl.h>
 #endif
 
-int main(int argc, char** argv) {
-	int store_width, store_height, store_autow, store_autoh;
-	FILE *fout = stdout;
-#ifdef FEAT_CURL
-	FILE *fr;
-	int fd;
-#endif
-	FILE *fp;
-	int n;
-
-	parse_options(argc, argv);
+int store_width, store_height, store_autow, store_autoh;
 
+// Remember the output dimensions given on the command line
+void save_dimensions() {
 	store_width = width;
 	store_height = height;
 	store_autow = auto_width;
 	store_autoh = auto_height;
+}
 
-	if ( strcmp(fileout, "-") ) {
-		if ( (fout = fopen(fileout, "wb")) == NULL ) {
-			fprintf(stderr, "Could not open '%s' for writing.\n", fileout);
-			return 1;
-		}
+// Each image is sized from the dimensions given on the command line
+void restore_dimensions() {
+	width = store_width;
+	height = store_height;
+	auto_width = store_autow;
+	auto_height = store_autoh;
+}
+
+// Report why an image could not be rendered.  Returns zero on success.
+static int render_result(const int result, const char *name) {
+	switch ( result ) {
+	case 0:
+		return 0;
+	case 1:
+		progress_clear();
+		fprintf(stderr, "Converted part of %s: %s\n", name, decoder_failure());
+		return 1;
+	default:
+		progress_clear();
+		fprintf(stderr, "Could not convert %s: %s\n", name, decoder_failure());
+		return 1;
 	}
+}
 
-	for ( n=1; n<argc; ++n ) {
+// Render an image to fout, and report why if it fails.  Returns zero on
+// success.
+static int render_stream(FILE *fp, const char *name, FILE *fout) {
+	return render_result(decompress(fp, fout), name);
+}
 
-		width = store_width;
-		height = store_height;
-		auto_width = store_autow;
-		auto_height = store_autoh;
+// Render an image file to fout, returns zero on success.
+int render_file(const char *path, FILE *fout) {
+	const unsigned char *data;
+	size_t size;
+	FILE *fp;
+	int failed;
 
-		// skip options
-		if ( argv[n][0]=='-' && argv[n][1] )
-			continue;
+	restore_dimensions();
+	data = readahead_take(path, &size);
 
-		// read from stdin
-		if ( argv[n][0]=='-' && !argv[n][1] ) {
-			#ifdef _WIN32
-			// Good news, everyone!
-			_setmode( _fileno( stdin ), _O_BINARY );
-			#endif
+	if ( verbose ) {
+		progress_clear();
+		fprintf(stderr, "File: %s\n", path);
+	}
 
-			decompress(stdin, fout);
-			continue;
+	progress_file(path);
+
+	// an image with an --index is read from that instead, unless it has
+	// to be decoded once for several --render outputs or exactly
+	if ( !render_count && quality != QUALITY_BEST ) {
+		if ( (failed = index_render(path, data, size, fout)) >= 0 ) {
+			if ( data != NULL )
+				readahead_release();
+
+			return render_result(failed, path);
 		}
 
-		#ifdef FEAT_CURL
-		if ( is_url(argv[n]) ) {
+		restore_dimensions();
+	}
 
-			if ( verbose )
-				fprintf(stderr, "URL: %s\n", argv[n]);
+	if ( data != NULL ) {
+		failed = render_result(decompress_mem(data, size, fout), path);
+		readahead_release();
+		return failed;
+	}
 
-			fd = curl_download(argv[n], debug);
+	if ( (fp = fopen(path, "rb")) == NULL ) {
+		progress_clear();
+		fprintf(stderr, "Can't open %s\n", path);
+		return 1;
+	}
 
-			if ( (fr = fdopen(fd, "rb")) == NULL ) {
-				fputs("Could not fdopen read pipe\n", stderr);
-				return 1;
-			}
+	failed = render_stream(fp, path, fout);
+	fclose(fp);
 
-			decompress(fr, fout);
-			fclose(fr);
-			close(fd);
-			
-			continue;
-		}
+	return failed;
+}
+
+// Render an image, directory or URL given on the command line or with
+// --files-from.  Images are counted by batch_done(), so this only returns
+// the number of failures that aren't: those on standard input.
+int render_input(const char *arg, FILE *fout) {
+#ifdef FEAT_CURL
+	FILE *fr;
+	int fd;
+#endif
+	struct stat st;
+	int failed;
+
+	restore_dimensions();
+
+	// a contact sheet or poster needs each image more than once, and an
+	// index is kept next to the image, so they can't be read from a pipe
+	if ( (grid_cols || tile_cols || make_index) && ((arg[0]=='-' && !arg[1])
+#ifdef FEAT_CURL
+	     || is_url(arg)
+#endif
+	   ) )
+	{
+		progress_clear();
+		fprintf(stderr, "Can't put %s in a %s, only files\n",
+			arg[1]? arg : "standard input", grid_cols? "--grid" : tile_cols? "--tiles poster" : "--index");
+		return 1;
+	}
+
+	// read from stdin
+	if ( arg[0]=='-' && !arg[1] ) {
+		#ifdef _WIN32
+		// Good news, everyone!
+		_setmode( _fileno( stdin ), _O_BINARY );
 		#endif
 
-		// read files
-		if ( (fp = fopen(argv[n], "rb")) != NULL ) {
-			if ( verbose )
-				fprintf(stderr, "File: %s\n", argv[n]);
+		progress_file("standard input");
+		failed = render_stream(stdin, "standard input", fout);
+		progress_done();
+		return failed;
+	}
 
-			decompress(fp, fout);
-			fclose(fp);
+	#ifdef FEAT_CURL
+	if ( is_url(arg) ) {
 
-			continue;
+		if ( batch_skip(arg) )
+			return 0;
 
-		} else {
-			fprintf(stderr, "Can't open %s\n", argv[n]);
-			return 1;
+		if ( verbose ) {
+			progress_clear();
+			fprintf(stderr, "URL: %s\n", arg);
 		}
+
+		progress_file(arg);
+
+		fd = curl_download(arg, debug);
+
+		if ( (fr = fdopen(fd, "rb")) == NULL ) {
+			progress_clear();
+			fputs("Could not fdopen read pipe\n", stderr);
+			exit(1);
+		}
+
+		batch_done(arg, render_stream(fr, arg, fout));
+		fclose(fr);
+		close(fd);
+		
+		return 0;
 	}
+	#endif
 
-	if ( fout != stdout )
-		fclose(fout);
+	// read directories
+	if ( stat(arg, &st) == 0 && S_ISDIR(st.st_mode) ) {
+		batch_directory(arg);
+		return 0;
+	}
+
+#ifdef FEAT_GRID
+	if ( grid_cols ) {
+		if ( !batch_skip(arg) )
+			grid_add(arg);
+		return 0;
+	}
+#endif
+
+	// read files, and go on with the next if one fails
+	if ( !batch_skip(arg) )
+		batch_done(arg, tile_cols? tiles_file(arg) : make_index? index_file(arg) : render_file(arg, fout));
 
 	return 0;
 }
+
+int main(int argc, char** argv) {
+	FILE *file = stdout, *fout;
+	int n, ahead = 1, failed = 0, unwritten;
+
+	parse_options(argc, argv);
+	save_dimensions();
+
+	if ( strcmp(fileout, "-") ) {
+		if ( (file = fopen(fileout, "wb")) == NULL ) {
+			fprintf(stderr, "Could not open '%s' for writing.\n", fileout);
+			return 1;
+		}
+	}
+	else if ( compression && isatty(fileno(stdout)) ) {
+		fputs("Compressed output is not written to a terminal, use --output\n", stderr);
+		return 1;
+	}
+
+	// what's left of the output is written before the stream is finished
+	fout = compress_open(file);
+	atexit(output_finish);
+
+#ifdef FEAT_VIEWER
+	if ( interactive )
+		return view_file(argc, argv);
+#endif
+
+#ifdef FEAT_SHM
+	if ( shm_name ) {
+		failed = shm_frames(fout);
+
+		if ( output_drain() )
+			failed = 1;
+
+		if ( compress_close(fout) )
+			failed = 1;
+
+		if ( file != stdout )
+			fclose(file);
+
+		return failed;
+	}
+#endif
+
+	batch_begin();
+	progress_start(argc, argv);
+
+	for ( n=1; n<argc; ++n ) {
+		// skip options
+		if ( argv[n][0]=='-' && argv[n][1] )
+			continue;
+
+		// start reading the files coming up, with --read-ahead
+		for ( ahead = ahead > n? ahead : n; read_ahead && ahead < argc; ++ahead )
+			if ( !(argv[ahead][0]=='-' && argv[ahead][1]) && batch_hint(argv[ahead]) )
+				break;
+
+		failed += render_input(argv[n], fout);
+	}
+
+	if ( files_from )
+		failed += batch_files_from(files_from, fout);
+
+#ifdef FEAT_GRID
+	grid_end(fout);
+#endif
+	failed += batch_end();
+	readahead_end();
+	unwritten = render_end();
+
+	if ( output_drain() )
+		unwritten = 1;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if ( watch && watch_files(argc, argv, fout) )
+		return 1;
+#endif
+
+	if ( compress_close(fout) || unwritten )
+		return 1;
+
+	if ( file != stdout )
+		fclose(file);
+
+	// images that could not be converted have been reported and skipped
+	return failed? 2 : 0;
+}
@@ -57,6 +57,30 @@ int clearscr = 0;
 int term_width = 0;
 int term_height = 0;
 int usecolors = 0;
+int use_shapes = 0;
+int unicode = 0;
+int recursive = 0;
+int use_thumbnail = THUMBNAIL_AUTO;
+int quality = QUALITY_DEFAULT;
+int watch = 0;
+int streaming = 0;
+int interactive = 0;
+int partial = 0;
+int levels = 0;
+const char *shm_name = NULL;
+const char *output_template = "%d/%n.%e";
+const char *statefile = NULL;
+const char *files_from = NULL;
+const char *journalfile = NULL;
+int shard_index = 0, shard_count = 0;
+int read_ahead = 0;
+int grid_cols = 0, grid_rows = 0, grid_captions = 0;
+int compression = 0;
+int output_format = 0;
+int tile_cols = 0, tile_rows = 0;
+int make_index = 0;
+int progress_rate = 0;
+unsigned long options_hash = HASH_INIT; // of options that change the output
 
 int termfit =
 #ifdef FEAT_TERMLIB
@@ -69,12 +93,27 @@ int termfit =
 char ascii_palette[ASCII_PALETTE_SIZE + 1] = "   ...',;:clodxkO0KXNWM";
 
 // Default weights, must add up to 1.0
-float redweight = 0.2989f;
-float greenweight = 0.5866f;
-float blueweight = 0.1145f;
-
-// calculated in parse_options
-float RED[256], GREEN[256], BLUE[256], GRAY[256];
+#define RED_WEIGHT   0.2989f
+#define GREEN_WEIGHT 0.5866f
+#define BLUE_WEIGHT  0.1145f
+
+float redweight = RED_WEIGHT;
+float greenweight = GREEN_WEIGHT;
+float blueweight = BLUE_WEIGHT;
+
+// The tables for the default weights are made by the compiler, with the
+// same arithmetic as precalc_rgb(), so starting jp2a doesn't have to.
+#define WEIGHT_1(w, n)  ((float) (n)) * (w) / 255.0f
+#define WEIGHT_4(w, n)  WEIGHT_1(w, n),  WEIGHT_1(w, n+1),  WEIGHT_1(w, n+2),   WEIGHT_1(w, n+3)
+#define WEIGHT_16(w, n) WEIGHT_4(w, n),  WEIGHT_4(w, n+4),  WEIGHT_4(w, n+8),   WEIGHT_4(w, n+12)
+#define WEIGHT_64(w, n) WEIGHT_16(w, n), WEIGHT_16(w, n+16), WEIGHT_16(w, n+32), WEIGHT_16(w, n+48)
+#define WEIGHTS(w)      { WEIGHT_64(w, 0), WEIGHT_64(w, 64), WEIGHT_64(w, 128), WEIGHT_64(w, 192) }
+
+// calculated again in parse_options if other weights are given
+float RED[256] = WEIGHTS(RED_WEIGHT);
+float GREEN[256] = WEIGHTS(GREEN_WEIGHT);
+float BLUE[256] = WEIGHTS(BLUE_WEIGHT);
+float GRAY[256] = WEIGHTS(1.0f);
 
 const char *fileout = "-"; // stdout
 
@@ -93,16 +132,18 @@ void help() {
 	fputs(
 "\n"
 #ifdef FEAT_CURL
-"Usage: jp2a [ options ] [ file(s) | URL(s) ]\n\n"
+"Usage: jp2a [ options ] [ file(s) | directories | URL(s) ]\n\n"
 
-"Convert files or URLs from JPEG format to ASCII.\n\n"
+"Convert files or URLs from JPEG, PNG or PNM format to ASCII.\n\n"
 #else
-"Usage: jp2a [ options ] [ file(s) ]\n\n"
+"Usage: jp2a [ options ] [ file(s) | directories ]\n\n"
 
-"Convert files in JPEG format to ASCII.\n\n"
+"Convert files in JPEG, PNG or PNM format to ASCII.\n\n"
 #endif
 "OPTIONS\n"
 "  -                 Read images from standard input.\n"
+"      --auto-levels Stretch the brightness of each image so its darkest\n"
+"                    part is black and its brightest white.\n"
 "      --blue=N.N    Set RGB to grayscale conversion weight, default is 0.1145\n"
 "  -b, --border      Print a border around the output image.\n"
 "      --chars=...   Select character palette used to paint the image.\n"
@@ -110,11 +151,26 @@ void help() {
 "                    most to white.  Minimum two characters must be specified.\n"
 "      --clear       Clears screen before drawing each output image.\n"
 "      --colors      Use ANSI colors in output.\n"
+#ifdef FEAT_COMPRESS
+"      --compress=gzip  Compress the output with gzip or zstd while it is\n"
+"      --compress=zstd  written, on several threads for big outputs.\n"
+#endif
+"      --crop=WxH+X+Y  Only convert this region of each image.  Values are in\n"
+"                    pixels, or in percent of the image size if they end\n"
+"                    with %, e.g. 50%x50%+25%+25%.  +X+Y may be left out.\n"
 "  -d, --debug       Print additional debug information.\n"
+"      --equalize    Spread the brightness of each image evenly over the\n"
+"                    palette, to bring out detail in dark or flat images.\n"
+"      --files-from=FILE  Also read the images, directories or URLs listed in\n"
+"                    FILE, one per line or ending with NUL.  - is standard\n"
+"                    input.\n"
 "      --fill        When used with --color and/or --html, color each character's\n"
 "                    background color.\n"
 "  -x, --flipx       Flip image in X direction.\n"
 "  -y, --flipy       Flip image in Y direction.\n"
+"      --format=cells  Print the character and colors of each cell in a\n"
+"                    compact binary format, see cells.h.  cells-rle also\n"
+"                    packs repeated cells.  jp2a-cells turns it into text.\n"
 #ifdef FEAT_TERMLIB
 "  -f, --term-fit    Use the largest image dimension that fits in your terminal\n"
 "                    display with correct aspect ratio.\n"
@@ -124,6 +180,13 @@ void help() {
 #endif
 "      --grayscale   Convert image to grayscale when using --html or --colors\n"
 "      --green=N.N   Set RGB to grayscale conversion weight, default is 0.5866\n"
+#ifdef FEAT_GRID
+"      --grid=CxR    Put the images on contact sheets of C columns and R\n"
+"                    rows, fitted in the output size.  --grid=C has as many\n"
+"                    rows as needed, and --grid or --grid=auto picks the\n"
+"                    columns for all images to fit on one sheet.\n"
+"      --grid-captions  Print the file name under each image in the grid.\n"
+#endif
 "      --height=N    Set output height, calculate width from aspect ratio.\n"
 "  -h, --help        Print program help.\n"
 "      --html        Produce strict XHTML 1.0 output.\n"
@@ -132,15 +195,71 @@ void help() {
 "      --html-no-bold      Do not use bold characters with HTML output\n"
 "      --html-raw    Output raw HTML codes, i.e. without the <head> section etc.\n"
 "      --html-title=...  Set HTML output title\n"
+"      --index       Instead of converting, write IMAGE.jp2a-index next to\n"
+"                    each image with smaller copies of it, which later\n"
+"                    conversions read instead of decoding the image.\n"
+#ifdef FEAT_VIEWER
+"      --interactive Show an image in the terminal, and pan with the arrow\n"
+"                    keys and zoom with + and -.  q quits.\n"
+#endif
+"      --journal=FILE  Add each converted input to FILE, and skip those\n"
+"                    already in it, so a stopped batch job can go on.\n"
 "  -i, --invert      Invert output image.  Use if your display has a dark\n"
 "                    background.\n"
 "      --background=dark   These are just mnemonics whether to use --invert\n"
 "      --background=light  or not.  If your console has light characters on\n"
 "                    a dark background, use --background=dark.\n"
 "      --output=...  Write output to file.\n"
+"      --output-template=...  Name of output file for each image read from\n"
+"                    a directory.  %d is the image's directory, %n its name\n"
+"                    without extension, %f its file name, %e is txt or\n"
+"                    html, and %t the tile with --tiles.  Default is\n"
+"                    %d/%n.%e, or %d/%n-%t.%e with --tiles.\n"
+#ifdef FEAT_READAHEAD
+"      --read-ahead=K  Read the next K input files while converting one,\n"
+"                    for many small files on slow storage.\n"
+#endif
+"  -r, --recursive   Also read images in subdirectories of given directories.\n"
+"      --render=...  Add an output for each image, with options separated by\n"
+"                    commas, e.g. width=40,html,colors,output=small.html.\n"
+"                    Each image is decoded once for all outputs.\n"
+"      --partial     Convert what can be read of damaged images, and leave the\n"
+"                    rest black, instead of skipping them.\n"
+"      --progress[=N]  Show the files done, the speed and the time left, N\n"
+"                    times a second (4 by default), or every 10 seconds\n"
+"                    when standard error is not a terminal.\n"
+"      --quality=fast     Decode faster but less exactly: fast JPEG DCT, no\n"
+"      --quality=default  smoothing, and one source pixel sampled for each\n"
+"      --quality=best     output pixel.  best uses the most exact settings.\n"
 "      --red=N.N     Set RGB to grayscale conversion weight, default 0.2989f.\n"
+"      --shapes      Pick characters by matching their shapes against each\n"
+"                    part of the image, not only by brightness.\n"
+"      --shard=I/N   Only convert the inputs in part I of N, e.g. 2/4,\n"
+"                    picked by a hash of their path.\n"
+#ifdef FEAT_SHM
+"      --shm=NAME    Convert frames from a ring buffer in POSIX shared memory,\n"
+"                    instead of files, until the program writing it is done.\n"
+#endif
 "      --size=WxH    Set output width and height.\n"
+"      --thumbnail   Convert the Exif thumbnail instead of the full image\n"
+"                    when it is big enough for the output size.  Done by\n"
+"                    default with --quality=fast and --grid.\n"
+"      --no-thumbnail  Always convert the full image.\n"
+"      --tiles=CxR   Print each image as a poster of C columns and R rows of\n"
+"                    tiles, each in its own file named by --output-template\n"
+"                    with %t for the tile.  Only a tile is kept in memory.\n"
+"      --stream      Print each row as soon as it is decoded, using memory for\n"
+"                    only a few rows.\n"
+"      --state=...   Remember images read from directories in this file, and\n"
+"                    skip those that have not changed since the last run.\n"
+"      --unicode=halfblock  Draw 1x2, 2x2 or 2x4 pixels per character using\n"
+"      --unicode=quadrant   Unicode block or braille characters, for higher\n"
+"      --unicode=braille    resolution in the same space.  Output is UTF-8.\n"
 "  -v, --verbose     Verbose output.\n"
+#ifdef HAVE_SYS_INOTIFY_H
+"      --watch       Keep running, and convert the files again when they are\n"
+"                    replaced or the terminal is resized.\n"
+#endif
 "  -V, --version     Print program version.\n"
 "      --width=N     Set output width, calculate height from ratio.\n"
 "\n"
@@ -166,6 +285,89 @@ void precalc_rgb(const float red, const float green, const float blue) {
 	}
 }
 
+// Output dimensions as given on the command line, before term_fit()
+static int given_width, given_height, given_autow, given_autoh;
+
+// Set output dimensions from the command line and, with --term-*, from
+// term_width and term_height.  Called again if the terminal is resized.
+void term_fit() {
+	int fit_to_use = termfit;
+
+	width = given_width;
+	height = given_height;
+	auto_width = given_autow;
+	auto_height = given_autoh;
+
+	if ( termfit == TERM_FIT_AUTO ) {
+		// use the smallest of terminal width or height 
+		// to guarantee that image fits in display.
+
+		if ( term_width <= term_height )
+			fit_to_use = TERM_FIT_WIDTH;
+		else
+			fit_to_use = TERM_FIT_HEIGHT;
+	}
+
+	switch ( fit_to_use ) {
+	case TERM_FIT_ZOOM:
+		auto_width = auto_height = 0;
+		width = term_width - use_border*2;
+		height = term_height - 1 - use_border*2;
+		break;
+
+	case TERM_FIT_WIDTH:
+		width = term_width - use_border*2;
+		height = 0;
+		auto_height += 1;
+		break;
+
+	case TERM_FIT_HEIGHT:
+		width = 0;
+		height = term_height - 1 - use_border*2;
+		auto_width += 1;
+		break;
+	}
+
+	// only --width specified, calc width
+	if ( auto_width==1 && auto_height == 1 )
+		auto_height = 0;
+
+	// --width and --height is the same as using --size
+	if ( auto_width==2 && auto_height==1 )
+		auto_width = auto_height = 0;
+}
+
+// Hash what the options have set that changes the output, for --state.
+// The same settings given in another order or spelling have the same
+// hash.  --crop and --render are kept elsewhere, so their arguments are
+// hashed instead.
+static unsigned long settings_hash(int argc, char **argv) {
+	const int ints[] = {
+		width, height, !!auto_width, !!auto_height, use_border, invert, flipx, flipy,
+		html, html_fontsize, colorfill, convert_grayscale, html_rawoutput, html_bold,
+		clearscr, usecolors, use_shapes, unicode, use_thumbnail, quality, partial, levels,
+		compression, output_format
+	};
+	const float weights[] = { redweight, greenweight, blueweight };
+	const char *crop = "";
+	unsigned long hash = HASH_INIT;
+	int n;
+
+	hash = hash_bytes(ints, sizeof(ints), hash);
+	hash = hash_bytes(weights, sizeof(weights), hash);
+	hash = hash_bytes(ascii_palette, strlen(ascii_palette) + 1, hash);
+	hash = hash_bytes(html_title, strlen(html_title) + 1, hash);
+
+	for ( n=1; n < argc; ++n ) {
+		if ( !strncmp(argv[n], "--crop=", 7) )
+			crop = argv[n]; // the last one is used
+		else if ( !strncmp(argv[n], "--render=", 9) )
+			hash = hash_bytes(argv[n], strlen(argv[n]) + 1, hash);
+	}
+
+	return hash_bytes(crop, strlen(crop) + 1, hash);
+}
+
 void parse_options(int argc, char** argv) {
 	// make code more readable
 	#define IF_OPTS(sopt, lopt)     if ( !strcmp(s, sopt) || !strcmp(s, lopt) )
@@ -173,7 +375,7 @@ void parse_options(int argc, char** argv) {
 	#define IF_VARS(format, v1, v2) if ( sscanf(s, format, v1, v2) == 2 )
 	#define IF_VAR(format, v1)      if ( sscanf(s, format, v1) == 1 )
 
-	int n, files, fit_to_use;
+	int n, files;
 
 	for ( n=1, files=0; n<argc; ++n ) {
 		const char *s = argv[n];
@@ -181,7 +383,7 @@ void parse_options(int argc, char** argv) {
 		if ( *s != '-' ) { // count files to read
 			++files; continue;
 		}
-	
+
 		IF_OPT ("-")                        { ++files; continue; }
 		IF_OPTS("-h", "--help")             { help(); exit(0); }
 		IF_OPTS("-v", "--verbose")          { verbose = 1; continue; }
@@ -198,6 +400,40 @@ void parse_options(int argc, char** argv) {
 		IF_OPTS("-i", "--invert")           { invert = !invert; continue; }
 		IF_OPT("--background=dark")         { invert = 1; continue; }
 		IF_OPT("--background=light")        { invert = 0; continue; }
+		IF_OPT ("--shapes")                 { use_shapes = 1; continue; }
+		IF_OPT ("--unicode=halfblock")      { unicode = UNICODE_HALFBLOCK; continue; }
+		IF_OPT ("--unicode=quadrant")       { unicode = UNICODE_QUADRANT; continue; }
+		IF_OPT ("--unicode=braille")        { unicode = UNICODE_BRAILLE; continue; }
+		IF_OPT ("--quality=fast")           { quality = QUALITY_FAST; continue; }
+		IF_OPT ("--quality=default")        { quality = QUALITY_DEFAULT; continue; }
+		IF_OPT ("--quality=best")           { quality = QUALITY_BEST; continue; }
+		IF_OPTS("-r", "--recursive")        { recursive = 1; continue; }
+		IF_OPT ("--thumbnail")              { use_thumbnail = THUMBNAIL_ON; continue; }
+		IF_OPT ("--no-thumbnail")           { use_thumbnail = 0; continue; }
+		IF_OPT ("--watch")                  { watch = 1; continue; }
+		IF_OPT ("--stream")                 { streaming = 1; continue; }
+		IF_OPT ("--interactive")            { interactive = 1; continue; }
+		IF_OPT ("--partial")                { partial = 1; continue; }
+		IF_OPT ("--progress")               { progress_rate = PROGRESS_RATE; continue; }
+		IF_OPT ("--auto-levels")            { levels = LEVELS_AUTO; continue; }
+		IF_OPT ("--equalize")               { levels = LEVELS_EQUALIZE; continue; }
+		IF_OPT ("--index")                  { make_index = 1; continue; }
+		IF_OPT ("--format=cells")           { output_format = FORMAT_CELLS; continue; }
+		IF_OPT ("--format=cells-rle")       { output_format = FORMAT_CELLS_RLE; continue; }
+		if ( !strncmp(s, "--render=", 9) )  { render_add(s + 9); continue; }
+#if defined(FEAT_COMPRESS) && defined(HAVE_ZLIB_H)
+		IF_OPT ("--compress=gzip")          { compression = COMPRESS_GZIP; continue; }
+#endif
+#if defined(FEAT_COMPRESS) && defined(HAVE_ZSTD_H)
+		IF_OPT ("--compress=zstd")          { compression = COMPRESS_ZSTD; continue; }
+#endif
+		if ( !strncmp(s, "--crop=", 7) ) {
+			if ( crop_parse(s + 7) ) {
+				fprintf(stderr, "Invalid --crop=%s, use WxH+X+Y\n", s + 7);
+				exit(1);
+			}
+			continue;
+		}
 		IF_OPTS("-x", "--flipx")            { flipx = 1; continue; }
 		IF_OPTS("-y", "--flipy")            { flipy = 1; continue; }
 		IF_OPTS("-V", "--version")          { print_version(); exit(0); }
@@ -225,6 +461,112 @@ void parse_options(int argc, char** argv) {
 			continue;
 		}
 
+		if ( !strncmp(s, "--output-template=", 18) ) {
+			output_template = s + 18;
+			continue;
+		}
+
+#ifdef FEAT_SHM
+		if ( !strncmp(s, "--shm=", 6) && s[6] ) {
+			shm_name = s + 6;
+			continue;
+		}
+#endif
+
+		if ( !strncmp(s, "--state=", 8) ) {
+			statefile = s + 8;
+			continue;
+		}
+
+		if ( !strncmp(s, "--files-from=", 13) ) {
+			files_from = s + 13;
+			++files;
+			continue;
+		}
+
+		if ( !strncmp(s, "--journal=", 10) ) {
+			journalfile = s + 10;
+			continue;
+		}
+
+		if ( !strncmp(s, "--shard=", 8) ) {
+			char end;
+
+			if ( sscanf(s + 8, "%d/%d%c", &shard_index, &shard_count, &end) != 2 ||
+			     shard_count < 1 || shard_index < 1 || shard_index > shard_count )
+			{
+				fprintf(stderr, "Invalid --shard=%s, use I/N with I from 1 to N\n", s + 8);
+				exit(1);
+			}
+			continue;
+		}
+
+		if ( !strncmp(s, "--progress=", 11) ) {
+			char end;
+
+			if ( sscanf(s + 11, "%d%c", &progress_rate, &end) != 1 ||
+			     progress_rate < 1 || progress_rate > PROGRESS_RATE_MAX )
+			{
+				fprintf(stderr, "Invalid --progress=%s, use 1 to %d updates a second\n",
+					s + 11, PROGRESS_RATE_MAX);
+				exit(1);
+			}
+			continue;
+		}
+
+#ifdef FEAT_READAHEAD
+		if ( !strncmp(s, "--read-ahead=", 13) ) {
+			char end;
+
+			if ( sscanf(s + 13, "%d%c", &read_ahead, &end) != 1 ||
+			     read_ahead < 0 || read_ahead > READ_AHEAD_MAX )
+			{
+				fprintf(stderr, "Invalid --read-ahead=%s, use 0 to %d files\n",
+					s + 13, READ_AHEAD_MAX);
+				exit(1);
+			}
+			continue;
+		}
+#endif
+
+		if ( !strncmp(s, "--tiles=", 8) ) {
+			char end;
+
+			if ( sscanf(s + 8, "%dx%d%c", &tile_cols, &tile_rows, &end) != 2 ||
+			     tile_cols < 1 || tile_rows < 1 )
+			{
+				fprintf(stderr, "Invalid --tiles=%s, use COLSxROWS\n", s + 8);
+				exit(1);
+			}
+			continue;
+		}
+
+#ifdef FEAT_GRID
+		IF_OPT ("--grid-captions")          { grid_captions = 1; continue; }
+
+		if ( !strcmp(s, "--grid") || !strcmp(s, "--grid=auto") ) {
+			grid_cols = GRID_AUTO;
+			grid_rows = 0;
+			continue;
+		}
+
+		if ( !strncmp(s, "--grid=", 7) ) {
+			char end;
+			int n = sscanf(s + 7, "%dx%d%c", &grid_cols, &grid_rows, &end);
+
+			if ( n == 1 && strchr(s + 7, 'x') == NULL )
+				grid_rows = 0;
+			else if ( n != 2 || grid_rows < 1 )
+				grid_cols = 0;
+
+			if ( grid_cols < 1 ) {
+				fprintf(stderr, "Invalid --grid=%s, use COLSxROWS, COLS or auto\n", s + 7);
+				exit(1);
+			}
+			continue;
+		}
+#endif
+
 		if ( !strncmp(s, "--html-title=", 13) ) {
 			html_title = s + 13;
 			continue;
@@ -250,7 +592,12 @@ void parse_options(int argc, char** argv) {
 
 	} // args ...
 
-	if ( !files ) {
+	if ( shm_name && (files || render_count || watch || interactive) ) {
+		fputs("--shm can not be used with files, --render, --watch or --interactive\n", stderr);
+		exit(1);
+	}
+
+	if ( !files && !shm_name ) {
 		fputs("No files specified.\n\n", stderr);
 		help();
 		exit(1);
@@ -277,47 +624,14 @@ void parse_options(int argc, char** argv) {
 	// blank lines for some window sizes, hence we decrease by one.
 	--term_width;
 #endif
-
-		fit_to_use = termfit;
-
-		if ( termfit == TERM_FIT_AUTO ) {
-			// use the smallest of terminal width or height 
-			// to guarantee that image fits in display.
-
-			if ( term_width <= term_height )
-				fit_to_use = TERM_FIT_WIDTH;
-			else
-				fit_to_use = TERM_FIT_HEIGHT;
-		}
-
-		switch ( fit_to_use ) {
-		case TERM_FIT_ZOOM:
-			auto_width = auto_height = 0;
-			width = term_width - use_border*2;
-			height = term_height - 1 - use_border*2;
-			break;
-
-		case TERM_FIT_WIDTH:
-			width = term_width - use_border*2;
-			height = 0;
-			auto_height += 1;
-			break;
-
-		case TERM_FIT_HEIGHT:
-			width = 0;
-			height = term_height - 1 - use_border*2;
-			auto_width += 1;
-			break;
-		}
 	}
 
-	// only --width specified, calc width
-	if ( auto_width==1 && auto_height == 1 )
-		auto_height = 0;
+	given_width = width;
+	given_height = height;
+	given_autow = auto_width;
+	given_autoh = auto_height;
 
-	// --width and --height is the same as using --size
-	if ( auto_width==2 && auto_height==1 )
-		auto_width = auto_height = 0;
+	term_fit();
 
 	if ( strlen(ascii_palette) < 2 ) {
 		fputs("You must specify at least two characters in --chars.\n",
@@ -335,10 +649,87 @@ void parse_options(int argc, char** argv) {
 		exit(1);
 	}
 
+	if ( unicode && (html || use_shapes) ) {
+		fputs("--unicode can not be used with --html or --shapes\n", stderr);
+		exit(1);
+	}
+
+	if ( interactive && (render_count || watch || html || strcmp(fileout, "-")) ) {
+		fputs("--interactive can not be used with --render, --watch, --html or --output\n", stderr);
+		exit(1);
+	}
+
+	if ( grid_cols && (render_count || watch || interactive || shm_name || journalfile || statefile || read_ahead) ) {
+		fputs("--grid can not be used with --render, --watch, --interactive, --shm, --journal, --state or --read-ahead\n", stderr);
+		exit(1);
+	}
+
+	if ( tile_cols && (strcmp(fileout, "-") || grid_cols || render_count || watch || interactive ||
+	     shm_name || statefile || read_ahead || levels || use_thumbnail == THUMBNAIL_ON) )
+	{
+		fputs("--tiles can not be used with --output, --grid, --render, --watch, --interactive, --shm,\n"
+		      "--state, --read-ahead, --auto-levels, --equalize or --thumbnail\n", stderr);
+		exit(1);
+	}
+
+	// tiles decode regions of the main image
+	if ( use_thumbnail == THUMBNAIL_AUTO && tile_cols )
+		use_thumbnail = 0;
+
+	if ( make_index && (strcmp(fileout, "-") || grid_cols || tile_cols || render_count || watch ||
+	     interactive || shm_name || statefile || read_ahead) )
+	{
+		fputs("--index can not be used with --output, --grid, --tiles, --render, --watch,\n"
+		      "--interactive, --shm, --state or --read-ahead\n", stderr);
+		exit(1);
+	}
+
+	// each tile needs a file of its own
+	if ( tile_cols && !strstr(output_template, "%t") ) {
+		if ( strcmp(output_template, "%d/%n.%e") ) {
+			fputs("--output-template needs %t with --tiles\n", stderr);
+			exit(1);
+		}
+
+		output_template = "%d/%n-%t.%e";
+	}
+
+	if ( output_format && (html || unicode || grid_cols || render_count || interactive) ) {
+		fputs("--format=cells can not be used with --html, --unicode, --grid, --render or --interactive\n", stderr);
+		exit(1);
+	}
+
+	if ( compression && (watch || interactive) ) {
+		fputs("--compress can not be used with --watch or --interactive\n", stderr);
+		exit(1);
+	}
+
+	// --verbose used to show a progress bar, and the viewer has the terminal
+	if ( verbose && !progress_rate )
+		progress_rate = PROGRESS_RATE;
+
+	if ( interactive )
+		progress_rate = 0;
+
+	if ( render_count && watch ) {
+		fputs("--render can not be used with --watch\n", stderr);
+		exit(1);
+	}
+
 	if ( *fileout == 0 ) {
 		fputs("Empty output filename.\n", stderr);
 		exit(1);
 	}
 
-	precalc_rgb(redweight, greenweight, blueweight);
+	if ( (statefile && *statefile == 0) || *output_template == 0 ||
+	     (files_from && *files_from == 0) || (journalfile && *journalfile == 0) )
+	{
+		fputs("Empty state, journal, list or output template filename.\n", stderr);
+		exit(1);
+	}
+
+	if ( redweight != RED_WEIGHT || greenweight != GREEN_WEIGHT || blueweight != BLUE_WEIGHT )
+		precalc_rgb(redweight, greenweight, blueweight);
+
+	options_hash = settings_hash(argc, argv);
 }
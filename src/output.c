@@ -0,0 +1,269 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "jp2a.h"
+#include "options.h"
+
+/*
+ * Output of each image is printed into a memory buffer, and a writer
+ * thread writes the buffers to their files.  This way we can decode the
+ * next image while the last one is being written to a slow terminal or
+ * pipe.  The queue is short, so a slow reader still holds us back
+ * instead of letting the buffers pile up.
+ *
+ * Without threads or open_memstream(), images are printed directly.
+ */
+
+#if defined(FEAT_THREADS) && defined(HAVE_OPEN_MEMSTREAM)
+
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H)
+#include <sys/uio.h>
+#endif
+
+#define QUEUE_LENGTH 4
+
+typedef struct chunk_ {
+	int fd;
+	char *data;
+	size_t size;
+} chunk;
+
+static chunk queue[QUEUE_LENGTH];
+static int head = 0, queued = 0, writing = 0;
+static int started = 0;
+static int failed = 0; // a write failed
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+
+// the buffer images are printed into
+static FILE *mem = NULL;
+static char *mem_data = NULL;
+static size_t mem_size = 0;
+
+// for --verbose
+static int max_queued = 0;
+static double blocked = 0.0;
+
+// Write all of the chunks, returns zero on success.
+static int write_chunks(chunk *c, const int count) {
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H)
+	struct iovec iov[QUEUE_LENGTH];
+	int n, first = 0;
+
+	for ( n=0; n < count; ++n ) {
+		iov[n].iov_base = c[n].data;
+		iov[n].iov_len = c[n].size;
+	}
+
+	while ( first < count ) {
+		ssize_t len = writev(c[0].fd, iov + first, count - first);
+
+		if ( len < 0 ) {
+			if ( errno == EINTR ) continue;
+			return -1;
+		}
+
+		// skip what was written, which may end inside a buffer
+		while ( first < count && (size_t) len >= iov[first].iov_len )
+			len -= iov[first++].iov_len;
+
+		if ( first < count ) {
+			iov[first].iov_base = (char*) iov[first].iov_base + len;
+			iov[first].iov_len -= len;
+		}
+	}
+#else
+	int n;
+
+	for ( n=0; n < count; ++n ) {
+		size_t done = 0;
+
+		while ( done < c[n].size ) {
+			ssize_t len = write(c[n].fd, c[n].data + done, c[n].size - done);
+
+			if ( len < 0 ) {
+				if ( errno == EINTR ) continue;
+				return -1;
+			}
+
+			done += len;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+static void* writer_thread(void *arg) {
+	chunk c[QUEUE_LENGTH];
+
+	for ( ;; ) {
+		int n, count = 0, result;
+
+		pthread_mutex_lock(&lock);
+
+		while ( queued == 0 )
+			pthread_cond_wait(&changed, &lock);
+
+		// take all queued buffers for the same file
+		while ( count < queued && queue[(head + count) % QUEUE_LENGTH].fd == queue[head].fd ) {
+			c[count] = queue[(head + count) % QUEUE_LENGTH];
+			++count;
+		}
+
+		head = (head + count) % QUEUE_LENGTH;
+		queued -= count;
+		writing = 1;
+
+		pthread_cond_broadcast(&changed);
+		pthread_mutex_unlock(&lock);
+
+		if ( (result = write_chunks(c, count)) != 0 ) {
+			progress_clear();
+			perror("Could not write output");
+		}
+
+		for ( n=0; n < count; ++n )
+			free(c[n].data);
+
+		pthread_mutex_lock(&lock);
+		writing = 0;
+
+		if ( result )
+			failed = 1;
+
+		pthread_cond_broadcast(&changed);
+		pthread_mutex_unlock(&lock);
+	}
+
+	return arg;
+}
+
+// Return the stream to print an image into, instead of fout.
+FILE* output_begin(FILE *fout) {
+	// a memory stream has no file for the writer thread
+	if ( mem != NULL || fileno(fout) < 0 ||
+	     (mem = open_memstream(&mem_data, &mem_size)) == NULL )
+		return fout;
+
+	return mem;
+}
+
+// Queue what was printed since output_begin() for writing to fout.
+void output_end(FILE *f, FILE *fout) {
+	double wait_start;
+
+	if ( f != mem )
+		return;
+
+	fclose(mem);
+	mem = NULL;
+
+	if ( mem_size == 0 ) {
+		free(mem_data);
+		return;
+	}
+
+	if ( !started ) {
+		if ( pthread_create(&writer, NULL, writer_thread, NULL) ) {
+			// write it ourselves
+			fwrite(mem_data, 1, mem_size, fout);
+			free(mem_data);
+			return;
+		}
+
+		pthread_detach(writer);
+		started = 1;
+	}
+
+	// what's in the stdio buffer must come first
+	fflush(fout);
+
+	pthread_mutex_lock(&lock);
+
+	wait_start = timer_now();
+
+	while ( queued == QUEUE_LENGTH )
+		pthread_cond_wait(&changed, &lock);
+
+	blocked += timer_now() - wait_start;
+
+	queue[(head + queued) % QUEUE_LENGTH].fd = fileno(fout);
+	queue[(head + queued) % QUEUE_LENGTH].data = mem_data;
+	queue[(head + queued) % QUEUE_LENGTH].size = mem_size;
+	++queued;
+
+	if ( queued > max_queued )
+		max_queued = queued;
+
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+}
+
+// Wait until all queued output has been written.  This must be done
+// before closing or truncating a file that images were written to.
+// Returns non-zero if any of the output could not be written.
+int output_drain() {
+	int result;
+
+	if ( !started )
+		return 0;
+
+	pthread_mutex_lock(&lock);
+
+	while ( queued > 0 || writing )
+		pthread_cond_wait(&changed, &lock);
+
+	result = failed;
+	pthread_mutex_unlock(&lock);
+	return result;
+}
+
+#else
+
+FILE* output_begin(FILE *fout) {
+	return fout;
+}
+
+void output_end(FILE *f, FILE *fout) {
+}
+
+int output_drain() {
+	return 0;
+}
+
+#endif
+
+// Write the rest of the output, at exit.
+void output_finish() {
+	output_drain();
+
+#if defined(FEAT_THREADS) && defined(HAVE_OPEN_MEMSTREAM)
+	if ( verbose && started ) {
+		progress_clear();
+		fprintf(stderr, "Output blocked %.3f seconds, queue depth up to %d of %d\n",
+			blocked, max_queued, QUEUE_LENGTH);
+	}
+#endif
+}
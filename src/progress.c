@@ -0,0 +1,231 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "decoder.h"
+#include "jp2a.h"
+#include "options.h"
+
+/*
+ * --progress, and --verbose, show on standard error how far the job has
+ * come: the files done of those known, how much of the current one is
+ * decoded, the megapixels of source images and bytes of output per
+ * second, and the time left.  On a terminal the line is drawn over at
+ * most --progress=N times a second; otherwise a line is logged every
+ * PROGRESS_LOG seconds.
+ *
+ * Decoded rows only add to counters, and the clock is read once per
+ * PROGRESS_CHECK decoded pixels, so large images aren't slowed down by
+ * it.  Files given on the command line are known from the start, and
+ * images in directories when the directory is read.  There is no total
+ * with --files-from, and so no time left.
+ */
+
+#define PROGRESS_CHECK 65536 // decoded pixels between looking at the clock
+#define PROGRESS_LOG   10.0  // seconds between lines, when not on a terminal
+#define PROGRESS_NAME  24    // characters of the file name shown
+
+static int tty = 0;
+static int drawn = 0;         // the line is on the terminal
+static double started = 0.0;
+static double next = 0.0;     // when the line is shown again
+static char current[PROGRESS_NAME + 1] = "";
+static float fraction = 0.0f; // of the current file that is decoded
+static int part = 0, parts = 1; // of the current file, with --tiles
+static int done = 0, total = 0, total_known = 1;
+static double pixels = 0.0;   // of source images, as far as converted
+static double source = 0.0;   // of the image about to be converted
+static double row_pixels = 0.0;
+static long unchecked = 0;
+static double bytes = 0.0;
+
+static double interval() {
+	return tty? 1.0 / progress_rate : PROGRESS_LOG;
+}
+
+// Put a number of seconds left as H:MM:SS or M:SS.
+static void format_time(char *s, const size_t size, const double seconds) {
+	const long t = (long) (seconds + 0.5);
+
+	if ( t >= 3600 )
+		snprintf(s, size, "%ld:%02ld:%02ld", t / 3600, t / 60 % 60, t % 60);
+	else
+		snprintf(s, size, "%ld:%02ld", t / 60, t % 60);
+}
+
+static void show(const double now) {
+	const double elapsed = now - started;
+	const double so_far = done + fraction;
+	char line[256], left[32];
+	size_t n;
+
+	if ( total_known )
+		n = snprintf(line, sizeof(line), "%d/%d files", done, total);
+	else
+		n = snprintf(line, sizeof(line), "%d files", done);
+
+	if ( current[0] )
+		n += snprintf(line + n, sizeof(line) - n, ", %s %d%%", current, (int) (fraction * 100));
+
+	if ( elapsed > 0 ) {
+		n += snprintf(line + n, sizeof(line) - n, ", %.1f MP/s", pixels / elapsed / 1e6);
+
+		// output written to pipes is not counted, see render()
+		if ( bytes > 0 )
+			n += snprintf(line + n, sizeof(line) - n, bytes / elapsed < 1e6? ", %.0f kB/s" : ", %.1f MB/s",
+				bytes / elapsed / (bytes / elapsed < 1e6? 1e3 : 1e6));
+	}
+
+	if ( total_known && so_far > 0 && total > so_far ) {
+		format_time(left, sizeof(left), elapsed * (total - so_far) / so_far);
+		snprintf(line + n, sizeof(line) - n, ", %s left", left);
+	}
+
+	// the cursor is left at the start of the line, so messages printed
+	// while it's shown start there
+	if ( tty ) {
+		fprintf(stderr, "%s\033[K\r", line);
+		drawn = 1;
+	} else
+		fprintf(stderr, "Progress: %s\n", line);
+
+	fflush(stderr);
+}
+
+// Show the line, if it's time for it.
+static void update() {
+	const double now = timer_now();
+
+	if ( now < next )
+		return;
+
+	next = now + interval();
+	show(now);
+}
+
+// Start counting, with the inputs given on the command line.
+void progress_start(int argc, char **argv) {
+	struct stat st;
+	int n;
+
+	if ( !progress_rate )
+		return;
+
+	tty = isatty(fileno(stderr));
+	started = timer_now();
+	next = started + interval();
+
+	// directories add their images when they are read
+	for ( n=1; n < argc; ++n )
+		if ( !(argv[n][0]=='-' && argv[n][1]) && (stat(argv[n], &st) || !S_ISDIR(st.st_mode)) )
+			++total;
+
+	if ( files_from )
+		total_known = 0;
+}
+
+// Add files to those to be done.
+void progress_expect(const int files) {
+	total += files;
+}
+
+// A file is about to be converted.
+void progress_file(const char *path) {
+	const char *base = strrchr(path, '/');
+	const size_t len = strlen(base = base? base + 1 : path);
+
+	if ( !progress_rate )
+		return;
+
+	// the end of a long name, which has the extension
+	if ( len > PROGRESS_NAME )
+		snprintf(current, sizeof(current), "...%s", base + len - (PROGRESS_NAME - 3));
+	else
+		snprintf(current, sizeof(current), "%s", base);
+
+	fraction = 0.0f;
+	part = 0;
+	parts = 1;
+}
+
+// The file is converted in parts, and the next image is part of them.
+void progress_part(const int n, const int count) {
+	part = n;
+	parts = count;
+}
+
+// The size of the next image to be converted, before it's shrunk.
+void progress_source(const int width, const int height) {
+	source = (double) width * height;
+}
+
+// A row has been decoded.
+void progress_row(const decoder *d) {
+	if ( d->scanline == 1 ) {
+		row_pixels = (source > 0? source : (double) d->width * d->height) / d->height;
+		source = 0.0;
+	}
+
+	pixels += row_pixels;
+
+	if ( (unchecked += d->width) < PROGRESS_CHECK )
+		return;
+
+	unchecked = 0;
+	fraction = (part + (float) d->scanline / d->height) / parts;
+	update();
+}
+
+// Bytes of output have been printed.
+void progress_output(const long size) {
+	bytes += size;
+}
+
+// A file is done, or skipped.
+void progress_done() {
+	if ( !progress_rate )
+		return;
+
+	++done;
+	current[0] = 0;
+	fraction = 0.0f;
+	update();
+}
+
+// Take the line off the terminal, before other messages.  errno is kept
+// for perror().
+void progress_clear() {
+	const int saved = errno;
+
+	if ( drawn ) {
+		fputs("\033[K", stderr);
+		fflush(stderr);
+		drawn = 0;
+	}
+
+	errno = saved;
+}
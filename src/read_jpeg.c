@@ -0,0 +1,353 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#include <stdio.h>
+
+#include "jpeglib.h"
+
+#include "decoder.h"
+#include "jp2a.h"
+#include "options.h"
+
+typedef struct jpeg_state_ {
+	struct jpeg_error_mgr jerr;
+	struct jpeg_error_mgr thumb_jerr;
+	struct jpeg_decompress_struct jpg;
+	struct jpeg_decompress_struct thumb;
+	struct jpeg_decompress_struct *cur; // the one we read rows from
+	int has_thumb;
+	int started;
+	int from_mem;
+} jpeg_state;
+
+// Set decoder dimensions from the image we're going to read.
+static int jpegdec_dimensions(decoder *d, struct jpeg_decompress_struct *jpg) {
+	if ( jpg->data_precision != 8 )
+		decoder_fail("Image has %d bits color channels, we only support 8-bit",
+			jpg->data_precision);
+
+	jpeg_calc_output_dimensions(jpg);
+
+	d->width = jpg->output_width;
+	d->height = jpg->output_height;
+	d->components = jpg->out_color_components;
+	return 0;
+}
+
+// Decoder settings for --quality.  The libjpeg defaults are the accurate
+// ones, except that the floating point DCT is more exact than ISLOW.
+static void jpegdec_quality(struct jpeg_decompress_struct *jpg) {
+	switch ( quality ) {
+	case QUALITY_FAST:
+		jpg->dct_method = JDCT_IFAST;
+		jpg->do_fancy_upsampling = FALSE;
+		jpg->do_block_smoothing = FALSE;
+		break;
+	case QUALITY_BEST:
+		jpg->dct_method = JDCT_FLOAT;
+		jpg->do_fancy_upsampling = TRUE;
+		jpg->do_block_smoothing = TRUE;
+		break;
+	}
+}
+
+// libjpeg errors fail the image, instead of exiting.
+static void jpegdec_error(j_common_ptr cinfo) {
+	char message[JMSG_LENGTH_MAX];
+
+	(*cinfo->err->format_message)(cinfo, message);
+	decoder_fail("%s", message);
+}
+
+// Warnings about the Exif thumbnail aren't shown, it's only a shortcut.
+static void jpegdec_quiet(j_common_ptr cinfo, int level) {
+	(void) cinfo;
+	(void) level;
+}
+
+// A decompressor is kept after each image and used for the next one, which
+// saves libjpeg from setting up its memory pools and tables again.  One
+// is kept for files and one for memory, since libjpeg can't switch a
+// decompressor from one source to the other.  Threads decoding at the
+// same time take and give them back atomically.
+static jpeg_state *spare[2] = { NULL, NULL };
+
+#ifdef DECODER_THREADS
+#define TAKE_SPARE(n) ((jpeg_state*) __sync_lock_test_and_set(&spare[n], NULL))
+#define GIVE_SPARE(n, s) __sync_bool_compare_and_swap(&spare[n], NULL, s)
+#else
+static jpeg_state* take_spare(const int n) {
+	jpeg_state *s = spare[n];
+	spare[n] = NULL;
+	return s;
+}
+
+static int give_spare(const int n, jpeg_state *s) {
+	if ( spare[n] != NULL )
+		return 0;
+	spare[n] = s;
+	return 1;
+}
+
+#define TAKE_SPARE(n) take_spare(n)
+#define GIVE_SPARE(n, s) give_spare(n, s)
+#endif
+
+// Read the header from fp, or from data if fp is NULL.
+static int jpegdec_begin(decoder *d, FILE *fp, const unsigned char *data, const size_t size) {
+	jpeg_state *s = TAKE_SPARE(fp == NULL);
+
+	if ( s != NULL ) {
+		s->has_thumb = s->started = 0;
+	} else {
+		if ( (s = (jpeg_state*) calloc(1, sizeof(jpeg_state))) == NULL ) {
+			progress_clear();
+			fputs("Not enough memory to decode image\n", stderr);
+			return -1;
+		}
+
+		s->jpg.err = jpeg_std_error(&s->jerr);
+		s->jerr.error_exit = jpegdec_error;
+		jpeg_create_decompress(&s->jpg);
+		s->from_mem = fp == NULL;
+	}
+
+	d->state = s;
+	s->cur = &s->jpg;
+
+#ifdef HAVE_JPEG_MEM_SRC
+	if ( fp == NULL )
+		jpeg_mem_src(&s->jpg, (unsigned char*) data, size);
+	else
+#endif
+		jpeg_stdio_src(&s->jpg, fp);
+
+#ifdef HAVE_JPEG_MEM_SRC
+	if ( use_thumbnail )
+		jpeg_save_markers(&s->jpg, JPEG_APP0 + 1, 0xffff);
+#endif
+
+	jpeg_read_header(&s->jpg, TRUE);
+	jpegdec_quality(&s->jpg);
+	return jpegdec_dimensions(d, &s->jpg);
+}
+
+static int jpegdec_open(decoder *d, FILE *fp) {
+	return jpegdec_begin(d, fp, NULL, 0);
+}
+
+#ifdef HAVE_JPEG_MEM_SRC
+static int jpegdec_open_mem(decoder *d, const unsigned char *data, const size_t size) {
+	return jpegdec_begin(d, NULL, data, size);
+}
+#endif
+
+#ifdef HAVE_JPEG_MEM_SRC
+
+// Exif orientations 2-4 are flips of the stored image, 5-8 also rotate it
+#define ORIENT_FLIPX(o) ((o) == 2 || (o) == 3)
+#define ORIENT_FLIPY(o) ((o) == 3 || (o) == 4)
+
+/*
+ * Read the Exif thumbnail instead of the main image, if there is one
+ * with at least the pixels we need for the output.  The output should
+ * look the same as for the main image, so thumbnails with a different
+ * aspect ratio (e.g., letterboxed), or stored rotated relative to the
+ * main image, are not used.
+ */
+static void jpegdec_thumbnail(decoder *d, const int width, const int height) {
+	jpeg_state *s = (jpeg_state*) d->state;
+	jpeg_saved_marker_ptr m;
+	const unsigned char *data = NULL;
+	unsigned length = 0;
+	int orientation = 1, thumb_orientation = 1;
+	float aspect, thumb_aspect;
+	jmp_buf env, *last;
+	int n;
+
+	for ( m = s->jpg.marker_list; m != NULL; m = m->next ) {
+		if ( m->marker == JPEG_APP0 + 1 &&
+		     exif_thumbnail(m->data, m->data_length, &data, &length,
+		                    &orientation, &thumb_orientation) )
+			break;
+	}
+
+	if ( m == NULL )
+		return;
+
+	if ( orientation != thumb_orientation && (orientation > 4 || thumb_orientation > 4) )
+		return;
+
+	s->thumb.err = jpeg_std_error(&s->thumb_jerr);
+	s->thumb_jerr.error_exit = jpegdec_error;
+	s->thumb_jerr.emit_message = jpegdec_quiet;
+	jpeg_create_decompress(&s->thumb);
+	s->has_thumb = 1;
+
+	// a damaged thumbnail is left out, the main image may be fine
+	last = decoder_catch(&env);
+
+	if ( setjmp(env) ) {
+		decoder_catch(last);
+		jpeg_destroy_decompress(&s->thumb);
+		s->has_thumb = 0;
+		return;
+	}
+
+	jpeg_mem_src(&s->thumb, (unsigned char*) data, length);
+	jpeg_read_header(&s->thumb, TRUE);
+
+	// libjpeg only finds missing tables when it starts decompressing
+	for ( n = 0; n < s->thumb.num_components; ++n ) {
+		if ( s->thumb.quant_tbl_ptrs[s->thumb.comp_info[n].quant_tbl_no] == NULL )
+			decoder_fail("Exif thumbnail has no quantization table");
+	}
+
+	decoder_catch(last);
+	jpegdec_quality(&s->thumb);
+
+	aspect = (float) s->jpg.image_width / (float) s->jpg.image_height;
+	thumb_aspect = (float) s->thumb.image_width / (float) s->thumb.image_height;
+
+	if ( (JDIMENSION) width > s->thumb.image_width ||
+	     (JDIMENSION) height > s->thumb.image_height ||
+	     s->thumb.image_width >= s->jpg.image_width ||
+	     thumb_aspect < 0.98f * aspect || thumb_aspect > 1.02f * aspect ||
+	     s->thumb.data_precision != 8 || jpegdec_dimensions(d, &s->thumb) )
+	{
+		jpegdec_dimensions(d, &s->jpg);
+		return;
+	}
+
+	if ( verbose ) {
+		progress_clear();
+		fprintf(stderr, "Using Exif thumbnail (%dx%d)\n",
+			s->thumb.image_width, s->thumb.image_height);
+	}
+
+	// turn the thumbnail the same way as the main image is stored
+	d->flipx = ORIENT_FLIPX(orientation) ^ ORIENT_FLIPX(thumb_orientation);
+	d->flipy = ORIENT_FLIPY(orientation) ^ ORIENT_FLIPY(thumb_orientation);
+
+	s->cur = &s->thumb;
+}
+
+#endif
+
+static void jpegdec_shrink(decoder *d, const int width, const int height) {
+	jpeg_state *s = (jpeg_state*) d->state;
+
+#ifdef HAVE_JPEG_MEM_SRC
+	// by default only when the decoder may scale the image down anyway
+	if ( use_thumbnail == THUMBNAIL_ON ||
+	     (use_thumbnail && (quality == QUALITY_FAST || d->downscale)) )
+		jpegdec_thumbnail(d, width, height);
+#endif
+
+	// let the IDCT scale the image down, as far as it can while still
+	// giving us at least the pixels we need
+	if ( quality == QUALITY_FAST || d->downscale ) {
+		struct jpeg_decompress_struct *jpg = s->cur;
+		int denom = 8;
+
+		while ( denom > 1 &&
+		        ((int) jpg->image_width / denom < width ||
+		         (int) jpg->image_height / denom < height) )
+			denom /= 2;
+
+		jpg->scale_num = 1;
+		jpg->scale_denom = denom;
+		jpegdec_dimensions(d, jpg);
+	}
+}
+
+#if defined(HAVE_JPEG_CROP_SCANLINE) && defined(HAVE_JPEG_SKIP_SCANLINES)
+
+// With libjpeg-turbo, decode only the iMCU columns covering the region,
+// and skip the rows above it without running the IDCT on them.  Rows
+// below it are left when the decoder is closed.
+static void jpegdec_crop(decoder *d, int *x, int *y, const int w) {
+	jpeg_state *s = (jpeg_state*) d->state;
+	JDIMENSION xoffset = *x, width = w;
+
+	if ( s->started )
+		return;
+
+	jpeg_start_decompress(s->cur);
+	s->started = 1;
+
+	jpeg_crop_scanline(s->cur, &xoffset, &width);
+	d->width = s->cur->output_width;
+	*x -= xoffset;
+
+	if ( *y > 0 ) {
+		const JDIMENSION skipped = jpeg_skip_scanlines(s->cur, *y);
+		d->scanline += skipped;
+		*y -= skipped;
+	}
+}
+
+#endif
+
+static int jpegdec_read_row(decoder *d, JSAMPLE *row) {
+	jpeg_state *s = (jpeg_state*) d->state;
+
+	if ( !s->started ) {
+		jpeg_start_decompress(s->cur);
+		s->started = 1;
+	}
+
+	return jpeg_read_scanlines(s->cur, &row, 1) == 1? 0 : -1;
+}
+
+static void jpegdec_close(decoder *d) {
+	jpeg_state *s = (jpeg_state*) d->state;
+
+	if ( s == NULL )
+		return;
+
+	if ( s->started && s->cur->output_scanline == s->cur->output_height )
+		jpeg_finish_decompress(s->cur);
+
+	if ( s->has_thumb )
+		jpeg_destroy_decompress(&s->thumb);
+
+	// keep the decompressor for the next image
+	jpeg_abort_decompress(&s->jpg);
+
+	if ( !GIVE_SPARE(s->from_mem, s) ) {
+		jpeg_destroy_decompress(&s->jpg);
+		free(s);
+	}
+
+	d->state = NULL;
+}
+
+const backend jpeg_backend = {
+	"JPEG", 0xff,
+	jpegdec_open,
+#ifdef HAVE_JPEG_MEM_SRC
+	jpegdec_open_mem,
+#else
+	NULL,
+#endif
+	jpegdec_shrink,
+#if defined(HAVE_JPEG_CROP_SCANLINE) && defined(HAVE_JPEG_SKIP_SCANLINES)
+	jpegdec_crop,
+#else
+	NULL,
+#endif
+	jpegdec_read_row,
+	jpegdec_close
+};
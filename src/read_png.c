@@ -0,0 +1,165 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef FEAT_PNG
+
+#include <png.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "decoder.h"
+#include "options.h"
+
+/*
+ * PNG images, read one row at a time through libpng.  Palette, low bit
+ * depth and 16-bit are all converted to 8-bit gray or RGB, and transparent
+ * pixels are put on the background.
+ * Interlaced images are the exception: their rows are not complete until
+ * the last pass, so they have to be read whole.
+ */
+
+typedef struct png_state_ {
+	png_structp png;
+	png_infop info;
+	JSAMPLE *image; // whole image, only for interlaced files
+	size_t rowbytes;
+} png_state;
+
+static int pngdec_open(decoder *d, FILE *fp) {
+	png_state *s = (png_state*) calloc(1, sizeof(png_state));
+	int color_type;
+
+	if ( s == NULL ) {
+		progress_clear();
+		fputs("Not enough memory to decode image\n", stderr);
+		return -1;
+	}
+
+	d->state = s;
+
+	if ( (s->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL ||
+	     (s->info = png_create_info_struct(s->png)) == NULL )
+	{
+		progress_clear();
+		fputs("Not enough memory to decode image\n", stderr);
+		return -1;
+	}
+
+	if ( setjmp(png_jmpbuf(s->png)) )
+		return -1; // libpng has printed the error
+
+	png_init_io(s->png, fp);
+	png_read_info(s->png, s->info);
+
+	color_type = png_get_color_type(s->png, s->info);
+
+	// transparent pixels show the background of the output: black with
+	// --background=dark, white with --background=light
+	if ( color_type & PNG_COLOR_MASK_ALPHA || png_get_valid(s->png, s->info, PNG_INFO_tRNS) ) {
+		png_color_16 bg;
+		const png_uint_16 v = invert? 0 : png_get_bit_depth(s->png, s->info) == 16? 65535 : 255;
+
+		memset(&bg, 0, sizeof(bg));
+		bg.red = bg.green = bg.blue = bg.gray = v;
+		png_set_background(s->png, &bg, PNG_BACKGROUND_GAMMA_SCREEN, 0, 1.0);
+	}
+
+	png_set_expand(s->png);
+	png_set_strip_16(s->png);
+	png_set_strip_alpha(s->png);
+
+	if ( png_get_interlace_type(s->png, s->info) != PNG_INTERLACE_NONE )
+		png_set_interlace_handling(s->png);
+
+	png_read_update_info(s->png, s->info);
+
+	d->width = png_get_image_width(s->png, s->info);
+	d->height = png_get_image_height(s->png, s->info);
+	d->components = color_type & PNG_COLOR_MASK_COLOR? 3 : 1;
+	s->rowbytes = png_get_rowbytes(s->png, s->info);
+
+	if ( s->rowbytes != (size_t) d->width * d->components )
+		decoder_fail("Unsupported PNG pixel format");
+
+	return 0;
+}
+
+static int pngdec_read_interlaced(decoder *d) {
+	png_state *s = (png_state*) d->state;
+	png_bytep *rows;
+	int y;
+
+	s->image = (JSAMPLE*) malloc(s->rowbytes * d->height);
+	rows = (png_bytep*) malloc(d->height * sizeof(png_bytep));
+
+	if ( s->image == NULL || rows == NULL ) {
+		progress_clear();
+		fputs("Not enough memory to decode interlaced PNG image\n", stderr);
+		free(rows);
+		return -1;
+	}
+
+	for ( y=0; y < d->height; ++y )
+		rows[y] = s->image + y * s->rowbytes;
+
+	png_read_image(s->png, rows);
+	free(rows);
+	return 0;
+}
+
+static int pngdec_read_row(decoder *d, JSAMPLE *row) {
+	png_state *s = (png_state*) d->state;
+
+	if ( setjmp(png_jmpbuf(s->png)) )
+		return -1;
+
+	if ( png_get_interlace_type(s->png, s->info) == PNG_INTERLACE_NONE ) {
+		png_read_row(s->png, row, NULL);
+		return 0;
+	}
+
+	if ( s->image == NULL && pngdec_read_interlaced(d) )
+		return -1;
+
+	memcpy(row, s->image + d->scanline * s->rowbytes, s->rowbytes);
+	return 0;
+}
+
+static void pngdec_close(decoder *d) {
+	png_state *s = (png_state*) d->state;
+
+	if ( s == NULL )
+		return;
+
+	png_destroy_read_struct(s->png? &s->png : NULL, s->info? &s->info : NULL, NULL);
+	free(s->image);
+	free(s);
+	d->state = NULL;
+}
+
+const backend png_backend = {
+	"PNG", 0x89,
+	pngdec_open,
+	NULL,
+	NULL,
+	NULL,
+	pngdec_read_row,
+	pngdec_close
+};
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#include <stdio.h>
+#include <ctype.h>
+
+#include "decoder.h"
+
+// Netpbm graymaps and pixmaps, both plain (P2, P3) and raw (P5, P6),
+// with up to 16 bits per sample.
+
+typedef struct pnm_state_ {
+	FILE *fp;
+	int plain;
+	int maxval;
+} pnm_state;
+
+// Read a number from the header, skipping whitespace and comments.
+static int pnmdec_number(FILE *fp, int *value) {
+	int c;
+
+	for ( ;; ) {
+		c = getc(fp);
+
+		if ( c == '#' ) {
+			while ( c != '\n' && c != EOF )
+				c = getc(fp);
+		}
+
+		if ( c == EOF )
+			return -1;
+
+		if ( !isspace(c) )
+			break;
+	}
+
+	if ( !isdigit(c) )
+		return -1;
+
+	*value = 0;
+
+	while ( isdigit(c) ) {
+		if ( *value > 100000000 )
+			return -1;
+
+		*value = *value * 10 + (c - '0');
+		c = getc(fp);
+	}
+
+	// exactly one whitespace separates the header from raw data
+	return c == EOF || isspace(c)? 0 : -1;
+}
+
+static int pnmdec_open(decoder *d, FILE *fp) {
+	pnm_state *s;
+	int type;
+
+	if ( getc(fp) != 'P' )
+		return -1;
+
+	type = getc(fp);
+
+	if ( type != '2' && type != '3' && type != '5' && type != '6' )
+		decoder_fail("Unsupported PNM type, only graymaps and pixmaps can be read");
+
+	if ( (s = (pnm_state*) calloc(1, sizeof(pnm_state))) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory to decode image\n", stderr);
+		return -1;
+	}
+
+	d->state = s;
+	s->fp = fp;
+	s->plain = type == '2' || type == '3';
+	d->components = type == '3' || type == '6'? 3 : 1;
+
+	if ( pnmdec_number(fp, &d->width) || pnmdec_number(fp, &d->height) ||
+	     pnmdec_number(fp, &s->maxval) || d->width < 1 || d->height < 1 ||
+	     s->maxval < 1 || s->maxval > 65535 )
+		decoder_fail("Invalid PNM header");
+
+	return 0;
+}
+
+static int pnmdec_read_row(decoder *d, JSAMPLE *row) {
+	pnm_state *s = (pnm_state*) d->state;
+	const int samples = d->width * d->components;
+	int n;
+
+	for ( n=0; n < samples; ++n ) {
+		int v;
+
+		if ( s->plain ) {
+			if ( pnmdec_number(s->fp, &v) )
+				return -1;
+		} else {
+			v = getc(s->fp);
+
+			if ( v != EOF && s->maxval > 255 ) {
+				const int low = getc(s->fp);
+				v = low == EOF? EOF : v << 8 | low;
+			}
+
+			if ( v == EOF )
+				decoder_fail("PNM image ends after %d of %d rows", d->scanline, d->height);
+		}
+
+		if ( v > s->maxval )
+			v = s->maxval;
+
+		row[n] = (JSAMPLE) (s->maxval == 255? v : (v * 255 + s->maxval/2) / s->maxval);
+	}
+
+	return 0;
+}
+
+static void pnmdec_close(decoder *d) {
+	free(d->state);
+	d->state = NULL;
+}
+
+const backend pnm_backend = {
+	"PNM", 'P',
+	pnmdec_open,
+	NULL,
+	NULL,
+	NULL,
+	pnmdec_read_row,
+	pnmdec_close
+};
@@ -0,0 +1,587 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "jp2a.h"
+#include "options.h"
+
+/*
+ * With --read-ahead=K, the next K input files are opened and read into
+ * memory while the current one is converted, so a batch of small files
+ * on slow storage doesn't wait for each of them in turn.  Callers name
+ * the files coming up with readahead_hint(), in the order they will be
+ * converted, and readahead_take() hands over the contents of one,
+ * waiting for it if it isn't read yet.  A file that isn't taken in turn,
+ * such as a directory, is dropped when a later one is taken.
+ *
+ * On Linux, the files are opened and read by the kernel with io_uring,
+ * driven from this thread.  Elsewhere, or if io_uring is not allowed, a
+ * few threads do blocking reads.  Each slot keeps its buffer for the
+ * next file, so they are only grown, not allocated for each file.
+ */
+
+#ifdef FEAT_READAHEAD
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_SYSCALL_H)
+#define FEAT_IO_URING
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if !defined(__NR_io_uring_setup) || !defined(__NR_io_uring_enter) || !defined(__NR_io_uring_register)
+#undef FEAT_IO_URING
+#endif
+#endif
+
+// threads reading files when io_uring can't be used
+#define READ_THREADS 4
+
+// bigger files are read as they are decoded, as without --read-ahead
+#define READ_MAX (64 << 20)
+
+#define SLOT_FREE    0
+#define SLOT_QUEUED  1 // waiting for a thread, or being opened by io_uring
+#define SLOT_READING 2
+#define SLOT_DONE    3
+#define SLOT_FAILED  4 // can't be read ahead; read it as usual
+#define SLOT_TAKEN   5 // being converted
+
+typedef struct slot_ {
+	char *path;
+	unsigned char *data;
+	size_t room, size, done;
+	int fd;
+	int state;
+	int dropped; // free it when the read in progress is done
+} slot;
+
+static slot *slots = NULL;
+static slot *taken = NULL;
+static int nslots = 0, head = 0, queued = 0;
+static int threads = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+
+// for --verbose
+static double waited = 0.0;
+static unsigned long files = 0, waits = 0;
+
+// Check the file just opened in the slot and make room for all of it.
+// Returns zero if it can be read ahead.
+static int slot_begin(slot *s, const int fd) {
+	struct stat st;
+
+	// opened without blocking in case it's a FIFO; reads may block
+	if ( fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size > READ_MAX ||
+	     fcntl(fd, F_SETFL, 0) )
+		return -1;
+
+	s->size = st.st_size;
+	s->done = 0;
+
+	// one more byte, so an empty file has a buffer too
+	if ( s->size + 1 > s->room ) {
+		unsigned char *p = (unsigned char*) realloc(s->data, s->size + 1);
+
+		if ( p == NULL )
+			return -1;
+
+		s->data = p;
+		s->room = s->size + 1;
+	}
+
+	s->fd = fd;
+	return 0;
+}
+
+// The read of a slot is over.
+static void slot_end(slot *s, const int state) {
+	if ( s->fd >= 0 ) {
+		close(s->fd);
+		s->fd = -1;
+	}
+
+	s->state = s->dropped? SLOT_FREE : state;
+}
+
+// Read a whole file into the slot, with blocking calls.
+static int read_file(slot *s) {
+	const int fd = open(s->path, O_RDONLY | O_NONBLOCK);
+
+	if ( fd < 0 )
+		return SLOT_FAILED;
+
+	if ( slot_begin(s, fd) ) {
+		close(fd);
+		return SLOT_FAILED;
+	}
+
+	while ( s->done < s->size ) {
+		const ssize_t len = read(fd, s->data + s->done, s->size - s->done);
+
+		if ( len < 0 && errno == EINTR )
+			continue;
+
+		if ( len < 0 )
+			return SLOT_FAILED;
+
+		if ( len == 0 ) {
+			s->size = s->done; // it got shorter
+			break;
+		}
+
+		s->done += len;
+	}
+
+	return SLOT_DONE;
+}
+
+static void* read_thread(void *arg) {
+	pthread_mutex_lock(&lock);
+
+	for ( ;; ) {
+		slot *s = NULL;
+		int n, state;
+
+		for ( n=0; n < queued && s == NULL; ++n )
+			if ( slots[(head + n) % nslots].state == SLOT_QUEUED )
+				s = &slots[(head + n) % nslots];
+
+		if ( s == NULL ) {
+			pthread_cond_wait(&changed, &lock);
+			continue;
+		}
+
+		s->state = SLOT_READING;
+		pthread_mutex_unlock(&lock);
+
+		state = read_file(s);
+
+		pthread_mutex_lock(&lock);
+		slot_end(s, state);
+		pthread_cond_broadcast(&changed);
+	}
+
+	return arg;
+}
+
+#ifdef FEAT_IO_URING
+
+static struct {
+	int fd;
+	volatile unsigned *sq_tail, *cq_head, *cq_tail;
+	unsigned sq_mask, cq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned pending; // queued, but not submitted
+} ring = { .fd = -1 };
+
+// Set up a ring for the given number of reads at a time, if the kernel
+// can open and read files with it.  Returns zero on success.
+static int uring_setup(const unsigned entries) {
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	size_t sq_size, cq_size;
+	unsigned char *sq, *cq;
+	int supported;
+
+	memset(&p, 0, sizeof(p));
+
+	if ( (ring.fd = (int) syscall(__NR_io_uring_setup, entries, &p)) < 0 )
+		return -1;
+
+	// IORING_OP_OPENAT and IORING_OP_READ came with Linux 5.6
+	probe = (struct io_uring_probe*) calloc(1, sizeof(struct io_uring_probe) +
+		256 * sizeof(struct io_uring_probe_op));
+
+	supported = probe != NULL &&
+		syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+		probe->last_op >= IORING_OP_READ &&
+		(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if ( (p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size )
+		sq_size = cq_size;
+
+	if ( !supported ||
+	     (sq = (unsigned char*) mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+	        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING)) == MAP_FAILED )
+	{
+		close(ring.fd);
+		return -1;
+	}
+
+	cq = sq;
+
+	if ( !(p.features & IORING_FEAT_SINGLE_MMAP) &&
+	     (cq = (unsigned char*) mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+	        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING)) == MAP_FAILED )
+	{
+		munmap(sq, sq_size);
+		close(ring.fd);
+		return -1;
+	}
+
+	if ( (ring.sqes = (struct io_uring_sqe*) mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES)) == MAP_FAILED )
+	{
+		if ( cq != sq )
+			munmap(cq, cq_size);
+		munmap(sq, sq_size);
+		close(ring.fd);
+		return -1;
+	}
+
+	ring.sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	ring.sq_mask = *(unsigned*) (sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned*) (sq + p.sq_off.array);
+	ring.cq_head = (unsigned*) (cq + p.cq_off.head);
+	ring.cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	ring.cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	ring.pending = 0;
+
+	return 0;
+}
+
+// Queue an operation for the slot.  There is never more than one per
+// slot, so the ring has room.
+static struct io_uring_sqe* uring_sqe(const unsigned char opcode, slot *s) {
+	const unsigned index = *ring.sq_tail & ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->user_data = (uint64_t) (s - slots);
+	ring.sq_array[index] = index;
+
+	__sync_synchronize();
+	*ring.sq_tail = *ring.sq_tail + 1;
+	++ring.pending;
+
+	return sqe;
+}
+
+static void uring_read(slot *s) {
+	struct io_uring_sqe *sqe = uring_sqe(IORING_OP_READ, s);
+
+	sqe->fd = s->fd;
+	sqe->addr = (uint64_t) (uintptr_t) (s->data + s->done);
+	sqe->len = (unsigned) (s->size - s->done);
+	sqe->off = s->done;
+}
+
+static void uring_open(slot *s) {
+	struct io_uring_sqe *sqe = uring_sqe(IORING_OP_OPENAT, s);
+
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uint64_t) (uintptr_t) s->path;
+	sqe->open_flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+}
+
+// Submit what is queued, and wait for at least one operation to complete
+// if wait is set.
+static void uring_enter(const int wait) {
+	int n;
+
+	if ( ring.pending == 0 && !wait )
+		return;
+
+	n = (int) syscall(__NR_io_uring_enter, ring.fd, ring.pending, wait? 1 : 0,
+		wait? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+	if ( n > 0 )
+		ring.pending -= n;
+}
+
+// An operation of the slot completed with result res.
+static void uring_complete(slot *s, const int res) {
+	if ( s->state == SLOT_QUEUED ) {
+		// opened
+		if ( res < 0 ) {
+			slot_end(s, SLOT_FAILED);
+		} else if ( s->dropped || slot_begin(s, res) ) {
+			close(res);
+			slot_end(s, SLOT_FAILED);
+		} else if ( s->size == 0 ) {
+			slot_end(s, SLOT_DONE);
+		} else {
+			s->state = SLOT_READING;
+			uring_read(s);
+		}
+
+		return;
+	}
+
+	if ( res == -EINTR || res == -EAGAIN ) {
+		uring_read(s);
+		return;
+	}
+
+	if ( res > 0 )
+		s->done += res;
+
+	if ( res > 0 && s->done < s->size && !s->dropped ) {
+		uring_read(s);
+		return;
+	}
+
+	if ( res == 0 )
+		s->size = s->done; // it got shorter
+
+	slot_end(s, res < 0? SLOT_FAILED : SLOT_DONE);
+}
+
+// Handle the operations that have completed, without waiting.
+static void uring_reap() {
+	unsigned h = *ring.cq_head;
+
+	__sync_synchronize();
+
+	while ( h != *ring.cq_tail ) {
+		const struct io_uring_cqe *c = &ring.cqes[h & ring.cq_mask];
+		uring_complete(&slots[c->user_data], c->res);
+		++h;
+	}
+
+	__sync_synchronize();
+	*ring.cq_head = h;
+
+	uring_enter(0);
+}
+
+#endif
+
+// Set up the slots and io_uring or threads.  Returns zero on success.
+static int readahead_begin() {
+	pthread_t thread;
+	int n;
+
+	// the files ahead, the next one, and the one being converted
+	nslots = read_ahead + 2;
+
+	if ( (slots = (slot*) calloc(nslots, sizeof(slot))) == NULL )
+		return -1;
+
+	for ( n=0; n < nslots; ++n )
+		slots[n].fd = -1;
+
+#ifdef FEAT_IO_URING
+	if ( uring_setup(nslots) == 0 ) {
+		if ( verbose ) {
+			progress_clear();
+			fprintf(stderr, "Read-ahead: %d files with io_uring\n", read_ahead);
+		}
+		return 0;
+	}
+#endif
+
+	for ( n=0; n < read_ahead && n < READ_THREADS; ++n ) {
+		if ( pthread_create(&thread, NULL, read_thread, NULL) )
+			break;
+
+		pthread_detach(thread);
+		++threads;
+	}
+
+	if ( threads == 0 ) {
+		free(slots);
+		slots = NULL;
+		read_ahead = 0;
+		return -1;
+	}
+
+	if ( verbose ) {
+		progress_clear();
+		fprintf(stderr, "Read-ahead: %d files with %d threads\n", read_ahead, threads);
+	}
+
+	return 0;
+}
+
+// Start reading a file that will be converted after those before it.
+// Returns nonzero if it can't be read ahead now, e.g. because K files
+// already are.
+int readahead_hint(const char *path) {
+	slot *s;
+	char *p;
+
+	if ( read_ahead < 1 || (slots == NULL && readahead_begin()) )
+		return -1;
+
+	pthread_mutex_lock(&lock);
+
+#ifdef FEAT_IO_URING
+	if ( threads == 0 )
+		uring_reap();
+#endif
+
+	s = &slots[(head + queued) % nslots];
+
+	if ( queued == nslots - 1 || s->state != SLOT_FREE ||
+	     (p = (char*) realloc(s->path, strlen(path) + 1)) == NULL )
+	{
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	strcpy(p, path);
+	s->path = p;
+	s->dropped = 0;
+	s->state = SLOT_QUEUED;
+	++queued;
+
+#ifdef FEAT_IO_URING
+	if ( threads == 0 ) {
+		uring_open(s);
+		uring_enter(0);
+	}
+#endif
+
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+// Returns the contents of the file if it was read ahead, waiting for the
+// read to finish, or NULL to read it as usual.  Call readahead_release()
+// when done with it.
+const unsigned char* readahead_take(const char *path, size_t *size) {
+	slot *s;
+	int n, i;
+
+	if ( slots == NULL )
+		return NULL;
+
+	pthread_mutex_lock(&lock);
+
+	for ( n=0; n < queued && strcmp(slots[(head + n) % nslots].path, path); ++n )
+		;
+
+	if ( n == queued ) {
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+
+	// those before it were not converted in turn, and won't be
+	for ( i=0; i < n; ++i ) {
+		slot *d = &slots[(head + i) % nslots];
+
+		if ( d->state >= SLOT_DONE || (d->state == SLOT_QUEUED && threads) )
+			d->state = SLOT_FREE;
+		else
+			d->dropped = 1;
+	}
+
+	s = &slots[(head + n) % nslots];
+	head = (head + n + 1) % nslots;
+	queued -= n + 1;
+	++files;
+
+	if ( s->state < SLOT_DONE ) {
+		const double start = timer_now();
+
+		// no thread got to it yet, so read it here
+		if ( s->state == SLOT_QUEUED && threads ) {
+			s->state = SLOT_READING;
+			pthread_mutex_unlock(&lock);
+			n = read_file(s);
+			pthread_mutex_lock(&lock);
+			slot_end(s, n);
+		}
+
+		while ( s->state < SLOT_DONE ) {
+#ifdef FEAT_IO_URING
+			if ( threads == 0 ) {
+				uring_enter(1);
+				uring_reap();
+				continue;
+			}
+#endif
+			pthread_cond_wait(&changed, &lock);
+		}
+
+		waited += timer_now() - start;
+		++waits;
+	}
+
+	if ( s->state == SLOT_FAILED ) {
+		s->state = SLOT_FREE;
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+
+	s->state = SLOT_TAKEN;
+	taken = s;
+	*size = s->size;
+
+	pthread_mutex_unlock(&lock);
+	return s->data;
+}
+
+// The file from readahead_take() has been converted.
+void readahead_release() {
+	pthread_mutex_lock(&lock);
+
+	if ( taken != NULL ) {
+		taken->state = SLOT_FREE;
+		taken = NULL;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+// Report how long we waited for reads.
+void readahead_end() {
+	if ( verbose && slots != NULL ) {
+		progress_clear();
+		fprintf(stderr, "Read-ahead: waited %.3f seconds for %lu of %lu files\n",
+			waited, waits, files);
+	}
+}
+
+#else
+
+int readahead_hint(const char *path) {
+	return -1;
+}
+
+const unsigned char* readahead_take(const char *path, size_t *size) {
+	return NULL;
+}
+
+void readahead_release() {
+}
+
+void readahead_end() {
+}
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "aspect_ratio.h"
+#include "decoder.h"
+#include "image.h"
+#include "jp2a.h"
+#include "options.h"
+
+/*
+ * --render=SPEC gives one output for each image.  SPEC is a comma
+ * separated list of options without the leading dashes, for instance
+ * "width=40,html,colors,output=small.html".  The image is decoded once,
+ * and every output is converted from the decoded image in memory.
+ * Options not given in SPEC are taken from the command line.
+ */
+
+// Images larger than this are scaled down before converting them
+#define MAX_DECODED (16 * 1024 * 1024)
+
+typedef struct render_spec_ {
+	const char *spec;
+	int width, height, auto_width, auto_height, termfit; // -1 if not given
+	int html, usecolors, colorfill, convert_grayscale, invert, toggle_invert;
+	int flipx, flipy, use_border, unicode, use_shapes;
+	const char *fileout; // NULL if not given
+	FILE *file, *fout;   // fout compresses to file with --compress
+} render_spec;
+
+int render_count = 0;
+static render_spec *specs = NULL;
+
+static void spec_error(const char *spec, const char *s) {
+	fprintf(stderr, "Invalid option '%s' in --render=%s\n", s, spec);
+	exit(1);
+}
+
+static void spec_size(render_spec *r, const int width, const int height) {
+	r->width = width;
+	r->height = height;
+	r->auto_width = width == 0;
+	r->auto_height = height == 0;
+	r->termfit = 0;
+}
+
+// Parse an output specification given with --render.
+void render_add(const char *spec) {
+	render_spec *r;
+	char *copy, *s;
+
+	if ( (specs = (render_spec*) realloc(specs, (render_count + 1) * sizeof(render_spec))) == NULL ||
+	     (copy = strdup(spec)) == NULL )
+	{
+		progress_clear();
+		fputs("Not enough memory for --render\n", stderr);
+		exit(1);
+	}
+
+	r = &specs[render_count++];
+	memset(r, -1, sizeof(render_spec));
+	r->spec = spec;
+	r->toggle_invert = 0;
+	r->fileout = NULL;
+	r->file = r->fout = NULL;
+
+	for ( s = strtok(copy, ","); s != NULL; s = strtok(NULL, ",") ) {
+		int w, h;
+
+		if ( sscanf(s, "size=%dx%d", &w, &h) == 2 ) {
+			if ( w < 1 || h < 1 ) spec_error(spec, s);
+			spec_size(r, w, h);
+		}
+		else if ( sscanf(s, "width=%d", &w) == 1 ) {
+			if ( w < 1 ) spec_error(spec, s);
+			spec_size(r, w, 0);
+		}
+		else if ( sscanf(s, "height=%d", &h) == 1 ) {
+			if ( h < 1 ) spec_error(spec, s);
+			spec_size(r, 0, h);
+		}
+		else if ( !strncmp(s, "output=", 7) && s[7] )
+			r->fileout = strdup(s + 7);
+		else if ( !strcmp(s, "html") ) r->html = 1;
+		else if ( !strcmp(s, "color") || !strcmp(s, "colors") ) r->usecolors = 1;
+		else if ( !strcmp(s, "grayscale") ) r->usecolors = r->convert_grayscale = 1;
+		else if ( !strcmp(s, "fill") ) r->colorfill = 1;
+		else if ( !strcmp(s, "invert") ) r->toggle_invert = 1;
+		else if ( !strcmp(s, "background=dark") ) r->invert = 1;
+		else if ( !strcmp(s, "background=light") ) r->invert = 0;
+		else if ( !strcmp(s, "flipx") ) r->flipx = 1;
+		else if ( !strcmp(s, "flipy") ) r->flipy = 1;
+		else if ( !strcmp(s, "border") ) r->use_border = 1;
+		else if ( !strcmp(s, "shapes") ) r->use_shapes = 1;
+		else if ( !strcmp(s, "unicode=halfblock") ) r->unicode = UNICODE_HALFBLOCK;
+		else if ( !strcmp(s, "unicode=quadrant") ) r->unicode = UNICODE_QUADRANT;
+		else if ( !strcmp(s, "unicode=braille") ) r->unicode = UNICODE_BRAILLE;
+		else
+			spec_error(spec, s);
+	}
+
+	free(copy);
+}
+
+#define SET(field, var) if ( r->field != -1 ) var = r->field
+
+// Set the options given in r.
+static void spec_apply(const render_spec *r) {
+	SET(width, width);
+	SET(height, height);
+	SET(auto_width, auto_width);
+	SET(auto_height, auto_height);
+	SET(termfit, termfit);
+	SET(html, html);
+	SET(usecolors, usecolors);
+	SET(convert_grayscale, convert_grayscale);
+	SET(colorfill, colorfill);
+	SET(invert, invert);
+	SET(flipx, flipx);
+	SET(flipy, flipy);
+	SET(use_border, use_border);
+	SET(use_shapes, use_shapes);
+	SET(unicode, unicode);
+
+	if ( r->toggle_invert )
+		invert = !invert;
+}
+
+#undef SET
+
+// Remember the current options in r, so they can be set again.
+static void spec_save(render_spec *r) {
+	r->width = width;
+	r->height = height;
+	r->auto_width = auto_width;
+	r->auto_height = auto_height;
+	r->termfit = termfit;
+	r->html = html;
+	r->usecolors = usecolors;
+	r->convert_grayscale = convert_grayscale;
+	r->colorfill = colorfill;
+	r->invert = invert;
+	r->toggle_invert = 0;
+	r->flipx = flipx;
+	r->flipy = flipy;
+	r->use_border = use_border;
+	r->use_shapes = use_shapes;
+	r->unicode = unicode;
+}
+
+static FILE* spec_output(render_spec *r, FILE *fout) {
+	if ( r->fileout == NULL || !strcmp(r->fileout, "-") )
+		return fout;
+
+	if ( r->fout == NULL ) {
+		if ( (r->file = fopen(r->fileout, "wb")) == NULL ) {
+			progress_clear();
+			fprintf(stderr, "Could not open '%s' for writing.\n", r->fileout);
+			exit(1);
+		}
+
+		r->fout = compress_open(r->file);
+	}
+
+	return r->fout;
+}
+
+// If the decoded image is big, scale it down to twice the largest size
+// any output needs, which keeps the averaging of source pixels.
+static image_t* reduce(image_t *p, const render_spec *base) {
+	const size_t size = (size_t) p->w * p->h * p->components;
+	int n, need_w = 1, need_h = 1, factor, x, y, w, h;
+	image_t *small;
+
+	// --crop in pixels is relative to the image as decoded
+	if ( size <= MAX_DECODED || crop_region(p->w, p->h, &x, &y, &w, &h) )
+		return p;
+
+	for ( n=0; n < render_count; ++n ) {
+		int subx, suby;
+
+		spec_apply(&specs[n]);
+		aspect_ratio(p->w, p->h);
+		sample_size(&subx, &suby);
+
+		if ( width * subx > need_w ) need_w = width * subx;
+		if ( height * suby > need_h ) need_h = height * suby;
+
+		spec_apply(base);
+	}
+
+	factor = p->w / (2 * need_w);
+	if ( p->h / (2 * need_h) < factor )
+		factor = p->h / (2 * need_h);
+
+	if ( factor < 2 )
+		return p;
+
+	if ( verbose ) {
+		progress_clear();
+		fprintf(stderr, "Reducing decoded image to 1/%d size\n", factor);
+	}
+
+	small = image_new(p->w / factor, p->h / factor, p->components);
+	image_resize(p, small);
+	image_destroy(p);
+	return small;
+}
+
+// Decode the image from fp and write every --render output.
+void render_outputs(FILE *fp, FILE *fout) {
+	render_spec base;
+	image_t *p = image_read(fp);
+	int n;
+
+	spec_save(&base);
+	p = reduce(p, &base);
+
+	for ( n=0; n < render_count; ++n ) {
+		decoder d;
+
+		spec_apply(&specs[n]);
+
+		if ( unicode && (html || use_shapes) ) {
+			fprintf(stderr, "--unicode can not be used with --html or --shapes in --render=%s\n",
+				specs[n].spec);
+			exit(1);
+		}
+
+		if ( verbose ) {
+			progress_clear();
+			fprintf(stderr, "Output: %s\n", specs[n].spec);
+		}
+
+		memory_decoder(&d, p);
+		convert(&d, spec_output(&specs[n], fout));
+		d.b->close(&d);
+
+		spec_apply(&base);
+	}
+
+	image_destroy(p);
+}
+
+// Close the output files.  Returns nonzero if one could not be written.
+int render_end() {
+	int n, failed = 0;
+
+	output_drain();
+
+	for ( n=0; n < render_count; ++n ) {
+		if ( specs[n].fout != NULL ) {
+			if ( compress_close(specs[n].fout) )
+				failed = 1;
+			fclose(specs[n].file);
+		}
+	}
+
+	return failed;
+}
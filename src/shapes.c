@@ -0,0 +1,229 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "jp2a.h"
+#include "options.h"
+
+// Ink coverage of each printable ASCII character (32..126), sampled on a
+// SHAPE_COLS x SHAPE_ROWS grid from DejaVu Sans Mono, row by row from the
+// top left.  0 is no ink, 255 would be a solid subcell.
+static const unsigned char glyph_coverage[95][SHAPE_CELLS] = {
+	{   0,   0,   0,   0,   0,   0,   0,   0 }, // ' '
+	{  12,  12,  42,  41,  23,  23,   9,   9 }, // '!'
+	{  20,  21,  46,  46,   0,   0,   0,   0 }, // '"'
+	{  10,  18, 100, 114, 114,  99,  17,  10 }, // '#'
+	{   4,  12, 102,  66,  45, 125,  33,  39 }, // '$'
+	{  24,   0, 114,  46,  47, 107,   0,  31 }, // '%'
+	{  38,  31,  99,   8,  95, 136,  32,  37 }, // '&'
+	{  11,  10,  24,  22,   0,   0,   0,   0 }, // '\''
+	{   0,  27,  53,  24,  68,  11,   7,  39 }, // '('
+	{  27,   0,  26,  51,  13,  66,  40,   7 }, // ')'
+	{  10,  10,  84,  83,   5,   5,   0,   0 }, // '*'
+	{   0,   0,  27,  25,  88,  86,   1,   1 }, // '+'
+	{   0,   0,   0,   0,  14,  16,  43,  16 }, // ','
+	{   0,   0,   0,   0,  31,  30,   0,   0 }, // '-'
+	{   0,   0,   0,   0,  15,  14,  11,  10 }, // '.'
+	{   0,  22,   6,  73,  71,   8,  41,   0 }, // '/'
+	{  37,  36,  96,  96,  96,  96,  23,  23 }, // '0'
+	{  36,  19,  22,  68,  24,  77,  30,  41 }, // '1'
+	{  51,  36,   7,  89,  73,  39,  40,  38 }, // '2'
+	{  51,  36,  25,  93,  19,  98,  42,  24 }, // '3'
+	{   0,  34,  56,  92,  86, 120,   0,  17 }, // '4'
+	{  48,  41,  95,  45,  16,  94,  42,  21 }, // '5'
+	{  33,  44, 114,  54,  93,  90,  24,  27 }, // '6'
+	{  56,  53,   0,  81,  48,  37,  18,   0 }, // '7'
+	{  42,  41,  93,  93,  97,  97,  28,  28 }, // '8'
+	{  43,  36,  86,  94,  55, 112,  34,  18 }, // '9'
+	{   0,   0,  27,  25,  15,  14,  11,  10 }, // ':'
+	{   0,   0,  27,  25,  14,  16,  43,  16 }, // ';'
+	{   0,   0,  40,  64,  71,  64,   0,   0 }, // '<'
+	{   0,   0,  63,  62,  63,  62,   0,   0 }, // '='
+	{   0,   0,  65,  39,  65,  71,   0,   0 }, // '>'
+	{  41,  41,  10,  87,  38,  22,  11,   6 }, // '?'
+	{   5,  12,  96, 126, 118, 105,  58,  41 }, // '@'
+	{  18,  17,  76,  76, 110, 110,  18,  18 }, // 'A'
+	{  53,  35, 109, 102,  95, 102,  39,  25 }, // 'B'
+	{  29,  52,  89,   5,  93,  18,  16,  37 }, // 'C'
+	{  56,  21,  85,  93,  93,  96,  40,  12 }, // 'D'
+	{  50,  55, 106,  45,  93,  21,  36,  41 }, // 'E'
+	{  45,  58, 103,  44,  86,   6,  17,   0 }, // 'F'
+	{  33,  49,  89,  23,  93, 103,  19,  35 }, // 'G'
+	{  24,  24, 112, 112,  88,  88,  17,  17 }, // 'H'
+	{  49,  48,  43,  41,  52,  50,  36,  35 }, // 'I'
+	{  29,  40,   0,  83,  23,  87,  41,  16 }, // 'J'
+	{  24,  28, 132,  60,  97,  90,  17,  21 }, // 'K'
+	{  24,   0,  84,   0,  90,  15,  34,  44 }, // 'L'
+	{  35,  35, 136, 137,  92,  91,  16,  16 }, // 'M'
+	{  34,  23, 142,  87,  86, 142,  17,  24 }, // 'N'
+	{  39,  38,  87,  87,  91,  91,  25,  24 }, // 'O'
+	{  50,  39,  90, 106, 103,  26,  17,   0 }, // 'P'
+	{  39,  38,  87,  87,  91,  91,  25,  60 }, // 'Q'
+	{  56,  31, 100, 101, 100,  89,  17,  18 }, // 'R'
+	{  41,  45, 104,  25,  25, 105,  38,  27 }, // 'S'
+	{  67,  67,  42,  41,  42,  41,   9,   9 }, // 'T'
+	{  24,  24,  84,  83,  89,  89,  27,  26 }, // 'U'
+	{  24,  24,  81,  81,  74,  74,  12,  12 }, // 'V'
+	{  23,  23, 110, 109, 123, 122,  18,  18 }, // 'W'
+	{  25,  25,  75,  76,  85,  83,  18,  18 }, // 'X'
+	{  25,  25,  81,  81,  44,  41,   9,   8 }, // 'Y'
+	{  52,  62,   4,  84,  85,  23,  39,  47 }, // 'Z'
+	{  25,  29,  64,  12,  64,  12,  42,  32 }, // '['
+	{  22,   0,  78,   1,  18,  60,   0,  41 }, // '\\'
+	{  30,  25,  13,  62,  13,  62,  33,  41 }, // ']'
+	{  19,  18,  53,  53,   0,   0,   0,   0 }, // '^'
+	{   0,   0,   0,   0,   0,   0,  62,  61 }, // '_'
+	{  36,   4,   2,   5,   0,   0,   0,   0 }, // '`'
+	{   0,   0,  45,  67,  94, 118,  34,  29 }, // 'a'
+	{  30,   0, 105,  72,  91,  83,  31,  28 }, // 'b'
+	{   0,   0,  61,  48,  85,   9,  16,  38 }, // 'c'
+	{   0,  30,  72, 105,  83,  91,  28,  30 }, // 'd'
+	{   0,   0,  68,  69, 114,  66,  22,  39 }, // 'e'
+	{   9,  50,  82,  64,  51,  24,  11,   5 }, // 'f'
+	{   0,   0,  72,  80,  86,  93,  63,  86 }, // 'g'
+	{  30,   0, 101,  72,  76,  76,  16,  16 }, // 'h'
+	{  12,  18,  51,  30,  37,  50,  38,  40 }, // 'i'
+	{   3,  27,  38,  46,   8,  68,  52,  46 }, // 'j'
+	{  31,   0,  84,  57, 103,  79,  16,  19 }, // 'k'
+	{  57,   3,  67,   8,  64,  20,   3,  34 }, // 'l'
+	{   0,   0, 100,  92, 103, 105,  21,  22 }, // 'm'
+	{   0,   0,  77,  72,  76,  76,  16,  16 }, // 'n'
+	{   0,   0,  70,  70,  84,  84,  25,  25 }, // 'o'
+	{   0,   0,  82,  71,  91,  83,  84,  27 }, // 'p'
+	{   0,   0,  71,  82,  84,  91,  27,  84 }, // 'q'
+	{   0,   0,  62,  64,  77,   0,  16,   0 }, // 'r'
+	{   0,   0,  68,  38,  50,  89,  35,  24 }, // 's'
+	{  16,   0, 107,  43,  74,  10,   6,  34 }, // 't'
+	{   0,   0,  52,  52,  80,  88,  29,  30 }, // 'u'
+	{   0,   0,  53,  53,  76,  76,  12,  12 }, // 'v'
+	{   0,   0,  55,  55, 120, 119,  18,  18 }, // 'w'
+	{   0,   0,  56,  57,  75,  74,  18,  18 }, // 'x'
+	{   0,   0,  54,  54,  74,  76,  71,  20 }, // 'y'
+	{   0,   0,  40,  80,  66,  30,  35,  36 }, // 'z'
+	{   6,  46,  39,  40,  75,  27,  19,  60 }, // '{'
+	{  14,  14,  37,  34,  37,  34,  37,  34 }, // '|'
+	{  46,   5,  41,  36,  28,  73,  61,  17 }, // '}'
+	{   0,   0,  14,   2,  50,  61,   0,   0 }, // '~'
+};
+
+// Each subcell of a cell is quantised to SHAPE_LEVELS levels, and the
+// levels are packed into a key that indexes shape_lut.  Entries are
+// filled in lazily, so we only search the palette once per key seen.
+#define SHAPE_LEVELS 4
+#define SHAPE_KEYS (1 << (2 * SHAPE_CELLS))
+
+static unsigned short shape_lut[SHAPE_KEYS]; // palette index + 1, 0 is unset
+static char shape_palette[256 + 1] = "";
+static float shape_ink[256][SHAPE_CELLS];
+static float shape_mean[256];
+static int shape_chars = 0;
+
+// Build the signatures for the characters in ascii_palette.  A character
+// stands for the same brightness as it does when matching on brightness
+// alone, and its shape is how its ink is spread over the subcells compared
+// to an average character in the palette (all glyphs leave the line gap
+// at the top and bottom empty, so that should not count against them).
+static void shape_init() {
+	const int chars = (int) strlen(ascii_palette);
+	float profile[SHAPE_CELLS];
+	int n, k, inked = 0;
+
+	memset(shape_lut, 0, sizeof(shape_lut));
+	memset(profile, 0, sizeof(profile));
+	strcpy(shape_palette, ascii_palette);
+	shape_chars = chars;
+
+	for ( n=0; n < chars; ++n ) {
+		const unsigned char ch = (unsigned char) ascii_palette[n];
+		float sum = 0.0f;
+
+		for ( k=0; k < SHAPE_CELLS; ++k ) {
+			// unknown glyphs are assumed to be evenly inked
+			shape_ink[n][k] = ch >= 32 && ch < 127 ?
+				(float) glyph_coverage[ch - 32][k] : 1.0f;
+			sum += shape_ink[n][k];
+		}
+
+		// relative amount of ink in each subcell
+		for ( k=0; k < SHAPE_CELLS; ++k )
+			shape_ink[n][k] = sum > 0.0f ?
+				shape_ink[n][k] * (float) SHAPE_CELLS / sum : 1.0f;
+
+		if ( sum > 0.0f ) {
+			for ( k=0; k < SHAPE_CELLS; ++k )
+				profile[k] += shape_ink[n][k];
+			++inked;
+		}
+
+		shape_mean[n] = (float) n / (float) (chars - 1);
+	}
+
+	for ( n=0; n < chars; ++n )
+		for ( k=0; k < SHAPE_CELLS; ++k )
+			shape_ink[n][k] = shape_mean[n] *
+				(shape_ink[n][k] - (inked? profile[k] / (float) inked : 1.0f));
+}
+
+// Return the palette index whose signature is closest to the given key.
+// Being one palette step off in brightness costs about as much as
+// a poorly matched shape, so shape only decides between neighbours.
+static int shape_search(const int key) {
+	float ink[SHAPE_CELLS], mean = 0.0f, best_dist = 0.0f;
+	int n, k, best = 0;
+
+	for ( k=0; k < SHAPE_CELLS; ++k ) {
+		const int level = (key >> (2*k)) & (SHAPE_LEVELS - 1);
+		ink[k] = (float) level / (float) (SHAPE_LEVELS - 1);
+		mean += ink[k] / (float) SHAPE_CELLS;
+	}
+
+	for ( n=0; n < shape_chars; ++n ) {
+		// brightness error counted in palette steps
+		const float dm = (mean - shape_mean[n]) * (float) (shape_chars - 1);
+		float dist = dm*dm;
+
+		for ( k=0; k < SHAPE_CELLS; ++k ) {
+			const float d = (ink[k] - mean) - shape_ink[n][k];
+			dist += d*d;
+		}
+
+		if ( n==0 || dist < best_dist ) {
+			best = n;
+			best_dist = dist;
+		}
+	}
+
+	return best;
+}
+
+// Pick the palette character that best matches the ink wanted in each
+// subcell of a cell, given as SHAPE_CELLS values in the range 0.0 - 1.0.
+char shape_match(const float *ink) {
+	int key = 0, k;
+
+	if ( strcmp(shape_palette, ascii_palette) )
+		shape_init();
+
+	for ( k=0; k < SHAPE_CELLS; ++k ) {
+		int level = (int) (0.5f + ink[k] * (float) (SHAPE_LEVELS - 1));
+		if ( level < 0 ) level = 0;
+		if ( level >= SHAPE_LEVELS ) level = SHAPE_LEVELS - 1;
+		key |= level << (2*k);
+	}
+
+	if ( !shape_lut[key] )
+		shape_lut[key] = (unsigned short) (1 + shape_search(key));
+
+	return ascii_palette[shape_lut[key] - 1];
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include "jp2a.h"
+
+#ifdef FEAT_SHM
+
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "decoder.h"
+#include "image.h"
+#include "options.h"
+#include "shmring.h"
+
+/*
+ * --shm=NAME converts frames that a capture program writes to a ring
+ * buffer in shared memory (see shmring.h), until it closes the ring.
+ * Frames are decoded where they are, without copying them.  We always
+ * take the newest frame, so if converting is slower than capturing, the
+ * frames in between are skipped.  A frame that is written over while we
+ * convert it is thrown away.
+ */
+
+// How long to sleep between looking for new frames
+#define POLL_NSEC 1000000
+
+static size_t mapped = 0;
+
+// Convert a frame with the given header fields to f.  Returns zero on
+// success.
+static int shm_convert(const shmring_slot *s, const unsigned format,
+	const unsigned w, const unsigned h, const size_t size, FILE *f)
+{
+	static decoder d; // not on the stack, since we may longjmp back here
+	static image_t p;
+	jmp_buf env;
+
+	d.b = NULL;
+	decoder_damaged();
+
+	if ( setjmp(env) ) {
+		decoder_catch(NULL);
+
+		if ( d.b != NULL && d.b->close != NULL )
+			d.b->close(&d);
+
+		return -1;
+	}
+
+	decoder_catch(&env);
+
+	switch ( format ) {
+	case SHMRING_JPEG:
+		decoder_open_mem(&d, SHMRING_DATA(s), size);
+		break;
+
+	case SHMRING_GRAY:
+	case SHMRING_RGB:
+		p.w = w;
+		p.h = h;
+		p.components = format == SHMRING_RGB? 3 : 1;
+		p.pixels = (JSAMPLE*) SHMRING_DATA(s);
+
+		if ( p.w < 1 || p.h < 1 || (size_t) p.w * p.h * p.components > size )
+			decoder_fail("Raw frame of %ux%u does not fit in %lu bytes",
+				w, h, (unsigned long) size);
+
+		memory_decoder(&d, &p);
+		break;
+
+	default:
+		decoder_fail("Unknown frame format %u", format);
+	}
+
+	convert(&d, f);
+	d.b->close(&d);
+
+	decoder_catch(NULL);
+	return 0;
+}
+
+// Map the ring buffer, or exit.
+static const shmring_header* shm_map(const char *name) {
+	const struct timespec pause = { 0, POLL_NSEC };
+	const shmring_header *h;
+	struct stat st;
+	int fd;
+
+	if ( (fd = shm_open(name, O_RDONLY, 0)) < 0 ) {
+		fprintf(stderr, "Could not open shared memory %s\n", name);
+		exit(1);
+	}
+
+	if ( fstat(fd, &st) || (size_t) st.st_size < sizeof(shmring_header) ||
+	     (h = (const shmring_header*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED )
+	{
+		fprintf(stderr, "Could not map shared memory %s\n", name);
+		exit(1);
+	}
+
+	close(fd);
+	mapped = st.st_size;
+
+	// the producer sets magic when the header is filled in
+	while ( *(volatile const uint32_t*) &h->magic == 0 )
+		nanosleep(&pause, NULL);
+
+	__sync_synchronize();
+
+	if ( h->magic != SHMRING_MAGIC || h->version != SHMRING_VERSION ||
+	     h->slots < 1 || h->slot_size % 8 != 0 ||
+	     SHMRING_SIZE(h->slots, h->slot_size) > (size_t) st.st_size )
+	{
+		fprintf(stderr, "%s is not a jp2a frame ring buffer\n", name);
+		exit(1);
+	}
+
+	if ( verbose )
+		fprintf(stderr, "Shared memory %s: %u slots of %u bytes\n",
+			name, h->slots, h->slot_size);
+
+	return h;
+}
+
+// Convert frames from the ring buffer until it is closed.  Returns 2 if
+// some frame could not be converted, like main().
+int shm_frames(FILE *fout) {
+	const struct timespec pause = { 0, POLL_NSEC };
+	const shmring_header *h = shm_map(shm_name);
+	unsigned long shown = 0, skipped = 0, torn = 0;
+	uint64_t last = 0;
+	int failed = 0;
+
+	// draw each frame on top of the last
+	if ( isatty(fileno(fout)) )
+		clearscr = 1;
+
+	for ( ;; ) {
+		const uint64_t n = h->head;
+		const shmring_slot *s;
+		unsigned format, w, hgt;
+		size_t size;
+		char *out = NULL;
+		size_t outsize = 0;
+		FILE *f;
+		int ok;
+
+		if ( n == last ) {
+			if ( h->flags & SHMRING_CLOSED ) {
+				__sync_synchronize();
+				if ( h->head == last )
+					break;
+			} else
+				nanosleep(&pause, NULL);
+
+			continue;
+		}
+
+		skipped += n - last - 1;
+		last = n;
+		s = SHMRING_SLOT(h, n);
+
+		__sync_synchronize();
+
+		if ( s->seq != 2 * n ) {
+			++torn;
+			continue;
+		}
+
+		__sync_synchronize();
+
+		format = s->format;
+		w = s->width;
+		hgt = s->height;
+		size = s->size < h->slot_size? s->size : h->slot_size;
+
+		if ( (f = open_memstream(&out, &outsize)) == NULL ) {
+			fputs("Not enough memory to convert frame\n", stderr);
+			exit(1);
+		}
+
+		restore_dimensions();
+		ok = shm_convert(s, format, w, hgt, size, f) == 0;
+		fclose(f);
+
+		__sync_synchronize();
+
+		if ( s->seq != 2 * n ) {
+			// written over while we read it
+			++torn;
+		} else if ( !ok ) {
+			fprintf(stderr, "Could not convert frame %lu: %s\n",
+				(unsigned long) n, decoder_failure());
+			failed = 1;
+		} else {
+			fwrite(out, 1, outsize, fout);
+			fflush(fout);
+			++shown;
+		}
+
+		free(out);
+	}
+
+	if ( verbose )
+		fprintf(stderr, "Frames: %lu shown, %lu skipped, %lu torn\n",
+			shown, skipped, torn);
+
+	munmap((void*) h, mapped);
+	return failed? 2 : 0;
+}
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+/*
+ * Writes images to a shared memory ring buffer for jp2a --shm=NAME, as an
+ * example of a producer and for the tests.  JPEG files are stored as they
+ * are, and binary PGM and PPM files with maxval 255 as raw frames.
+ *
+ *   shmring-producer [-s SLOTS] [-i MS] [-l LOOPS] NAME FILE...
+ *   shmring-producer -u NAME
+ *
+ * The ring is left in place when the frames have been written, with the
+ * closed flag set; -u removes it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmring.h"
+
+typedef struct frame_ {
+	unsigned format, width, height;
+	unsigned char *data; // the whole file
+	size_t offset, size; // of the frame in data
+} frame;
+
+static void usage() {
+	fputs("Usage: shmring-producer [-s SLOTS] [-i MS] [-l LOOPS] NAME FILE...\n"
+	      "       shmring-producer -u NAME\n", stderr);
+	exit(1);
+}
+
+// Read a number in a PNM header, skipping whitespace and comments.
+static int pnm_number(const unsigned char *p, const size_t size, size_t *pos) {
+	int n = 0, digits = 0;
+
+	while ( *pos < size ) {
+		if ( p[*pos] == '#' ) {
+			while ( *pos < size && p[*pos] != '\n' )
+				++*pos;
+		} else if ( p[*pos] == ' ' || p[*pos] == '\t' || p[*pos] == '\r' || p[*pos] == '\n' )
+			++*pos;
+		else
+			break;
+	}
+
+	while ( *pos < size && p[*pos] >= '0' && p[*pos] <= '9' && n < 100000 ) {
+		n = n*10 + p[(*pos)++] - '0';
+		++digits;
+	}
+
+	return digits? n : -1;
+}
+
+static void load(frame *f, const char *path) {
+	FILE *fp = fopen(path, "rb");
+	long len;
+
+	if ( fp == NULL || fseek(fp, 0, SEEK_END) || (len = ftell(fp)) < 0 ) {
+		fprintf(stderr, "Can't read %s\n", path);
+		exit(1);
+	}
+
+	rewind(fp);
+	f->size = len;
+
+	if ( (f->data = (unsigned char*) malloc(len + 1)) == NULL ||
+	     fread(f->data, 1, len, fp) != (size_t) len )
+	{
+		fprintf(stderr, "Can't read %s\n", path);
+		exit(1);
+	}
+
+	fclose(fp);
+	f->offset = 0;
+
+	if ( len > 2 && f->data[0] == 0xff && f->data[1] == 0xd8 ) {
+		f->format = SHMRING_JPEG;
+		f->width = f->height = 0;
+		return;
+	}
+
+	if ( len > 2 && f->data[0] == 'P' && (f->data[1] == '5' || f->data[1] == '6') ) {
+		const int c = f->data[1] == '6'? 3 : 1;
+		size_t pos = 2;
+		int w = pnm_number(f->data, len, &pos);
+		int h = pnm_number(f->data, len, &pos);
+		int maxval = pnm_number(f->data, len, &pos);
+
+		if ( w > 0 && h > 0 && maxval == 255 && pos + 1 + (size_t) w*h*c <= (size_t) len ) {
+			f->format = c == 3? SHMRING_RGB : SHMRING_GRAY;
+			f->width = w;
+			f->height = h;
+			f->offset = pos + 1;
+			f->size = (size_t) w*h*c;
+			return;
+		}
+	}
+
+	fprintf(stderr, "%s is not a JPEG file or a binary PGM or PPM with maxval 255\n", path);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	unsigned slots = 4, interval = 0, loops = 1, slot_size = 0;
+	shmring_header *h;
+	frame *frames;
+	uint64_t n = 0;
+	size_t size;
+	int opt, fd, count, i;
+	unsigned loop;
+
+	while ( (opt = getopt(argc, argv, "s:i:l:u:")) != -1 ) {
+		switch ( opt ) {
+		case 's': slots = atoi(optarg); break;
+		case 'i': interval = atoi(optarg); break;
+		case 'l': loops = atoi(optarg); break;
+		case 'u':
+			if ( shm_unlink(optarg) ) {
+				perror(optarg);
+				return 1;
+			}
+			return 0;
+		default: usage();
+		}
+	}
+
+	if ( argc - optind < 2 || slots < 1 )
+		usage();
+
+	count = argc - optind - 1;
+	frames = (frame*) calloc(count, sizeof(frame));
+
+	for ( i=0; i < count; ++i ) {
+		load(&frames[i], argv[optind + 1 + i]);
+
+		if ( frames[i].size > slot_size )
+			slot_size = frames[i].size;
+	}
+
+	slot_size = (slot_size + 7) & ~7u;
+	size = SHMRING_SIZE(slots, slot_size);
+
+	if ( (fd = shm_open(argv[optind], O_CREAT | O_RDWR, 0600)) < 0 ||
+	     ftruncate(fd, 0) || ftruncate(fd, size) ||
+	     (h = (shmring_header*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED )
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+
+	close(fd);
+
+	h->version = SHMRING_VERSION;
+	h->slots = slots;
+	h->slot_size = slot_size;
+	h->head = 0;
+	h->flags = 0;
+	__sync_synchronize();
+	h->magic = SHMRING_MAGIC;
+
+	for ( loop=0; loop < loops; ++loop ) {
+		for ( i=0; i < count; ++i ) {
+			const frame *f = &frames[i];
+			shmring_slot *s = SHMRING_SLOT(h, ++n);
+
+			s->seq = 2*n - 1;
+			__sync_synchronize();
+
+			s->format = f->format;
+			s->width = f->width;
+			s->height = f->height;
+			s->size = f->size;
+			memcpy(SHMRING_DATA(s), f->data + f->offset, f->size);
+			__sync_synchronize();
+
+			s->seq = 2*n;
+			__sync_synchronize();
+			h->head = n;
+
+			if ( interval ) {
+				struct timespec t;
+				t.tv_sec = interval / 1000;
+				t.tv_nsec = (interval % 1000) * 1000000L;
+				nanosleep(&t, NULL);
+			}
+		}
+	}
+
+	__sync_synchronize();
+	h->flags |= SHMRING_CLOSED;
+
+	munmap(h, size);
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "jp2a.h"
+
+// A small hash table mapping strings to strings, using separate chaining.
+
+typedef struct strtab_entry_ {
+	struct strtab_entry_ *next;
+	unsigned long hash;
+	char *key;
+	char *value;
+} strtab_entry;
+
+struct strtab_ {
+	strtab_entry **bucket;
+	size_t buckets;
+	size_t count;
+};
+
+// 32-bit FNV-1a, pass HASH_INIT as h to start a new hash
+unsigned long hash_bytes(const void *p, size_t len, unsigned long h) {
+	const unsigned char *s = (const unsigned char*) p;
+
+	while ( len-- ) {
+		h ^= *s++;
+		h = (h * 16777619UL) & 0xffffffffUL;
+	}
+
+	return h;
+}
+
+static unsigned long hash_string(const char *s) {
+	return hash_bytes(s, strlen(s), HASH_INIT);
+}
+
+static char* copy_string(const char *s) {
+	char *p = (char*) malloc(strlen(s) + 1);
+	if ( p ) strcpy(p, s);
+	return p;
+}
+
+strtab* strtab_new() {
+	strtab *t = (strtab*) malloc(sizeof(strtab));
+
+	if ( t == NULL )
+		return NULL;
+
+	t->buckets = 256;
+	t->count = 0;
+	t->bucket = (strtab_entry**) calloc(t->buckets, sizeof(strtab_entry*));
+
+	if ( t->bucket == NULL ) {
+		free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+void strtab_free(strtab *t) {
+	size_t n;
+
+	if ( t == NULL )
+		return;
+
+	for ( n=0; n < t->buckets; ++n ) {
+		strtab_entry *e = t->bucket[n];
+
+		while ( e ) {
+			strtab_entry *next = e->next;
+			free(e->key);
+			free(e->value);
+			free(e);
+			e = next;
+		}
+	}
+
+	free(t->bucket);
+	free(t);
+}
+
+static strtab_entry* strtab_find(const strtab *t, const char *key, const unsigned long hash) {
+	strtab_entry *e = t->bucket[hash & (t->buckets - 1)];
+
+	while ( e && (e->hash != hash || strcmp(e->key, key)) )
+		e = e->next;
+
+	return e;
+}
+
+// Double the number of buckets to keep the chains short.
+static void strtab_grow(strtab *t) {
+	const size_t buckets = t->buckets * 2;
+	strtab_entry **bucket = (strtab_entry**) calloc(buckets, sizeof(strtab_entry*));
+	size_t n;
+
+	if ( bucket == NULL )
+		return; // keep going with longer chains
+
+	for ( n=0; n < t->buckets; ++n ) {
+		strtab_entry *e = t->bucket[n];
+
+		while ( e ) {
+			strtab_entry *next = e->next;
+			e->next = bucket[e->hash & (buckets - 1)];
+			bucket[e->hash & (buckets - 1)] = e;
+			e = next;
+		}
+	}
+
+	free(t->bucket);
+	t->bucket = bucket;
+	t->buckets = buckets;
+}
+
+// Return value stored for key, or NULL if there is none.
+const char* strtab_get(const strtab *t, const char *key) {
+	const strtab_entry *e = strtab_find(t, key, hash_string(key));
+	return e? e->value : NULL;
+}
+
+// Store a copy of key and value, replacing any previous value.
+// Returns 0 on success and -1 if we ran out of memory.
+int strtab_put(strtab *t, const char *key, const char *value) {
+	const unsigned long hash = hash_string(key);
+	strtab_entry *e = strtab_find(t, key, hash);
+	char *v = copy_string(value);
+
+	if ( v == NULL )
+		return -1;
+
+	if ( e ) {
+		free(e->value);
+		e->value = v;
+		return 0;
+	}
+
+	if ( (e = (strtab_entry*) malloc(sizeof(strtab_entry))) == NULL ||
+	     (e->key = copy_string(key)) == NULL )
+	{
+		free(e);
+		free(v);
+		return -1;
+	}
+
+	e->hash = hash;
+	e->value = v;
+	e->next = t->bucket[hash & (t->buckets - 1)];
+	t->bucket[hash & (t->buckets - 1)] = e;
+
+	if ( ++t->count > t->buckets - t->buckets/4 )
+		strtab_grow(t);
+
+	return 0;
+}
+
+size_t strtab_count(const strtab *t) {
+	return t->count;
+}
+
+// Call fn for each entry, in no particular order.
+void strtab_each(const strtab *t, void (*fn)(const char *key, const char *value, void *arg), void *arg) {
+	size_t n;
+
+	for ( n=0; n < t->buckets; ++n ) {
+		const strtab_entry *e;
+
+		for ( e = t->bucket[n]; e; e = e->next )
+			fn(e->key, e->value, arg);
+	}
+}
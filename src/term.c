@@ -17,6 +17,14 @@
 #include <stdlib.h>
 #endif
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+
 #ifdef HAVE_CURSES_H
 #include <curses.h>
 #endif
@@ -36,6 +44,30 @@
 #endif
 #endif
 
+#if defined(FEAT_TERMLIB) && !defined(WIN32)
+// Ask the terminal on standard output or error for its size.  This is
+// much faster than reading the termcap database, so it's tried first.
+// Returns nonzero on success.
+static int ioctl_termsize(int *width, int *height) {
+#ifdef TIOCGWINSZ
+	struct winsize ws;
+
+	if ( ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) &&
+	     ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) )
+		return 0;
+
+	if ( ws.ws_col < 1 || ws.ws_row < 1 )
+		return 0;
+
+	*width = ws.ws_col;
+	*height = ws.ws_row;
+	return 1;
+#else
+	return 0;
+#endif
+}
+#endif
+
 /*
  * Returns:  1  success
  *           0  terminal type not defined
@@ -69,6 +101,9 @@ int get_termsize(int* _width, int* _height, char** err) {
 	return 1;
 #else
 
+	if ( ioctl_termsize(_width, _height) )
+		return 1;
+
 	if ( !termtype ) {
 		strcpy(errstr, "Environment variable TERM not set.");
 		return -2;
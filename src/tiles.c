@@ -0,0 +1,419 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "aspect_ratio.h"
+#include "decoder.h"
+#include "image.h"
+#include "jp2a.h"
+#include "options.h"
+
+/*
+ * --tiles=COLSxROWS prints each image as a poster: its output, at the
+ * size given by --width, --height or --size, is cut into COLS x ROWS
+ * tiles, each written to its own file named by --output-template, where
+ * %t is the row and column of the tile.
+ *
+ * Only one tile is converted at a time, so the buffers for the output are
+ * as big as a tile, not the whole poster.  Each tile decodes only the
+ * part of the image under it, with a cropping decoder (see crop.c), and
+ * a few threads decode the next tiles while one is converted and written.
+ * Decoding threads only touch the tile they decode, and keep their
+ * decoder state per thread (see DECODER_LOCAL).
+ */
+
+// most threads decoding at once, and tiles decoded ahead
+#define TILE_THREADS 8
+
+typedef struct tile_ {
+	int x, y, w, h;    // the region of the image, before flipping
+	int cols, rows;    // the size of the tile in characters
+	char name[32];     // for %t
+	image_t *image;    // NULL if it could not be decoded
+	int damaged;
+	int decoded;
+	char failure[256];
+} tile;
+
+static const char *tile_path = NULL;
+static tile *tiles = NULL;
+static int count = 0;
+
+// the size of the image, and the pixels needed for the whole poster
+static int full_width, full_height;
+static int need_width, need_height;
+
+// Decode the region of a tile.  This runs in the decoding threads.
+static void tile_decode(tile *t) {
+	static DECODER_LOCAL decoder d; // not on the stack, since we may longjmp back here
+	static DECODER_LOCAL image_t *p;
+	static DECODER_LOCAL FILE *fp;
+	static DECODER_LOCAL int x, y, w, h;
+	jmp_buf env;
+
+	x = t->x;
+	y = t->y;
+	w = t->w;
+	h = t->h;
+
+	if ( (fp = fopen(tile_path, "rb")) == NULL ) {
+		snprintf(t->failure, sizeof(t->failure), "Can't open file");
+		return;
+	}
+
+	d.b = NULL;
+	p = NULL;
+	decoder_damaged();
+
+	if ( setjmp(env) ) {
+		decoder_catch(NULL);
+
+		if ( d.b != NULL && d.b->close != NULL )
+			d.b->close(&d);
+
+		image_destroy(p);
+		fclose(fp);
+		snprintf(t->failure, sizeof(t->failure), "%s", decoder_failure());
+		return;
+	}
+
+	decoder_catch(&env);
+	decoder_open(&d, fp);
+
+	if ( d.width != full_width || d.height != full_height )
+		decoder_fail("Image changed while it was converted");
+
+	if ( d.b->shrink ) {
+		d.b->shrink(&d, need_width, need_height);
+
+		if ( d.width != full_width ) {
+			const int right = (int) (((long) (x + w) * d.width + full_width - 1) / full_width);
+			x = (int) ((long) x * d.width / full_width);
+			w = right - x;
+		}
+
+		if ( d.height != full_height ) {
+			const int bottom = (int) (((long) (y + h) * d.height + full_height - 1) / full_height);
+			y = (int) ((long) y * d.height / full_height);
+			h = bottom - y;
+		}
+	}
+
+	// rows of a flipped image come out on the other side
+	if ( d.flipx ) x = d.width - x - w;
+	if ( d.flipy ) y = d.height - y - h;
+
+	decoder_crop(&d, x, y, w, h);
+	p = image_new(d.width, d.height, d.components);
+
+	while ( d.scanline < d.height ) {
+		decoder_read_row(&d, p->pixels + (size_t) d.scanline * d.width * d.components);
+		++d.scanline;
+	}
+
+	d.b->close(&d);
+
+	decoder_catch(NULL);
+	fclose(fp);
+
+	if ( (t->damaged = decoder_damaged()) )
+		snprintf(t->failure, sizeof(t->failure), "%s", decoder_failure());
+
+	t->image = p;
+}
+
+#ifdef FEAT_THREADS
+
+#include <pthread.h>
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static int next = 0;  // the next tile to decode
+static int limit = 0; // tiles up to here may be decoded
+static int quit = 0;
+
+static void* decode_thread(void *arg) {
+	pthread_mutex_lock(&lock);
+
+	for ( ;; ) {
+		tile *t;
+
+		while ( next >= limit && !quit )
+			pthread_cond_wait(&changed, &lock);
+
+		if ( next >= limit )
+			break;
+
+		t = &tiles[next++];
+		pthread_mutex_unlock(&lock);
+
+		tile_decode(t);
+
+		pthread_mutex_lock(&lock);
+		t->decoded = 1;
+		pthread_cond_broadcast(&changed);
+	}
+
+	pthread_mutex_unlock(&lock);
+	return arg;
+}
+
+#endif
+
+// Read the header of the image, and cut its output into tiles.  Returns
+// zero on success.
+static int plan(const char *path) {
+	static decoder d; // not on the stack, since we may longjmp back here
+	static FILE *fp;
+	int x = 0, y = 0, w, h, subx, suby, digits, n;
+	char format[16];
+	jmp_buf env;
+
+	if ( (fp = fopen(path, "rb")) == NULL ) {
+		progress_clear();
+		fprintf(stderr, "Can't open %s\n", path);
+		return -1;
+	}
+
+	d.b = NULL;
+
+	if ( setjmp(env) ) {
+		decoder_catch(NULL);
+
+		if ( d.b != NULL && d.b->close != NULL )
+			d.b->close(&d);
+
+		fclose(fp);
+		progress_clear();
+		fprintf(stderr, "Could not convert %s: %s\n", path, decoder_failure());
+		return -1;
+	}
+
+	decoder_catch(&env);
+	decoder_open(&d, fp);
+
+	full_width = w = d.width;
+	full_height = h = d.height;
+	crop_region(full_width, full_height, &x, &y, &w, &h);
+
+	restore_dimensions();
+	aspect_ratio(w, h);
+	sample_size(&subx, &suby);
+
+	// enough pixels for the whole poster, as convert() would use
+	need_width = (int) (((long) width * subx * full_width + w - 1) / w);
+	need_height = (int) (((long) height * suby * full_height + h - 1) / h);
+
+	d.b->close(&d);
+	decoder_catch(NULL);
+	fclose(fp);
+
+	if ( width < tile_cols || height < tile_rows ) {
+		progress_clear();
+		fprintf(stderr, "Can't cut %dx%d characters of %s into %dx%d tiles\n",
+			width, height, path, tile_cols, tile_rows);
+		return -1;
+	}
+
+	count = tile_cols * tile_rows;
+
+	if ( (tiles = (tile*) calloc(count, sizeof(tile))) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory for --tiles\n", stderr);
+		exit(1);
+	}
+
+	digits = snprintf(format, sizeof(format), "%d", tile_cols > tile_rows? tile_cols : tile_rows);
+
+	for ( n=0; n < count; ++n ) {
+		tile *t = &tiles[n];
+		const int col = n % tile_cols, row = n / tile_cols;
+
+		// the tile's place in the image, which --flipx and --flipy put
+		// elsewhere in the poster
+		const int ix = flipx? tile_cols - col - 1 : col;
+		const int iy = flipy? tile_rows - row - 1 : row;
+
+		const int left = ix * width / tile_cols, right = (ix + 1) * width / tile_cols;
+		const int top = iy * height / tile_rows, bottom = (iy + 1) * height / tile_rows;
+
+		t->cols = right - left;
+		t->rows = bottom - top;
+
+		t->x = x + (int) ((long) left * w / width);
+		t->y = y + (int) ((long) top * h / height);
+		t->w = x + (int) ((long) right * w / width) - t->x;
+		t->h = y + (int) ((long) bottom * h / height) - t->y;
+
+		if ( t->w < 1 ) t->w = 1;
+		if ( t->h < 1 ) t->h = 1;
+		if ( t->x + t->w > full_width ) t->x = full_width - t->w;
+		if ( t->y + t->h > full_height ) t->y = full_height - t->h;
+
+		snprintf(t->name, sizeof(t->name), "%0*d-%0*d", digits, row + 1, digits, col + 1);
+	}
+
+	// the tiles are printed flipped like the whole image would be
+	flipx ^= d.flipx;
+	flipy ^= d.flipy;
+	return 0;
+}
+
+// Convert a decoded tile into its file.  Returns zero on success.
+static int tile_write(const tile *t) {
+	FILE *file, *fout;
+	decoder d;
+	int failed = 0;
+
+	if ( (file = batch_create(tile_path, t->name)) == NULL )
+		return -1;
+
+	fout = compress_open(file);
+
+	width = t->cols;
+	height = t->rows;
+	auto_width = auto_height = 0;
+
+	// flips of the image are already in flipx and flipy, see plan()
+	memory_decoder(&d, t->image);
+	render(&d, fout);
+	d.b->close(&d);
+
+	output_drain();
+
+	if ( compress_close(fout) )
+		failed = -1;
+
+	fclose(file);
+	return failed;
+}
+
+// Convert an image into tiles.  Returns nonzero if it, or some of its
+// tiles, could not be converted; see batch_done().
+int tiles_file(const char *path) {
+	const int store_flipx = flipx, store_flipy = flipy;
+	int n, failed = 0, damaged = 0;
+#ifdef FEAT_THREADS
+	pthread_t threads[TILE_THREADS];
+	int started = 0, cpus = TILE_THREADS;
+#endif
+
+	if ( verbose ) {
+		progress_clear();
+		fprintf(stderr, "File: %s\n", path);
+	}
+
+	// errors of the plan are printed on their own line
+	progress_clear();
+	progress_file(path);
+	tile_path = path;
+
+	if ( plan(path) ) {
+		flipx = store_flipx;
+		flipy = store_flipy;
+		return 1;
+	}
+
+	if ( verbose ) {
+		progress_clear();
+		fprintf(stderr, "Tiles: %dx%d of %dx%d characters\n",
+			tile_cols, tile_rows, width, height);
+	}
+
+#ifdef FEAT_THREADS
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	next = 0;
+	limit = 0;
+	quit = 0;
+
+	for ( n=0; n < TILE_THREADS && n < cpus && n < count; ++n ) {
+		if ( pthread_create(&threads[n], NULL, decode_thread, NULL) )
+			break;
+		++started;
+	}
+#endif
+
+	for ( n=0; n < count; ++n ) {
+		tile *t = &tiles[n];
+
+#ifdef FEAT_THREADS
+		if ( started ) {
+			pthread_mutex_lock(&lock);
+
+			// decode this tile and a few after it
+			limit = n + TILE_THREADS < count? n + TILE_THREADS : count;
+			pthread_cond_broadcast(&changed);
+
+			while ( !t->decoded )
+				pthread_cond_wait(&changed, &lock);
+
+			pthread_mutex_unlock(&lock);
+		}
+		else
+#endif
+		tile_decode(t);
+
+		if ( t->image == NULL ) {
+			progress_clear();
+			fprintf(stderr, "Could not convert tile %s of %s: %s\n", t->name, path, t->failure);
+			failed = 1;
+			continue;
+		}
+
+		if ( t->damaged && !damaged ) {
+			progress_clear();
+			fprintf(stderr, "Converted part of %s: %s\n", path, t->failure);
+			damaged = 1;
+		}
+
+		progress_part(n, count);
+
+		if ( tile_write(t) )
+			failed = 1;
+
+		image_destroy(t->image);
+		t->image = NULL;
+	}
+
+#ifdef FEAT_THREADS
+	pthread_mutex_lock(&lock);
+	quit = 1;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+
+	for ( n=0; n < started; ++n )
+		pthread_join(threads[n], NULL);
+#endif
+
+	free(tiles);
+	tiles = NULL;
+	count = 0;
+
+	flipx = store_flipx;
+	flipy = store_flipy;
+
+	return failed || damaged;
+}
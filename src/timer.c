@@ -0,0 +1,39 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_CLOCK_GETTIME
+#include <time.h>
+#else
+ #ifdef HAVE_GETTIMEOFDAY
+ #include <sys/time.h>
+ #else
+ #include <time.h>
+ #endif
+#endif
+
+#include "jp2a.h"
+
+// Return seconds since some fixed point in time, for measuring durations.
+double timer_now() {
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#else
+ #ifdef HAVE_GETTIMEOFDAY
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double) tv.tv_sec + (double) tv.tv_usec / 1e6;
+ #else
+	return (double) clock() / (double) CLOCKS_PER_SEC;
+ #endif
+#endif
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "jp2a.h"
+#include "options.h"
+
+// UTF-8 encoded characters for each --unicode mode, indexed by a bit
+// pattern of lit subpixels.  Bit n is subpixel (n % cols, n / cols),
+// counting from the upper left, for a cell of cols x rows subpixels.
+
+static const char* const halfblock_utf8[4] = {
+	" ",            // 00
+	"\xe2\x96\x80", // 01 upper half block
+	"\xe2\x96\x84", // 10 lower half block
+	"\xe2\x96\x88", // 11 full block
+};
+
+static const char* const quadrant_utf8[16] = {
+	" ",            // 0000
+	"\xe2\x96\x98", // 0001 quadrant upper left
+	"\xe2\x96\x9d", // 0010 quadrant upper right
+	"\xe2\x96\x80", // 0011 upper half block
+	"\xe2\x96\x96", // 0100 quadrant lower left
+	"\xe2\x96\x8c", // 0101 left half block
+	"\xe2\x96\x9e", // 0110 quadrant upper right and lower left
+	"\xe2\x96\x9b", // 0111 quadrant upper left and upper right and lower left
+	"\xe2\x96\x97", // 1000 quadrant lower right
+	"\xe2\x96\x9a", // 1001 quadrant upper left and lower right
+	"\xe2\x96\x90", // 1010 right half block
+	"\xe2\x96\x9c", // 1011 quadrant upper left and upper right and lower right
+	"\xe2\x96\x84", // 1100 lower half block
+	"\xe2\x96\x99", // 1101 quadrant upper left and lower left and lower right
+	"\xe2\x96\x9f", // 1110 quadrant upper right and lower left and lower right
+	"\xe2\x96\x88", // 1111 full block
+};
+
+// Braille patterns are U+2800 plus a bit for each dot, but the dots are
+// numbered down the left column first, with the bottom row added last.
+static const int braille_dot[8] = {
+	0x01, 0x08, // dots 1, 4
+	0x02, 0x10, // dots 2, 5
+	0x04, 0x20, // dots 3, 6
+	0x40, 0x80, // dots 7, 8
+};
+
+static char braille_utf8[256][4];
+
+static void init_braille() {
+	int bits, n;
+
+	for ( bits=0; bits < 256; ++bits ) {
+		int dots = 0;
+
+		for ( n=0; n < 8; ++n )
+			if ( bits & (1 << n) ) dots |= braille_dot[n];
+
+		braille_utf8[bits][0] = (char) 0xe2;
+		braille_utf8[bits][1] = (char) (0xa0 | (dots >> 6));
+		braille_utf8[bits][2] = (char) (0x80 | (dots & 0x3f));
+		braille_utf8[bits][3] = 0;
+	}
+}
+
+// Number of subpixels per character cell for the current --unicode mode.
+void unicode_cell_size(int *cols, int *rows) {
+	switch ( unicode ) {
+	case UNICODE_HALFBLOCK: *cols = 1; *rows = 2; break;
+	case UNICODE_QUADRANT:  *cols = 2; *rows = 2; break;
+	case UNICODE_BRAILLE:   *cols = 2; *rows = 4; break;
+	default:                *cols = 1; *rows = 1; break;
+	}
+}
+
+// UTF-8 string for a cell with the given subpixels lit.
+const char* unicode_cell(const int bits) {
+	switch ( unicode ) {
+	case UNICODE_HALFBLOCK: return halfblock_utf8[bits & 3];
+	case UNICODE_QUADRANT:  return quadrant_utf8[bits & 15];
+	case UNICODE_BRAILLE:
+		if ( !braille_utf8[0][0] ) init_braille();
+		return braille_utf8[bits & 255];
+	}
+	return " ";
+}
@@ -0,0 +1,625 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "jp2a.h"
+
+#ifdef FEAT_VIEWER
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+
+#include "decoder.h"
+#include "image.h"
+#include "options.h"
+
+/*
+ * --interactive shows one image in the terminal, and lets the user pan
+ * with the arrow keys and zoom with + and -.
+ *
+ * The image is kept as tiles of TILE x TILE pixels, at full size and at
+ * 1/2, 1/4 and 1/8 size.  Each view is put together from the tiles of the
+ * smallest level that still has a pixel for each sample of the output.
+ * Missing tiles in a row are decoded together: for JPEG images, with the
+ * IDCT scaling to the level and only the region of the tiles, so panning
+ * and zooming don't decode the whole file again.  Other formats are
+ * decoded once, and the levels made by scaling down.
+ *
+ * Only the lines of the terminal that changed are redrawn.
+ */
+
+#define TILE 256
+#define MAX_TILES 64
+#define LEVELS 4
+#define ZOOM_STEP 1.5
+#define ESC_WAIT 50 // milliseconds to wait for the rest of an arrow key
+
+typedef struct tile_ {
+	int level, tx, ty;
+	unsigned long used; // 0 if the slot is free
+	image_t *p;
+} tile;
+
+typedef struct viewer_ {
+	FILE *fp;
+	int width, height, components; // full size
+	int scalable;                  // backend can decode smaller sizes
+	int level_w[LEVELS], level_h[LEVELS];
+	image_t *whole[LEVELS];        // levels of images that are not scalable
+	tile tiles[MAX_TILES];
+	unsigned long clock;
+	int decodes;                   // tile rows decoded so far
+
+	double cx, cy;                 // center of the view, in full size pixels
+	double zoom;                   // full size pixels per character
+	int level;                     // level of the last view
+
+	char **lines;                  // lines on the screen
+	int line_count;
+} viewer;
+
+static struct termios saved_tio;
+static int signal_pipe[2] = { -1, -1 };
+
+static void on_signal(int sig) {
+	const int saved = errno;
+	const char c = sig == SIGWINCH? 'w' : 'q';
+
+	if ( write(signal_pipe[1], &c, 1) < 0 ) {
+		// pipe is full, the main loop has enough to do
+	}
+
+	errno = saved;
+}
+
+static void terminal_restore() {
+	tcsetattr(STDIN_FILENO, TCSANOW, &saved_tio);
+	fputs("\033[0m\033[?25h\033[?1049l", stdout); // show cursor, leave alternate screen
+	fflush(stdout);
+}
+
+static int terminal_setup() {
+	struct termios tio;
+	struct sigaction sa;
+
+	if ( tcgetattr(STDIN_FILENO, &saved_tio) || pipe(signal_pipe) )
+		return -1;
+
+	fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGWINCH, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// read keys as they are pressed, without echo
+	tio = saved_tio;
+	tio.c_lflag &= ~(ICANON | ECHO);
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+
+	if ( tcsetattr(STDIN_FILENO, TCSANOW, &tio) )
+		return -1;
+
+	atexit(terminal_restore);
+
+	fputs("\033[?1049h\033[?25l", stdout); // alternate screen, hide cursor
+	return 0;
+}
+
+static void terminal_size(int *cols, int *rows) {
+#ifdef TIOCGWINSZ
+	struct winsize ws;
+
+	if ( !ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) && ws.ws_col > 0 && ws.ws_row > 1 ) {
+		*cols = ws.ws_col;
+		*rows = ws.ws_row;
+		return;
+	}
+#endif
+
+	*cols = term_width > 0? term_width : 80;
+	*rows = term_height > 1? term_height : 25;
+}
+
+// Open the image, and read its size at each level.
+static void viewer_open(viewer *v, const char *path) {
+	decoder d;
+	int l;
+
+	memset(v, 0, sizeof(viewer));
+
+	if ( (v->fp = fopen(path, "rb")) == NULL ) {
+		fprintf(stderr, "Can't open %s\n", path);
+		exit(1);
+	}
+
+	decoder_open(&d, v->fp);
+	v->width = d.width;
+	v->height = d.height;
+	v->components = d.components;
+	v->scalable = d.b->shrink != NULL;
+	d.b->close(&d);
+
+	for ( l=0; l < LEVELS; ++l ) {
+		v->level_w[l] = (v->width + (1 << l) - 1) >> l;
+		v->level_h[l] = (v->height + (1 << l) - 1) >> l;
+	}
+}
+
+// Put a new tile in the slot used longest ago.
+static tile* tile_put(viewer *v, const int level, const int tx, const int ty, image_t *p) {
+	tile *t = &v->tiles[0];
+	int n;
+
+	for ( n=1; n < MAX_TILES && t->used; ++n ) {
+		if ( v->tiles[n].used < t->used )
+			t = &v->tiles[n];
+	}
+
+	image_destroy(t->p);
+
+	t->level = level;
+	t->tx = tx;
+	t->ty = ty;
+	t->used = ++v->clock;
+	t->p = p;
+	return t;
+}
+
+static tile* tile_find(viewer *v, const int level, const int tx, const int ty) {
+	int n;
+
+	for ( n=0; n < MAX_TILES; ++n ) {
+		tile *t = &v->tiles[n];
+
+		if ( t->used && t->level == level && t->tx == tx && t->ty == ty ) {
+			t->used = ++v->clock;
+			return t;
+		}
+	}
+
+	return NULL;
+}
+
+// Copy a w x h region at x, y of s into a new image.
+static image_t* image_part(const image_t *s, const int x, const int y, const int w, const int h) {
+	image_t *p = image_new(w, h, s->components);
+	int row;
+
+	for ( row=0; row < h; ++row )
+		memcpy(p->pixels + (size_t) row * w * s->components,
+		       s->pixels + ((size_t) (y + row) * s->w + x) * s->components,
+		       (size_t) w * s->components);
+
+	return p;
+}
+
+// Decode the region of tiles tx0 .. tx1 in tile row ty of a level.
+static image_t* decode_strip(viewer *v, const int level, const int ty, const int tx0, const int tx1) {
+	const int x = tx0 * TILE, y = ty * TILE;
+	int w = (tx1 + 1) * TILE, h = TILE;
+	const int store_quality = quality, store_thumbnail = use_thumbnail;
+	image_t *p;
+	decoder d;
+
+	if ( w > v->level_w[level] ) w = v->level_w[level];
+	if ( y + h > v->level_h[level] ) h = v->level_h[level] - y;
+	w -= x;
+
+	++v->decodes;
+
+	if ( !v->scalable ) {
+		if ( v->whole[0] == NULL ) {
+			rewind(v->fp);
+			v->whole[0] = image_read(v->fp);
+		}
+
+		if ( v->whole[level] == NULL ) {
+			v->whole[level] = image_new(v->level_w[level], v->level_h[level], v->components);
+			image_resize(v->whole[0], v->whole[level]);
+		}
+
+		return image_part(v->whole[level], x, y, w, h);
+	}
+
+	rewind(v->fp);
+	decoder_open(&d, v->fp);
+
+	// the backend only scales with --quality=fast, and may pick a thumbnail
+	quality = QUALITY_FAST;
+	use_thumbnail = 0;
+	d.b->shrink(&d, v->width >> level, v->height >> level);
+	quality = store_quality;
+	use_thumbnail = store_thumbnail;
+
+	// the decoder rounds up the same way as level_w and level_h
+	if ( x + w > d.width ) w = d.width - x;
+	if ( y + h > d.height ) h = d.height - y;
+
+	decoder_crop(&d, x, y, w, h);
+	p = image_new(w, h, d.components);
+
+	while ( d.scanline < d.height ) {
+		decoder_read_row(&d, p->pixels + (size_t) d.scanline * w * d.components);
+		++d.scanline;
+	}
+
+	d.b->close(&d);
+	return p;
+}
+
+// Return a tile, decoding it and the missing tiles to its right in the
+// same pass if it's not in the cache.
+static const image_t* tile_get(viewer *v, const int level, const int tx, const int ty, const int last_tx) {
+	tile *t = tile_find(v, level, tx, ty);
+	image_t *strip;
+	int end = tx, n;
+
+	if ( t != NULL )
+		return t->p;
+
+	// at most half of the cache, so the strip doesn't push out its own tiles
+	while ( end < last_tx && end - tx + 1 < MAX_TILES / 2 && !tile_find(v, level, end + 1, ty) )
+		++end;
+
+	strip = decode_strip(v, level, ty, tx, end);
+
+	for ( n=tx; n <= end; ++n ) {
+		const int x = (n - tx) * TILE;
+		const int w = x + TILE > strip->w? strip->w - x : TILE;
+		t = tile_put(v, level, n, ty, image_part(strip, x, 0, w, strip->h));
+	}
+
+	image_destroy(strip);
+	return tile_find(v, level, tx, ty)->p;
+}
+
+// Put together the w x h region at x, y of a level from tiles.
+static image_t* viewer_region(viewer *v, const int level, const int x, const int y, const int w, const int h) {
+	image_t *p = image_new(w, h, v->components);
+	const int c = v->components;
+	const int tx0 = x / TILE, tx1 = (x + w - 1) / TILE;
+	const int ty0 = y / TILE, ty1 = (y + h - 1) / TILE;
+	int tx, ty, row;
+
+	for ( ty=ty0; ty <= ty1; ++ty ) {
+		for ( tx=tx0; tx <= tx1; ++tx ) {
+			const image_t *t = tile_get(v, level, tx, ty, tx1);
+
+			// the part of the tile inside the region
+			const int left = tx == tx0? x - tx * TILE : 0;
+			const int top = ty == ty0? y - ty * TILE : 0;
+			const int right = tx == tx1? x + w - tx * TILE : t->w;
+			const int bottom = ty == ty1? y + h - ty * TILE : t->h;
+
+			for ( row=top; row < bottom; ++row )
+				memcpy(p->pixels + ((size_t) (ty * TILE + row - y) * w + tx * TILE + left - x) * c,
+				       t->pixels + ((size_t) row * t->w + left) * c,
+				       (size_t) (right - left) * c);
+		}
+	}
+
+	return p;
+}
+
+// Zoom that shows the whole image.
+static double zoom_fit(const viewer *v, const int cols, const int rows) {
+	const double zx = (double) v->width / cols;
+	const double zy = (double) v->height / (2.0 * rows);
+	return zx > zy? zx : zy;
+}
+
+// Convert the current view, and return the output.
+static char* viewer_render(viewer *v, const int cols, const int rows, size_t *size) {
+	const int border = use_border * 2;
+	double fit, src_w, src_h, x0, y0, step;
+	int subx, suby, level = 0, lx, ly, lw, lh;
+	char *out = NULL;
+	image_t *p;
+	decoder d;
+	FILE *f;
+
+	sample_size(&subx, &suby);
+
+	// the most we can zoom out is to show all of it
+	fit = zoom_fit(v, cols - border, rows - border);
+	if ( v->zoom > fit ) v->zoom = fit;
+	if ( v->zoom < 1.0 / subx ) v->zoom = 1.0 / subx;
+
+	src_w = (cols - border) * v->zoom;
+	src_h = (rows - border) * 2.0 * v->zoom;
+	if ( src_w > v->width ) src_w = v->width;
+	if ( src_h > v->height ) src_h = v->height;
+
+	// keep the view inside the image
+	if ( v->cx < src_w / 2 ) v->cx = src_w / 2;
+	if ( v->cy < src_h / 2 ) v->cy = src_h / 2;
+	if ( v->cx > v->width - src_w / 2 ) v->cx = v->width - src_w / 2;
+	if ( v->cy > v->height - src_h / 2 ) v->cy = v->height - src_h / 2;
+
+	x0 = v->cx - src_w / 2;
+	y0 = v->cy - src_h / 2;
+
+	// the smallest level with a pixel for each sample
+	for ( step = 2.0; level + 1 < LEVELS && step * subx <= v->zoom; step *= 2.0 )
+		++level;
+
+	lx = (int) (x0 / (1 << level));
+	ly = (int) (y0 / (1 << level));
+	lw = (int) (src_w / (1 << level) + 0.5);
+	lh = (int) (src_h / (1 << level) + 0.5);
+	if ( lw < 1 ) lw = 1;
+	if ( lh < 1 ) lh = 1;
+	if ( lx + lw > v->level_w[level] ) lx = v->level_w[level] - lw;
+	if ( ly + lh > v->level_h[level] ) ly = v->level_h[level] - lh;
+
+	v->level = level;
+	p = viewer_region(v, level, lx, ly, lw, lh);
+
+	auto_width = auto_height = 0;
+	width = (int) (src_w / v->zoom + 0.5);
+	height = (int) (src_h / (2.0 * v->zoom) + 0.5);
+	if ( width < 1 ) width = 1;
+	if ( height < 1 ) height = 1;
+
+	if ( (f = open_memstream(&out, size)) == NULL ) {
+		fputs("Not enough memory to show image\n", stderr);
+		exit(1);
+	}
+
+	memory_decoder(&d, p);
+	convert(&d, f);
+	d.b->close(&d);
+	fclose(f);
+
+	image_destroy(p);
+	return out;
+}
+
+// Draw the lines of the new view that differ from what is on the screen.
+static void viewer_draw(viewer *v, char *out, const size_t size, const int cols, const int rows) {
+	char **lines = (char**) calloc(rows, sizeof(char*));
+	char *s = out, *end = out + size;
+	int n, count = 0;
+	char status[256];
+
+	if ( lines == NULL ) {
+		fputs("Not enough memory to show image\n", stderr);
+		exit(1);
+	}
+
+	while ( s < end && count < rows - 1 ) {
+		char *nl = memchr(s, '\n', end - s);
+		if ( nl == NULL ) nl = end;
+		*nl = 0;
+		if ( (lines[count++] = strdup(s)) == NULL ) {
+			fputs("Not enough memory to show image\n", stderr);
+			exit(1);
+		}
+		s = nl + 1;
+	}
+
+	for ( n=0; n < rows - 1; ++n ) {
+		const char *now = n < count? lines[n] : "";
+		const char *was = n < v->line_count && v->lines[n]? v->lines[n] : NULL;
+
+		if ( was == NULL || strcmp(now, was) )
+			printf("\033[%d;1H%s\033[0m\033[K", n + 1, now);
+	}
+
+	snprintf(status, sizeof(status),
+		"%dx%d at %d,%d  zoom 1:%.1f  level 1/%d  %d decodes  [arrows +/- 0 q]",
+		v->width, v->height, (int) v->cx, (int) v->cy,
+		v->zoom, 1 << v->level, v->decodes);
+
+	printf("\033[%d;1H\033[7m%.*s\033[0m\033[K", rows, cols, status);
+	fflush(stdout);
+
+	for ( n=0; n < v->line_count; ++n )
+		free(v->lines[n]);
+	free(v->lines);
+
+	v->lines = lines;
+	v->line_count = rows - 1;
+}
+
+// Forget what is on the screen, so that all of it is redrawn.
+static void viewer_clear(viewer *v) {
+	int n;
+
+	for ( n=0; n < v->line_count; ++n )
+		free(v->lines[n]);
+
+	free(v->lines);
+	v->lines = NULL;
+	v->line_count = 0;
+
+	fputs("\033[2J", stdout);
+}
+
+// Returns nonzero if the keys end in the first part of an arrow key.
+static int partial_escape(const char *keys, const int len) {
+	return (len >= 1 && keys[len-1] == 27) ||
+	       (len >= 2 && keys[len-2] == 27 && (keys[len-1] == '[' || keys[len-1] == 'O'));
+}
+
+// Handle the keys read, returns nonzero to quit.
+static int viewer_keys(viewer *v, const char *keys, const int len, const int cols, const int rows) {
+	const double pan_x = cols * v->zoom / 4;
+	const double pan_y = rows * 2.0 * v->zoom / 4;
+	int n;
+
+	for ( n=0; n < len; ++n ) {
+		int key = keys[n];
+
+		// arrow keys are ESC [ A or ESC O A
+		if ( key == 27 && n + 2 < len && (keys[n+1] == '[' || keys[n+1] == 'O') ) {
+			key = keys[n+2];
+			n += 2;
+
+			switch ( key ) {
+			case 'A': key = 'k'; break;
+			case 'B': key = 'j'; break;
+			case 'C': key = 'l'; break;
+			case 'D': key = 'h'; break;
+			default: continue;
+			}
+		}
+
+		switch ( key ) {
+		case 'h': v->cx -= pan_x; break;
+		case 'l': v->cx += pan_x; break;
+		case 'k': v->cy -= pan_y; break;
+		case 'j': v->cy += pan_y; break;
+		case '+':
+		case '=': v->zoom /= ZOOM_STEP; break;
+		case '-':
+		case '_': v->zoom *= ZOOM_STEP; break;
+		case '0': v->zoom = zoom_fit(v, cols, rows); break;
+		case 'q':
+		case 'Q':
+		case 27:
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Show the image file given on the command line until the user quits.
+int view_file(int argc, char **argv) {
+	const char *path = NULL;
+	struct pollfd fds[2];
+	viewer v;
+	int n, cols, rows, redraw = 1;
+
+	for ( n=1; n < argc; ++n ) {
+		if ( argv[n][0] == '-' && argv[n][1] )
+			continue;
+
+		if ( path != NULL || !strcmp(argv[n], "-") ) {
+			fputs("--interactive needs one image file\n", stderr);
+			return 1;
+		}
+
+		path = argv[n];
+	}
+
+	if ( path == NULL ) {
+		fputs("--interactive needs one image file\n", stderr);
+		return 1;
+	}
+
+	if ( !isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) ) {
+		fputs("--interactive needs a terminal\n", stderr);
+		return 1;
+	}
+
+	viewer_open(&v, path);
+
+	if ( terminal_setup() ) {
+		perror("Could not set up terminal");
+		return 1;
+	}
+
+	clearscr = 0;
+	terminal_size(&cols, &rows);
+	v.cx = v.width / 2.0;
+	v.cy = v.height / 2.0;
+	v.zoom = zoom_fit(&v, cols, rows - 1);
+
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = signal_pipe[0];
+	fds[1].events = POLLIN;
+
+	for ( ;; ) {
+		char buf[64];
+		ssize_t len;
+
+		if ( redraw ) {
+			size_t size;
+			char *out = viewer_render(&v, cols, rows - 1, &size);
+			viewer_draw(&v, out, size, cols, rows);
+			free(out);
+			redraw = 0;
+		}
+
+		if ( poll(fds, 2, -1) < 0 ) {
+			if ( errno == EINTR )
+				continue;
+
+			perror("poll");
+			return 1;
+		}
+
+		if ( fds[1].revents & POLLIN ) {
+			while ( (len = read(signal_pipe[0], buf, sizeof(buf))) > 0 ) {
+				if ( memchr(buf, 'q', len) )
+					return 0;
+
+				terminal_size(&cols, &rows);
+				viewer_clear(&v);
+				redraw = 1;
+			}
+		}
+
+		if ( fds[0].revents & (POLLIN | POLLHUP) ) {
+			if ( (len = read(STDIN_FILENO, buf, sizeof(buf))) <= 0 )
+				return 0;
+
+			// ESC alone quits, so wait a little for the rest of an
+			// arrow key the terminal sent in more than one write
+			while ( len < (ssize_t) sizeof(buf) && partial_escape(buf, (int) len) &&
+			        poll(fds, 1, ESC_WAIT) > 0 )
+			{
+				const ssize_t more = read(STDIN_FILENO, buf + len, sizeof(buf) - len);
+
+				if ( more <= 0 )
+					break;
+
+				len += more;
+			}
+
+			if ( viewer_keys(&v, buf, (int) len, cols, rows - 1) )
+				return 0;
+
+			redraw = 1;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,297 @@
+/*
+ * Copyright 2006-2016 Christian Stigen Larsen
+ * Distributed under the GNU General Public License (GPL) v2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#undef HAVE_STDLIB_H
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "jp2a.h"
+#include "options.h"
+
+/*
+ * --watch: after the files have been converted, wait for them to be
+ * replaced and convert them again.  We watch the directories holding the
+ * files rather than the files themselves, because programs that replace a
+ * file usually write a new one and rename it over the old.
+ *
+ * With --term-*, SIGWINCH also redraws at the new terminal size.  The
+ * signal handler only writes to a pipe, so everything waits in poll()
+ * and an idle jp2a uses no CPU.
+ */
+
+typedef struct watched_ {
+	int wd;
+	const char *path;
+	const char *name; // file name part of path
+} watched;
+
+static int winch_pipe[2] = { -1, -1 };
+
+static void on_winch(int sig) {
+	const int saved = errno;
+
+	(void) sig;
+
+	if ( write(winch_pipe[1], "", 1) < 0 ) {
+		// pipe is full, so a redraw is already pending
+	}
+
+	errno = saved;
+}
+
+// Set output dimensions from the current terminal size.  Returns nonzero
+// if the size changed.
+static int watch_termsize() {
+#ifdef TIOCGWINSZ
+	struct winsize ws;
+	int w, h;
+
+	if ( ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) &&
+	     ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) )
+		return 0;
+
+	w = ws.ws_col;
+	h = ws.ws_row;
+
+#ifdef __CYGWIN__
+	--w; // see parse_options()
+#endif
+
+	if ( w < 1 || h < 2 || (w == term_width && h == term_height) )
+		return 0;
+
+	term_width = w;
+	term_height = h;
+
+	term_fit();
+	save_dimensions();
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+// Listen for SIGWINCH, returns zero on success.
+static int watch_resize() {
+	struct sigaction sa;
+
+	if ( pipe(winch_pipe) )
+		return -1;
+
+	fcntl(winch_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(winch_pipe[1], F_SETFL, O_NONBLOCK);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_winch;
+	sigemptyset(&sa.sa_mask);
+
+	return sigaction(SIGWINCH, &sa, NULL);
+}
+
+// Convert all watched files again.
+static void redraw(const watched *files, const int count, FILE *fout) {
+	int n;
+
+	output_drain();
+
+	if ( fout != stdout ) {
+		rewind(fout);
+		if ( ftruncate(fileno(fout), 0) ) {
+			progress_clear();
+			fputs("Could not truncate output file\n", stderr);
+			exit(1);
+		}
+	}
+
+	for ( n=0; n < count; ++n )
+		render_file(files[n].path, fout);
+
+	fflush(fout);
+}
+
+// Returns nonzero if any watched file has been replaced.
+static int read_events(const int fd, const watched *files, const int count) {
+	union {
+		struct inotify_event event;
+		char buf[4096];
+	} u;
+	ssize_t len;
+	int changed = 0;
+
+	while ( (len = read(fd, u.buf, sizeof(u.buf))) > 0 ) {
+		char *p = u.buf;
+
+		while ( p < u.buf + len ) {
+			const struct inotify_event *e = (const struct inotify_event*) p;
+			int n;
+
+			for ( n=0; n < count; ++n ) {
+				if ( files[n].wd == e->wd && e->len > 0 && !strcmp(files[n].name, e->name) )
+					changed = 1;
+			}
+
+			p += sizeof(struct inotify_event) + e->len;
+		}
+	}
+
+	return changed;
+}
+
+// Add a watch for each image file given on the command line.  Returns
+// the number of files, or -1 if one can't be watched.
+static int add_watches(const int fd, int argc, char **argv, watched *files) {
+	int n, count = 0;
+
+	for ( n=1; n < argc; ++n ) {
+		const char *path = argv[n];
+		const char *slash = strrchr(path, '/');
+		struct stat st;
+		char dir[4096];
+
+		if ( path[0] == '-' )
+			continue;
+
+		if ( stat(path, &st) || !S_ISREG(st.st_mode) ) {
+			progress_clear();
+			fprintf(stderr, "Can only watch image files, not %s\n", path);
+			return -1;
+		}
+
+		if ( slash == NULL )
+			strcpy(dir, ".");
+		else if ( slash == path )
+			strcpy(dir, "/");
+		else
+			snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path), path);
+
+		files[count].path = path;
+		files[count].name = slash? slash + 1 : path;
+		files[count].wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+
+		if ( files[count].wd < 0 ) {
+			progress_clear();
+			fprintf(stderr, "Can't watch %s: %s\n", dir, strerror(errno));
+			return -1;
+		}
+
+		++count;
+	}
+
+	if ( count == 0 ) {
+		progress_clear();
+		fputs("--watch needs image files to watch\n", stderr);
+	}
+
+	return count? count : -1;
+}
+
+// Redraw when the files change until interrupted.  Returns nonzero if
+// waiting for changes fails.
+static int watch_loop(const int fd, const watched *files, const int count, FILE *fout) {
+	struct pollfd fds[2];
+
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = -1; // poll() skips negative descriptors
+	fds[1].events = POLLIN;
+
+	if ( termfit && watch_resize() == 0 )
+		fds[1].fd = winch_pipe[0];
+
+	// redraw on top of the last image
+	if ( fout == stdout )
+		clearscr = 1;
+
+	fflush(fout);
+
+	for ( ;; ) {
+		int changed = 0;
+
+		if ( poll(fds, 2, -1) < 0 ) {
+			if ( errno == EINTR )
+				continue;
+
+			progress_clear();
+			perror("poll");
+			return 1;
+		}
+
+		if ( fds[1].revents & POLLIN ) {
+			char c;
+			while ( read(winch_pipe[0], &c, 1) > 0 )
+				;
+			changed |= watch_termsize();
+		}
+
+		if ( fds[0].revents & POLLIN )
+			changed |= read_events(fd, files, count);
+
+		if ( changed )
+			redraw(files, count, fout);
+	}
+}
+
+// Watch the image files given on the command line until interrupted.
+// Returns nonzero if they could not be watched.
+int watch_files(int argc, char **argv, FILE *fout) {
+	watched *files;
+	int fd, count, failed;
+
+	if ( (files = (watched*) malloc(argc * sizeof(watched))) == NULL ) {
+		progress_clear();
+		fputs("Not enough memory to watch files\n", stderr);
+		return 1;
+	}
+
+	if ( (fd = inotify_init()) < 0 ) {
+		progress_clear();
+		perror("inotify_init");
+		free(files);
+		return 1;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	count = add_watches(fd, argc, argv, files);
+	failed = count < 0 || watch_loop(fd, files, count, fout);
+
+	close(fd);
+	free(files);
+	return failed;
+}
+
+#endif
@@ -0,0 +1,66 @@
+#!/bin/bash
+
+# Copyright 2006-2016 Christian Stigen Larsen
+#
+# Times each output mode of jp2a on a big output, where most of the time
+# goes to printing characters rather than decoding.  Prints the best of
+# several runs, in milliseconds.  Then times how long jp2a takes to start,
+# as the average of many runs that do next to nothing.
+#
+#   ./benchmark.sh [jp2a]
+
+JP=${1:-../src/jp2a}
+IMAGE=${IMAGE:-grind.jpg}
+SIZE=${SIZE:-1200x800}
+RUNS=${RUNS:-5}
+STARTS=${STARTS:-200}
+
+function bench() {
+	local best=0 n start end
+
+	for n in $(seq ${RUNS}) ; do
+		start=$(date +%s%N)
+		${JP} ${IMAGE} --size=${SIZE} ${2} > /dev/null || return
+		end=$(date +%s%N)
+
+		if [ ${best} -eq 0 ] || [ $((end - start)) -lt ${best} ] ; then
+			best=$((end - start))
+		fi
+	done
+
+	printf "%-32s %8.1f ms\n" "${1}" "$(awk "BEGIN { print ${best} / 1000000 }")"
+}
+
+function startup() {
+	local n start end
+
+	start=$(date +%s%N)
+	for n in $(seq ${STARTS}) ; do
+		${JP} ${2} > /dev/null 2>&1
+	done
+	end=$(date +%s%N)
+
+	printf "%-32s %8.3f ms\n" "${1}" "$(awk "BEGIN { print $((end - start)) / ${STARTS} / 1000000 }")"
+}
+
+echo "${IMAGE} at ${SIZE}, best of ${RUNS} runs"
+
+bench "plain"                 ""
+bench "plain, invert, flipx"  "--invert --flipx"
+bench "plain, flipy"          "--flipy"
+bench "colors"                "--colors"
+bench "colors, fill, flipx"   "--colors --fill --flipx"
+bench "grayscale"             "--grayscale"
+bench "html"                  "--html"
+bench "html, colors"          "--html --colors"
+bench "html, colors, fill"    "--html --colors --fill"
+bench "shapes"                "--shapes"
+bench "shapes, colors"        "--shapes --colors"
+bench "unicode, halfblock"    "--unicode=halfblock --colors"
+
+echo
+echo "Startup, average of ${STARTS} runs"
+
+startup "version"                "--version"
+startup "1x1 render"             "--size=1x1 jp2a.jpg"
+startup "term-fit render"       "--term-fit jp2a.jpg"
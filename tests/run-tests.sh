@@ -37,8 +37,10 @@ function test_failed() {
 	FAILED_STR="${FAILED_STR}\n${2} | diff --strip-trailing-cr --brief - ${1}"
 }
 
-function test_jp2a() {
-	CMD="${JP} ${2}"
+# Run a test whose command is given in full, for one that has to set
+# something up before jp2a runs.
+function test_cmd() {
+	CMD="${2}"
 	printf "test (%2s) %-32s " "$((RESULT_OK+RESULT_FAILED+1))" "(${1})"
 
 	if [ ! -e "${3}" ] ; then
@@ -56,6 +58,25 @@ function test_jp2a() {
 	echo ""
 }
 
+function test_jp2a() {
+	test_cmd "${1}" "${JP} ${2}" "${3}"
+}
+
+# Compare jp2a output on standard input to a reference file, and print
+# "drift ok" if characters differ by at most ${2} palette steps on average.
+function drift() {
+	awk -v max="${2}" -v pal="   ...',;:clodxkO0KXNWM" '
+		NR == FNR { ref[FNR] = $0; next }
+		{
+			for ( i = 1; i <= length($0); ++i ) {
+				d = index(pal, substr($0, i, 1)) - index(pal, substr(ref[FNR], i, 1));
+				sum += d < 0 ? -d : d;
+				++n;
+			}
+		}
+		END { if ( n > 0 && sum/n <= max ) print "drift ok"; else printf("drift %.3f\n", n? sum/n : -1) }' ${1} -
+}
+
 function test_results() {
 	echo ""
 	echo "TEST RESULTS FOR JP2A"
@@ -88,12 +109,28 @@ test_jp2a "size" "--size=1x1 --invert jp2a.jpg" 1x1-inv.txt
 test_jp2a "invert, border" "-i -b --width=110 --height=30 jp2a.jpg" 110x30-i-b.txt
 test_jp2a "width, flip, invert" "--width=78 --flipx --flipy --invert jp2a.jpg" flip-xy-invert.txt
 test_jp2a "width, border" "--width=78 -b jp2a.jpg jp2a.jpg" 2xnormal-b.txt
-test_jp2a "width, verbose" "--verbose --width=78 jp2a.jpg 2>&1 | tr -d '\r'" normal-verbose.txt
+test_jp2a "width, verbose" "--verbose --width=78 jp2a.jpg 2>&1 | tr -d '\r' | awk '/^Decoded in|^Output blocked/ { \$3 = \"N\" } 1'" normal-verbose.txt
+test_jp2a "width, progress, no tty" "--progress=10 --width=78 jp2a.jpg 2>&1" normal.txt
 
 TEMPFILE=`mktemp /tmp/jp2a-test-XXXXXX`
 test_jp2a "width, outfile" "--width=78 jp2a.jpg --output=${TEMPFILE} && cat ${TEMPFILE}" normal.txt
+test_jp2a "render, two outputs" "--render=width=78,output=${TEMPFILE} --render=size=160x49 jp2a.jpg >/dev/null && cat ${TEMPFILE}" normal.txt
 rm -f ${TEMPFILE}
 
+TEMPDIR=`mktemp -d /tmp/jp2a-test-XXXXXX`
+mkdir ${TEMPDIR}/sub && cp jp2a.jpg ${TEMPDIR}/sub/
+test_jp2a "directory, output template" "--width=78 -r --output-template=${TEMPDIR}/out/%n.%e ${TEMPDIR} 2>/dev/null && cat ${TEMPDIR}/out/jp2a.txt" normal.txt
+test_jp2a "directory, state" "--width=78 -r --state=${TEMPDIR}/state ${TEMPDIR} 2>/dev/null && ${JP} --width=78 -r --state=${TEMPDIR}/state ${TEMPDIR} 2>&1 | cut -d' ' -f1-7" batch-state.txt
+test_cmd "directory, state, odd names and option order" "mkdir ${TEMPDIR}/odd && cp jp2a.jpg \"${TEMPDIR}/odd/\$(printf 'a\\tb\\nc').jpg\" && ${JP} --width=40 --flipx -r --state=${TEMPDIR}/odd.state ${TEMPDIR}/odd 2>/dev/null && ${JP} -x --width=40 -r --state=${TEMPDIR}/odd.state ${TEMPDIR}/odd 2>&1 | cut -d' ' -f1-7" batch-state.txt
+test_jp2a "directory, progress, no tty" "--width=78 -r --progress --output-template=${TEMPDIR}/progress/%n.%e ${TEMPDIR}/sub 2>${TEMPDIR}/progress.log && tr -d -c '\\r\\033' < ${TEMPDIR}/progress.log | wc -c | tr -d ' ' && cut -d' ' -f1-7 ${TEMPDIR}/progress.log" batch-progress.txt
+mkdir ${TEMPDIR}/index && cp jp2a.jpg dalsnuten-640x480-gray-low.jpg ${TEMPDIR}/index/
+test_jp2a "index" "--index ${TEMPDIR}/index/jp2a.jpg && ${JP} --verbose --width=78 ${TEMPDIR}/index/jp2a.jpg 2>${TEMPDIR}/index/log >${TEMPDIR}/index/out && grep -q '^Index:' ${TEMPDIR}/index/log && cat ${TEMPDIR}/index/out" normal.txt
+test_jp2a "index, drift" "--index ${TEMPDIR}/index && ${JP} --width=78 ${TEMPDIR}/index/dalsnuten-640x480-gray-low.jpg | drift dalsnuten-normal.txt 0.25" drift-ok.txt
+test_cmd "index, changed with the same time" "touch -r ${TEMPDIR}/index/jp2a.jpg ${TEMPDIR}/index/time && printf x | dd of=${TEMPDIR}/index/jp2a.jpg bs=1 seek=1000 conv=notrunc 2>/dev/null && touch -r ${TEMPDIR}/index/time ${TEMPDIR}/index/jp2a.jpg && ${JP} --verbose --width=78 ${TEMPDIR}/index/jp2a.jpg 2>&1 >/dev/null | grep -c '^Ignoring outdated index'" index-outdated.txt
+test_jp2a "tiles, one" "--width=78 --tiles=1x1 --output-template=${TEMPDIR}/%n-%t.%e jp2a.jpg && cat ${TEMPDIR}/jp2a-1-1.txt" normal.txt
+test_jp2a "tiles, poster" "--width=78 --border --tiles=2x2 jp2a.jpg --output-template=${TEMPDIR}/tiles/%t.txt && paste -d '' ${TEMPDIR}/tiles/1-[12].txt && paste -d '' ${TEMPDIR}/tiles/2-[12].txt" tiles-2x2.txt
+rm -rf ${TEMPDIR}
+
 test_jp2a "width, clear" "--width=78 jp2a.jpg --clear" normal-clear.txt
 test_jp2a "height, grayscale" "logo-40x25-gray.jpg --height=30" logo-30.txt
 test_jp2a "size, invert" "grind.jpg -i --size=80x30" grind.txt
@@ -123,6 +160,73 @@ test_jp2a "html-title, html" "--width=10 --html --html-title='just testing' jp2a
 test_jp2a "color, html-raw" "--width=10 --color --html-raw jp2a.jpg" html-raw.txt
 test_jp2a "color" "grind.jpg --color --width=60" grind-color.txt
 test_jp2a "color, grayscale" "dalsnuten-640x480-gray-low.jpg --color --width=78" dalsnuten-color.txt
+test_jp2a "width, shapes" "--width=78 --shapes jp2a.jpg" normal-shapes.txt
+test_jp2a "color, shapes, flipx" "grind.jpg --color --shapes --flipx --width=60" grind-shapes-color-flipx.txt
+test_jp2a "width, unicode braille" "--width=78 --unicode=braille jp2a.jpg" normal-braille.txt
+test_jp2a "color, unicode halfblock, flipy" "grind.jpg --color --unicode=halfblock --flipy --width=60" grind-halfblock-color-flipy.txt
+test_jp2a "width, thumbnail" "--width=78 --thumbnail dalsnuten-exif.jpg" dalsnuten-thumbnail.txt
+test_jp2a "width, thumbnail, verbose" "--width=78 --thumbnail --verbose dalsnuten-exif.jpg 2>&1 >/dev/null | grep Exif" dalsnuten-thumbnail-verbose.txt
+test_jp2a "quality fast, thumbnail by default" "--width=78 --quality=fast --verbose dalsnuten-exif.jpg 2>&1 >/dev/null | grep Exif" dalsnuten-thumbnail-verbose.txt
+test_jp2a "quality fast, no thumbnail" "--width=78 --quality=fast --no-thumbnail --verbose dalsnuten-exif.jpg 2>&1 >/dev/null | grep -c Exif" dalsnuten-no-thumbnail.txt
+test_jp2a "size, thumbnail too small" "--size=200x60 --thumbnail dalsnuten-exif.jpg" dalsnuten-200x60.txt
+test_jp2a "quality fast, damaged thumbnail" "--width=78 --quality=fast dalsnuten-exif-bad-thumbnail.jpg 2>&1" dalsnuten-bad-thumbnail.txt
+test_jp2a "quality fast, drift" "--quality=fast --width=78 jp2a.jpg | drift normal.txt 2.0" drift-ok.txt
+test_jp2a "quality fast, grayscale, drift" "--quality=fast --width=78 dalsnuten-640x480-gray-low.jpg | drift dalsnuten-normal.txt 0.5" drift-ok.txt
+test_jp2a "quality fast, color, drift" "--quality=fast grind.jpg -i --size=80x30 | drift grind.txt 1.5" drift-ok.txt
+test_jp2a "quality best, grayscale, drift" "--quality=best --width=78 dalsnuten-640x480-gray-low.jpg | drift dalsnuten-normal.txt 0.05" drift-ok.txt
+test_jp2a "quality best, color, drift" "--quality=best grind.jpg -i --size=80x30 | drift grind.txt 0.05" drift-ok.txt
+test_jp2a "interactive, no terminal" "--interactive jp2a.jpg < /dev/null 2>&1 >/dev/null" interactive-no-tty.txt
+
+# keys typed on a terminal made by script(1): zoom in twice, then an arrow
+# key whose ESC comes apart from the rest, and quit
+if command -v script >/dev/null 2>&1 ; then
+	test_cmd "interactive, keys" "(sleep 0.3; printf '++'; sleep 0.2; printf '\\033'; sleep 0.01; printf '[C'; sleep 0.3; printf q) | script -qec 'stty cols 80 rows 24; ${JP} --interactive dalsnuten-640x480-gray-low.jpg' /dev/null | grep -ao 'at [0-9,]*'" interactive-keys.txt
+fi
+test_jp2a "watch, standard input" "--watch --width=78 - < jp2a.jpg 2>&1 >/dev/null" watch-stdin.txt
+test_cmd "watch, redraw on change" "cp logo-40x25-gray.pgm watched.tmp && mv watched.tmp watched.img && { ${JP} --watch --width=78 --output=watched.txt watched.img & sleep 1; cp jp2a.jpg watched.tmp && mv watched.tmp watched.img; sleep 1; kill \$!; wait \$! 2>/dev/null; }; cat watched.txt; rm -f watched.img watched.txt" normal.txt
+test_jp2a "render, flip, invert" "--render=width=10,output=/dev/null --render=width=78,flipx,flipy,invert jp2a.jpg" flip-xy-invert.txt
+test_jp2a "render, color, html, fill" "grind.jpg --html-fontsize=8 --render=width=10 --render=colors,fill,background=dark,width=60,html,output=- | tail -n +5" grind-color-dark-fill.html
+test_jp2a "stream, width" "--stream --width=78 jp2a.jpg" normal.txt
+test_jp2a "stream, color, html, dark fill" "grind.jpg --stream --color --fill --background=dark --width=60 --html --html-fontsize=8" grind-color-dark-fill.html
+test_jp2a "stream, color, shapes, flipx" "grind.jpg --stream --color --shapes --flipx --width=60" grind-shapes-color-flipx.txt
+test_jp2a "stream, color, unicode halfblock, flipy" "grind.jpg --stream --color --unicode=halfblock --flipy --width=60" grind-halfblock-color-flipy.txt
+test_jp2a "crop, whole image" "--crop=100%x100% --width=78 jp2a.jpg" normal.txt
+test_jp2a "crop, width" "--crop=40x25+20+10 --width=60 jp2a.jpg" jp2a-crop-40x25.txt
+test_jp2a "crop, width, png" "--crop=40x25+20+10 --width=60 jp2a.png" jp2a-crop-40x25.txt
+test_jp2a "crop percent, color" "--crop=50%x40%+30%+20% --colors --width=60 grind.jpg" grind-crop-color.txt
+test_jp2a "damaged image, go on with next" "grind-80x60-truncated.ppm jp2a.jpg --width=78 2>/dev/null" normal.txt
+test_jp2a "damaged image, reason and status" "grind-80x60-truncated.ppm jp2a.jpg --width=78 2>&1 >/dev/null; echo \$?" damaged-skipped.txt
+test_jp2a "damaged image, partial" "--partial --width=40 grind-80x60-truncated.ppm 2>/dev/null" grind-80x60-partial.txt
+test_jp2a "full disk, status" "--width=78 jp2a.jpg 2>/dev/null >/dev/full; echo \$?" output-failed.txt
+test_jp2a "auto-levels, dark ppm" "--auto-levels --width=60 grind-80x60-dark.ppm" grind-80x60-dark-levels.txt
+test_jp2a "equalize, dark ppm, color" "--equalize --colors --width=60 grind-80x60-dark.ppm" grind-80x60-dark-equalize.txt
+test_jp2a "equalize, stream" "--equalize --stream --colors --width=60 grind-80x60-dark.ppm" grind-80x60-dark-equalize.txt
+test_cmd "files from, nul separated" "printf 'jp2a.jpg\\0' | ${JP} --files-from=- --width=78 2>/dev/null" normal.txt
+test_jp2a "shards, all of them" "--shard=1/2 --width=78 jp2a.jpg 2>/dev/null ; ${JP} --shard=2/2 --width=78 jp2a.jpg 2>/dev/null" normal.txt
+test_jp2a "journal, skip when done" " 2>/dev/null ; rm -f journal-\$\$; for n in 1 2; do echo jp2a.jpg | ${JP} --files-from=- --width=78 --journal=journal-\$\$ 2>/dev/null; done; rm -f journal-\$\$" normal.txt
+test_jp2a "read ahead, damaged and missing" "--read-ahead=2 grind-80x60-truncated.ppm missing.jpg jp2a.jpg --width=78 2>/dev/null" normal.txt
+test_jp2a "read ahead, render" "--read-ahead=2 --render=width=10,output=/dev/null --render=width=78,flipx,flipy,invert jp2a.jpg" flip-xy-invert.txt
+test_jp2a "grid, captions and missing" "--width=78 --grid=3x2 --grid-captions jp2a.jpg grind.jpg missing.jpg logo-40x25-gray.pgm 2>/dev/null" grid-captions.txt
+test_jp2a "grid, html color" "--width=60 --grid=2 --html --colors --html-title=grid jp2a.png grind-80x60.ppm" grid-html-color.txt
+test_jp2a "compress, gzip" "--compress=gzip --width=78 jp2a.jpg | gzip -dc" normal.txt
+test_jp2a "compress, gzip, many blocks" "--compress=gzip --size=2000x2000 dalsnuten-640x480-gray-low.jpg jp2a.jpg | gzip -dc | tr -d '\r' | wc -c | tr -d ' '" dalsnuten-jp2a-2000x2000-md5.txt
+
+# only when jp2a is built with libzstd, and zstd is there to read it back
+if command -v zstd >/dev/null 2>&1 && ${JP} --compress=zstd --width=1 jp2a.jpg >/dev/null 2>&1 ; then
+	test_jp2a "compress, zstd" "--compress=zstd --width=78 jp2a.jpg | zstd -dc" normal.txt
+	test_jp2a "compress, zstd, many blocks" "--compress=zstd --size=2000x2000 dalsnuten-640x480-gray-low.jpg jp2a.jpg | zstd -dc | tr -d '\r' | wc -c | tr -d ' '" dalsnuten-jp2a-2000x2000-md5.txt
+fi
+test_jp2a "cells" "--format=cells --width=78 jp2a.jpg | ../src/jp2a-cells" normal.txt
+test_jp2a "cells, color" "--format=cells --color --width=60 grind-80x60.ppm | ../src/jp2a-cells --colors" grind-80x60-ppm-color.txt
+test_jp2a "cells, rle, html fill" "grind.jpg --color --fill --background=dark --width=60 --format=cells-rle | ../src/jp2a-cells --colors --html --html-fontsize=8" grind-color-dark-fill.html
+test_cmd "cells, bad headers" "(printf 'JP2C\\1\\0\\5\\0\\377\\377\\377\\377\\1\\0\\0\\0\\1\\0\\0\\0\\0\\0\\0\\0M\\0\\0\\0\\0\\0\\0\\0'; head -c 400000 /dev/zero | tr '\\0' '\\377') | ../src/jp2a-cells 2>&1; echo \$?; ${JP} --format=cells --width=78 jp2a.jpg | head -c 30 | ../src/jp2a-cells 2>&1; echo \$?" cells-bad.txt
+test_cmd "shared memory, jpeg frame" "../src/shmring-producer /jp2a-test-\$\$ jp2a.jpg && ${JP} --shm=/jp2a-test-\$\$ --width=78; ../src/shmring-producer -u /jp2a-test-\$\$" normal.txt
+test_cmd "shared memory, newest raw frame" "../src/shmring-producer /jp2a-test-\$\$ jp2a.jpg grind-80x60.ppm && ${JP} --shm=/jp2a-test-\$\$ --color --width=60; ../src/shmring-producer -u /jp2a-test-\$\$" grind-80x60-ppm-color.txt
+test_jp2a "width, png" "--width=78 jp2a.png" normal.txt
+test_jp2a "png, alpha on the background" "--width=40 jp2a-alpha.png" jp2a-alpha-40.txt
+test_jp2a "color, palette png, flipx" "grind-80x60.png --color --flipx --width=60" grind-80x60-png-color-flipx.txt
+test_jp2a "height, plain pgm" "logo-40x25-gray.pgm --height=30" logo-30.txt
+test_jp2a "color, ppm" "grind-80x60.ppm --color --width=60" grind-80x60-ppm-color.txt
 test_jp2a "standard input, width" " 2>/dev/null ; cat jp2a.jpg | ${JP} --width=78 -" normal.txt
 test_jp2a "standard input, width, height" " 2>/dev/null ; cat jp2a.jpg | ${JP} - --width=40 --height=40" 40x40.txt
 test_jp2a "big size" "--size=2000x2000 dalsnuten-640x480-gray-low.jpg jp2a.jpg | tr -d '\r' | wc -c | tr -d ' '" dalsnuten-jp2a-2000x2000-md5.txt